@@ -65,7 +65,12 @@ using hotstuff::MsgRespCmd;
 using hotstuff::get_hash;
 using hotstuff::promise_t;
 
+#ifdef HOTSTUFF_BLS
+/* the keys are generated by hotstuff-keygen --algo bls */
+using HotStuff = hotstuff::HotStuffBLS;
+#else
 using HotStuff = hotstuff::HotStuffSecp256k1;
+#endif
 
 class HotStuffApp: public HotStuff {
     double stat_period;
@@ -131,7 +136,9 @@ class HotStuffApp: public HotStuff {
                 const EventContext &ec,
                 size_t nworker,
                 const Net::Config &repnet_config,
-                const ClientNetwork<opcode_t>::Config &clinet_config);
+                const ClientNetwork<opcode_t>::Config &clinet_config,
+                const hotstuff::Mempool::Config &mempool_config,
+                int vworker_cpu);
 
     void start(const std::vector<std::tuple<NetAddr, bytearray_t, bytearray_t>> &reps);
     void stop();
@@ -168,6 +175,7 @@ int main(int argc, char **argv) {
     auto opt_prop_delay = Config::OptValDouble::create(1);
     auto opt_imp_timeout = Config::OptValDouble::create(11);
     auto opt_nworker = Config::OptValInt::create(1);
+    auto opt_vworker_cpu = Config::OptValInt::create(-1);
     auto opt_repnworker = Config::OptValInt::create(1);
     auto opt_repburst = Config::OptValInt::create(100);
     auto opt_clinworker = Config::OptValInt::create(8);
@@ -175,6 +183,25 @@ int main(int argc, char **argv) {
     auto opt_notls = Config::OptValFlag::create(false);
     auto opt_max_rep_msg = Config::OptValInt::create(4 << 20); // 4M by default
     auto opt_max_cli_msg = Config::OptValInt::create(65536); // 64K by default
+    auto opt_mempool_max_cmds = Config::OptValInt::create(0);
+    auto opt_mempool_max_bytes = Config::OptValInt::create(0);
+    auto opt_mempool_client_quota = Config::OptValInt::create(0);
+    auto opt_no_vote_pipeline = Config::OptValFlag::create(false);
+    auto opt_prune_staleness = Config::OptValInt::create(100);
+    auto opt_blk_log = Config::OptValStr::create("");
+    auto opt_blk_log_sync = Config::OptValDouble::create(0.01);
+    auto opt_blk_range_chunk = Config::OptValInt::create(128);
+    auto opt_fetch_window = Config::OptValDouble::create(0.001);
+    auto opt_batch_size = Config::OptValInt::create(0);
+    auto opt_batch_timeout = Config::OptValDouble::create(0.005);
+    auto opt_ec_proposal = Config::OptValFlag::create(false);
+    auto opt_vote_fanin = Config::OptValInt::create(0);
+    auto opt_vote_agg_timeout = Config::OptValDouble::create(0.01);
+    auto opt_checkpoint_interval = Config::OptValInt::create(50);
+    auto opt_catchup_lag = Config::OptValInt::create(10);
+    auto opt_safety_log = Config::OptValStr::create("");
+    auto opt_safety_log_mode = Config::OptValStr::create("group");
+    auto opt_safety_log_direct = Config::OptValFlag::create(false);
 
     config.add_opt("block-size", opt_blk_size, Config::SET_VAL);
     config.add_opt("parent-limit", opt_parent_limit, Config::SET_VAL);
@@ -191,6 +218,7 @@ int main(int argc, char **argv) {
     config.add_opt("prop-delay", opt_prop_delay, Config::SET_VAL, 't', "set the delay that follows the timeout for the Round-Robin Pacemaker");
     config.add_opt("imp-timeout", opt_imp_timeout, Config::SET_VAL, 'u', "set impeachment timeout (for sticky)");
     config.add_opt("nworker", opt_nworker, Config::SET_VAL, 'n', "the number of threads for verification");
+    config.add_opt("vworker-cpu", opt_vworker_cpu, Config::SET_VAL, 'C', "pin verification threads to consecutive CPUs starting from this one (-1 to disable)");
     config.add_opt("repnworker", opt_repnworker, Config::SET_VAL, 'm', "the number of threads for replica network");
     config.add_opt("repburst", opt_repburst, Config::SET_VAL, 'b', "");
     config.add_opt("clinworker", opt_clinworker, Config::SET_VAL, 'M', "the number of threads for client network");
@@ -198,6 +226,25 @@ int main(int argc, char **argv) {
     config.add_opt("notls", opt_notls, Config::SWITCH_ON, 's', "disable TLS");
     config.add_opt("max-rep-msg", opt_max_rep_msg, Config::SET_VAL, 'S', "the maximum replica message size");
     config.add_opt("max-cli-msg", opt_max_cli_msg, Config::SET_VAL, 'S', "the maximum client message size");
+    config.add_opt("mempool-max-cmds", opt_mempool_max_cmds, Config::SET_VAL, 'Q', "the maximum number of pending commands at the proposer (0 for unlimited)");
+    config.add_opt("mempool-max-bytes", opt_mempool_max_bytes, Config::SET_VAL, 'Y', "the maximum size of pending commands at the proposer (0 for unlimited)");
+    config.add_opt("mempool-client-quota", opt_mempool_client_quota, Config::SET_VAL, 'q', "the maximum number of pending commands per client (0 for unlimited)");
+    config.add_opt("no-vote-pipeline", opt_no_vote_pipeline, Config::SWITCH_ON, 'P', "wait for the block delivery before checking the fairness and signing the vote");
+    config.add_opt("prune-staleness", opt_prune_staleness, Config::SET_VAL, 'R', "prune the blocks older than this many blocks below the last committed one (negative to disable)");
+    config.add_opt("blk-log", opt_blk_log, Config::SET_VAL, 'L', "persist the blocks to a log in this directory and recover from it on start (disabled if empty)");
+    config.add_opt("blk-log-sync", opt_blk_log_sync, Config::SET_VAL, 'G', "the interval (in seconds) of syncing the block log");
+    config.add_opt("blk-range-chunk", opt_blk_range_chunk, Config::SET_VAL, 'F', "fetch missing blocks as ranges in chunks of this many blocks (0 to fetch them one by one)");
+    config.add_opt("fetch-window", opt_fetch_window, Config::SET_VAL, 'w', "coalesce the block requests to a replica made within this many seconds");
+    config.add_opt("batch-size", opt_batch_size, Config::SET_VAL, 'X', "disseminate the client commands in certified batches of this many commands and order the batches (0 to disable)");
+    config.add_opt("batch-timeout", opt_batch_timeout, Config::SET_VAL, 'T', "send a partial batch after this many seconds");
+    config.add_opt("ec-proposal", opt_ec_proposal, Config::SWITCH_ON, 'E', "send the proposals as erasure-coded chunks relayed by the replicas");
+    config.add_opt("vote-fanin", opt_vote_fanin, Config::SET_VAL, 'A', "combine the votes along a tree of this fan-in rooted at the proposer (0 to send them directly); the orderings the votes carry are summarized on the way without signatures, so the aggregators are trusted not to alter those of their subtrees");
+    config.add_opt("vote-agg-timeout", opt_vote_agg_timeout, Config::SET_VAL, 'V', "how long (in seconds) a replica of the vote tree waits for each level below it");
+    config.add_opt("checkpoint-interval", opt_checkpoint_interval, Config::SET_VAL, 'K', "take a checkpoint of the committed state every this many blocks (0 to disable)");
+    config.add_opt("catchup-lag", opt_catchup_lag, Config::SET_VAL, 'J', "catch up from a checkpoint instead of fetching the blocks when falling behind by more than this many blocks");
+    config.add_opt("safety-log", opt_safety_log, Config::SET_VAL, 'W', "persist the safety state to this file before voting and recover from it on start (disabled if empty)");
+    config.add_opt("safety-log-mode", opt_safety_log_mode, Config::SET_VAL, 'D', "when votes wait for the safety log (sync, group, async)");
+    config.add_opt("safety-log-direct", opt_safety_log_direct, Config::SWITCH_ON, 'O', "write the safety log with O_DIRECT");
     config.add_opt("help", opt_help, Config::SWITCH_ON, 'h', "show this help info");
 
     EventContext ec;
@@ -264,6 +311,10 @@ int main(int argc, char **argv) {
     clinet_config
         .burst_size(opt_cliburst->get())
         .nworker(opt_clinworker->get());
+    hotstuff::Mempool::Config mempool_config;
+    mempool_config.max_cmds = opt_mempool_max_cmds->get();
+    mempool_config.max_bytes = opt_mempool_max_bytes->get();
+    mempool_config.client_quota = opt_mempool_client_quota->get();
     papp = new HotStuffApp(opt_blk_size->get(),
                         opt_stat_period->get(),
                         opt_imp_timeout->get(),
@@ -275,7 +326,33 @@ int main(int argc, char **argv) {
                         ec,
                         opt_nworker->get(),
                         repnet_config,
-                        clinet_config);
+                        clinet_config,
+                        mempool_config,
+                        opt_vworker_cpu->get());
+    papp->set_vote_pipeline(!opt_no_vote_pipeline->get());
+    papp->set_prune_staleness(opt_prune_staleness->get());
+    papp->set_blk_range_chunk(opt_blk_range_chunk->get());
+    papp->set_fetch_window(opt_fetch_window->get());
+    papp->set_batching(opt_batch_size->get(), opt_batch_timeout->get());
+    papp->set_ec_proposal(opt_ec_proposal->get());
+    papp->set_vote_aggregation(opt_vote_fanin->get(), opt_vote_agg_timeout->get());
+    papp->set_checkpoint(opt_checkpoint_interval->get(), opt_catchup_lag->get());
+    if (!opt_blk_log->get().empty())
+    {
+        hotstuff::BlockLog::Config blk_log_config;
+        blk_log_config.dir = opt_blk_log->get();
+        papp->enable_block_log(blk_log_config, opt_blk_log_sync->get());
+    }
+    if (!opt_safety_log->get().empty())
+    {
+        hotstuff::SafetyLog::Config safety_log_config;
+        safety_log_config.path = opt_safety_log->get();
+        if (!hotstuff::SafetyLog::parse_mode(opt_safety_log_mode->get(),
+                                            safety_log_config.mode))
+            throw HotStuffError("invalid safety log mode");
+        safety_log_config.direct = opt_safety_log_direct->get();
+        papp->enable_safety_log(safety_log_config);
+    }
     std::vector<std::tuple<NetAddr, bytearray_t, bytearray_t>> reps;
     for (auto &r: replicas)
     {
@@ -307,7 +384,9 @@ HotStuffApp::HotStuffApp(uint32_t blk_size,
                         const EventContext &ec,
                         size_t nworker,
                         const Net::Config &repnet_config,
-                        const ClientNetwork<opcode_t>::Config &clinet_config):
+                        const ClientNetwork<opcode_t>::Config &clinet_config,
+                        const hotstuff::Mempool::Config &mempool_config,
+                        int vworker_cpu):
     HotStuff(blk_size, idx, raw_privkey,
             plisten_addr, std::move(pmaker), ec, nworker, repnet_config),
     stat_period(stat_period),
@@ -315,6 +394,9 @@ HotStuffApp::HotStuffApp(uint32_t blk_size,
     ec(ec),
     cn(req_ec, clinet_config),
     clisten_addr(clisten_addr) {
+    mempool.set_config(mempool_config);
+    if (vworker_cpu >= 0 && !vpool.set_affinity(vworker_cpu))
+        HOTSTUFF_LOG_WARN("unable to set the affinity of verification threads");
     /* prepare the thread used for sending back confirmations */
     resp_tcall = new salticidae::ThreadCall(resp_ec);
     req_tcall = new salticidae::ThreadCall(req_ec);
@@ -339,25 +421,30 @@ HotStuffApp::HotStuffApp(uint32_t blk_size,
 
 void HotStuffApp::client_request_cmd_handler(MsgReqCmd &&msg, const conn_t &conn) {
     const NetAddr addr = conn->get_addr();
+    size_t nbytes = msg.serialized.size();
+    /* the command is passed on as is in a batch */
+    bytearray_t payload;
+    if (is_batching())
+        payload = bytearray_t(msg.serialized.data(), msg.serialized.data() + nbytes);
     auto cmd = parse_cmd(msg.serialized);
     const auto &cmd_hash = cmd->get_hash();
-    // adding command to the local storage and also recording the receive timestamp
-    if (command_timestamp_storage->is_new_command(cmd->get_hash()))
-    {
-        HOTSTUFF_LOG_PROTO("Adding command %s to storage", get_hex10(cmd->get_hash()).c_str());
-        command_timestamp_storage->add_command_to_storage(cmd->get_hash());
-    }
+    /* the receive timestamp is taken by exec_command on this thread, while
+     * command_timestamp_storage is only updated by the consensus thread */
     HOTSTUFF_LOG_DEBUG("processing %s", std::string(*cmd).c_str());
-    exec_command(cmd_hash, [this, addr](Finality fin) {
+    auto callback = [this, addr](Finality fin) {
         resp_queue.enqueue(std::make_pair(fin, addr));
-    });
+    };
+    if (is_batching())
+        exec_command(cmd_hash, addr, std::move(payload), std::move(callback));
+    else
+        exec_command(cmd_hash, addr, nbytes, std::move(callback));
 }
 
 void HotStuffApp::start(const std::vector<std::tuple<NetAddr, bytearray_t, bytearray_t>> &reps) {
     ev_stat_timer = TimerEvent(ec, [this](TimerEvent &) {
         HotStuff::print_stat();
         HotStuffApp::print_stat();
-        //HotStuffCore::prune(100);
+        reset_stat();
         ev_stat_timer.add(stat_period);
     });
     ev_stat_timer.add(stat_period);
@@ -437,22 +524,17 @@ void HotStuffApp::print_stat() const {
         {
             HOTSTUFF_LOG_PROTO("First -ts  is: %s", boost::lexical_cast<std::string>(ts).c_str());
         }
-        for (auto cmd : orderedlist_storage->get_cmds_for_second_one(vec[3]))
-        {
-            HOTSTUFF_LOG_PROTO("Second- cmd hash is: %s", get_hex10(cmd).c_str());
-        }
-        for (auto ts : orderedlist_storage->get_timestamps_for_second_one(vec[3]))
-        {
-            HOTSTUFF_LOG_PROTO("Second- ts  is: %s", boost::lexical_cast<std::string>(ts).c_str());
-        }
+        const auto &summary = orderedlist_storage->get_summary(vec[3]);
+        HOTSTUFF_LOG_PROTO("Summary - %u orderings over %lu cmds",
+                            summary.get_total(), summary.size());
     }
 
 	HOTSTUFF_LOG_INFO("successfully finishing command_timestamp_storage.");
     HOTSTUFF_LOG_INFO("--- writing command_timestamp_storage into a file. ---");
     std::ofstream outFile("command_timestamp_storage" + std::to_string(get_id()) + ".txt");
-    std::vector<uint256_t> cmd_hashes = command_timestamp_storage->get_all_cmd_hashes();
-    std::vector<uint64_t> timestamps = command_timestamp_storage->get_all_timestamps();
-    for (int i = 0; i <= cmd_hashes.size(); i++)
+    const auto &cmd_hashes = command_timestamp_storage->get_all_cmd_hashes();
+    const auto &timestamps = command_timestamp_storage->get_all_timestamps();
+    for (size_t i = 0; i < cmd_hashes.size(); i++)
     {
         outFile << get_hex10(cmd_hashes[i]).c_str() << " " << timestamps[i] << "\n"
                 << std::endl;
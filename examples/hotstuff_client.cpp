@@ -49,6 +49,10 @@ int max_iter_num;
 uint32_t cid;
 uint32_t cnt = 0;
 uint32_t nfaulty;
+/** the number of replicas each command is sent to */
+size_t nsend;
+/** the number of responses confirming a command */
+size_t nconfirm;
 
 struct Request
 {
@@ -77,10 +81,13 @@ bool try_send(bool check = true)
     // if ((!check || waiting.size() < max_async_num) && (max_iter_num > 0))
     if (!check || waiting.size() < max_async_num)
     {
-        auto cmd = new CommandDummy(cid, cnt++);
+        auto cmd = new CommandDummy(cid, cnt);
         MsgReqCmd msg(*cmd);
-        for (auto &p : conns)
-            mn.send_msg(msg, p.second);
+        /* spread the commands over the replicas when each goes to only a
+         * few of them (e.g. to the replicas batching them) */
+        for (size_t i = 0; i < nsend; i++)
+            mn.send_msg(msg, conns[(cnt + i) % replicas.size()]);
+        cnt++;
         HOTSTUFF_LOG_INFO("send new cmds %.10s",
                           get_hex(cmd->get_hash()).c_str());
         HOTSTUFF_LOG_INFO("max_iter_num %d",
@@ -100,12 +107,20 @@ void client_resp_cmd_handler(MsgRespCmd &&msg, const Net::conn_t &)
     HOTSTUFF_LOG_DEBUG("got %s", std::string(msg.fin).c_str());
     const uint256_t &cmd_hash = fin.cmd_hash;
     auto it = waiting.find(cmd_hash);
-    auto &et = it->second.et;
     if (it == waiting.end())
         return;
+    if (fin.decision == -1)
+    {
+        /* the proposer is overloaded, the command stays waiting for the
+         * confirmations from the other replicas */
+        HOTSTUFF_LOG_WARN("command %.10s rejected by replica %d",
+                          get_hex(cmd_hash).c_str(), fin.rid);
+        return;
+    }
+    auto &et = it->second.et;
     et.stop();
-    if (++it->second.confirmed <= nfaulty)
-        return; // wait for f + 1 ack
+    if (++it->second.confirmed < nconfirm)
+        return; // wait for f + 1 ack (or all of the replicas sent to)
 #ifndef HOTSTUFF_ENABLE_BENCHMARK
     HOTSTUFF_LOG_INFO("got %s, wall: %.3f, cpu: %.3f",
                       std::string(fin).c_str(),
@@ -139,6 +154,8 @@ int main(int argc, char **argv)
     auto opt_max_iter_num = Config::OptValInt::create(10000);
     auto opt_max_async_num = Config::OptValInt::create(10);
     auto opt_cid = Config::OptValInt::create(-1);
+    auto opt_nsend = Config::OptValInt::create(0);
+    auto opt_help = Config::OptValFlag::create(false);
 
     auto shutdown = [&](int) { ec.stop(); };
     salticidae::SigEvent ev_sigint(ec, shutdown);
@@ -154,8 +171,15 @@ int main(int argc, char **argv)
     config.add_opt("replica", opt_replicas, Config::APPEND);
     config.add_opt("iter", opt_max_iter_num, Config::SET_VAL);
     config.add_opt("max-async", opt_max_async_num, Config::SET_VAL);
+    config.add_opt("nsend", opt_nsend, Config::SET_VAL, 'n', "send each command to this many replicas (all if 0) and wait for min(f + 1, nsend) responses; below f + 1, a single faulty replica can confirm a command, so only use it for benchmarks");
+    config.add_opt("help", opt_help, Config::SWITCH_ON, 'h', "show this help info");
 
     config.parse(argc, argv);
+    if (opt_help->get())
+    {
+        config.print_help();
+        exit(0);
+    }
     auto idx = opt_idx->get();
 
     max_iter_num = opt_max_iter_num->get();
@@ -181,6 +205,9 @@ int main(int argc, char **argv)
 
     nfaulty = (replicas.size() - 1) / 3;
     HOTSTUFF_LOG_INFO("nfaulty = %zu", nfaulty);
+    nsend = opt_nsend->get() > 0 ? std::min((size_t)opt_nsend->get(), replicas.size()) :
+                                    replicas.size();
+    nconfirm = std::min((size_t)nfaulty + 1, nsend);
     connect_all();
     while (try_send());
     ec.dispatch();
@@ -122,37 +122,27 @@ class TopologyGraph
 //decide whether we should add an edge from cmd_j to cmd_i
 //if in more than threshold_number replicas, cmd_j is before cmd_i, then we'll add an edge
 //you can add the granularity "g" here if needed
-bool run_before(int j, int i, std::vector<hotstuff::OrderedList> &proposed_orderlist, int threshold_number)
+//the counts come from the summary of the orderings, so this does not depend on the number of replicas
+bool run_before(const uint256_t &cmd_j, const uint256_t &cmd_i, const hotstuff::PrecedenceMatrix &summary, int threshold_number)
 {
-    int n_replica = proposed_orderlist.size();
-    int n_cmds = proposed_orderlist[0].cmds.size();
-    int count = 0;
-    for(int ii = 0; ii < n_replica; ii++)
-    {
-        for(int jj = 0; jj < proposed_orderlist[ii].cmds.size(); jj++)
-        {
-            if(proposed_orderlist[ii].cmds[jj] == proposed_orderlist[0].cmds[j]) {count++; break;}
-            if(proposed_orderlist[ii].cmds[jj] == proposed_orderlist[0].cmds[i]) break;
-        }
-    }
-    if(count > threshold_number) return true;
-    return false;
+    return (int)summary.get_before(cmd_j, cmd_i) > threshold_number;
 }
 
-//proposed_orderlist[0] is the orderlist of the leader before the leader receive other replicas' ordered list
+//candidates is the orderlist of the leader before the leader receive other replicas' ordered list
+//summary merges the ordered lists of all the replicas (including the leader)
 //return a vector, which will be a list of orderedlist
 //"timestamps" in these returned orderedlist are useless, cmds in one orderedlist should be in one block
-hotstuff::LeaderProposedOrderedList aequitas_order(std::vector<hotstuff::OrderedList> &proposed_orderlist, double g)
+hotstuff::LeaderProposedOrderedList aequitas_order(hotstuff::OrderedList candidates, const hotstuff::PrecedenceMatrix &summary, double g)
 {
-    int n_replica = proposed_orderlist.size();
+    int n_replica = summary.get_total();
     if(n_replica == 0) 
         throw std::runtime_error("the number of replica is 0.");
-    int n_cmds = proposed_orderlist[0].cmds.size();
-    if(n_cmds == 0 || (n_cmds != proposed_orderlist[0].timestamps.size()))
+    int n_cmds = candidates.cmds.size();
+    if(n_cmds == 0 || (n_cmds != candidates.timestamps.size()))
         throw std::runtime_error("no cmds to be ordered or cmds not in the right form.");
     
     //sort all the cmds
-    for (int i = 0; i < n_replica; i++) proposed_orderlist[i].sort_cmds();
+    candidates.sort_cmds();
 
     //map the cmd to a number
     int distinct_cmd = 0;
@@ -163,16 +153,16 @@ hotstuff::LeaderProposedOrderedList aequitas_order(std::vector<hotstuff::Ordered
 
     for (int i = 0; i < n_cmds; i++)
     {
-        uint256_t cmd_i = proposed_orderlist[0].cmds[i];
+        uint256_t cmd_i = candidates.cmds[i];
         if (!map_cmd[cmd_i])
             map_cmd[cmd_i] = ++distinct_cmd, cmd_content.push_back(cmd_i);
         int ii = map_cmd[cmd_i];
         for (int j = 0; j < n_cmds; j++)
         {
-            uint256_t cmd_j = proposed_orderlist[0].cmds[j];
+            uint256_t cmd_j = candidates.cmds[j];
             if (!map_cmd[cmd_j]) map_cmd[cmd_j] = ++distinct_cmd, cmd_content.push_back(cmd_j);
             int jj = map_cmd[cmd_j];
-            if (j != i && run_before(j, i, proposed_orderlist, g * n_replica))
+            if (j != i && run_before(cmd_j, cmd_i, summary, g * n_replica))
             {
 
                 //add edge from jj to ii
@@ -229,6 +219,16 @@ hotstuff::LeaderProposedOrderedList aequitas_order(std::vector<hotstuff::Ordered
     return final_ordered_vector;
 }
 
+//proposed_orderlist[0] is the orderlist of the leader, the others are the ones of the replicas
+hotstuff::LeaderProposedOrderedList aequitas_order(std::vector<hotstuff::OrderedList> &proposed_orderlist, double g)
+{
+    if(proposed_orderlist.size() == 0) 
+        throw std::runtime_error("the number of replica is 0.");
+    hotstuff::PrecedenceMatrix summary;
+    for (const auto &list : proposed_orderlist) summary.add(list);
+    return aequitas_order(proposed_orderlist[0], summary, g);
+}
+
 }
 
 
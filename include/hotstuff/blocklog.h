@@ -0,0 +1,168 @@
+/**
+ * Copyright 2018 VMware
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _HOTSTUFF_BLOCKLOG_H
+#define _HOTSTUFF_BLOCKLOG_H
+
+#include <functional>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "hotstuff/type.h"
+
+namespace hotstuff {
+
+/** Append-only log of the delivered and committed blocks, used to rebuild
+ * the chain after a restart.
+ *
+ * The log is split into segment files (blk-00000000.log, ...). Each record
+ * has a 16-byte header (magic, type, payload length, CRC-32C) followed by
+ * the 32-byte block hash and, for a block record, the serialized block.
+ * Appends are buffered and made durable in batches (group commit): the
+ * buffered records are handed over by start_flush(), written and synced by
+ * write_inflight() (which may run on a worker thread) and accounted by
+ * finish_flush(). On recovery, the segments are memory-mapped and scanned
+ * in order, the hash index is rebuilt, and a torn record at the tail (from
+ * a crash in the middle of a write) is truncated.
+ *
+ * Segments are never retired, so the log and its index grow with the
+ * chain. */
+class BlockLog {
+    public:
+    enum RecordType: uint8_t {
+        REC_BLOCK = 1,  /**< a delivered block */
+        REC_COMMIT = 2  /**< a committed block (only the hash) */
+    };
+
+    struct Config {
+        /** the directory holding the segments */
+        std::string dir;
+        /** the size after which a new segment is started */
+        size_t segment_size;
+        /** the amount of buffered records that triggers a sync */
+        size_t sync_bytes;
+        Config(): segment_size(64 << 20), sync_bytes(1 << 20) {}
+    };
+
+    /** Called for each recovered record with the block hash and the payload
+     * (the serialized block for REC_BLOCK, empty for REC_COMMIT). */
+    using recover_cb_t = std::function<void(RecordType type,
+                                            const uint256_t &blk_hash,
+                                            const uint8_t *data, size_t len)>;
+
+    private:
+    static const uint32_t magic = 0x48534c47; /* "HSLG" */
+    static const size_t header_size = 16;
+
+    struct Location {
+        uint32_t seg;
+        uint32_t off;   /**< offset of the record in the segment */
+        uint32_t len;   /**< length of the serialized block */
+    };
+
+    /** buffered records in one segment */
+    struct Chunk {
+        uint32_t seg;
+        uint64_t off;   /**< offset of the first record in the segment */
+        bytearray_t data;
+    };
+
+    Config config;
+    /* the open segment (only used by write_inflight() during a flush) */
+    int fd;
+    uint32_t fd_seg;
+    /** the segment being appended to, and its size with the buffered
+     * records */
+    uint32_t seg_id;
+    uint64_t seg_size;
+    /** records not yet handed over */
+    std::vector<Chunk> pending;
+    size_t pending_bytes;
+    /** records being written by write_inflight() */
+    std::vector<Chunk> inflight;
+    bool flushing;
+    /** set once a flush fails: the log ends at the last durable record */
+    bool failed;
+    /** where each block is in the log */
+    std::unordered_map<uint256_t, Location> index;
+
+    /* statistics */
+    uint64_t nrecord;
+    uint64_t nsync;
+    uint64_t nsync_bytes;
+
+    std::string seg_path(uint32_t id) const;
+    void open_segment(uint32_t id, uint64_t size);
+    void sync_dir() const;
+    uint64_t scan_segment(uint32_t id, const recover_cb_t &cb);
+    void append(RecordType type, const uint256_t &blk_hash,
+                const uint8_t *data, size_t len);
+
+    public:
+    BlockLog(const Config &config);
+    ~BlockLog();
+
+    BlockLog(const BlockLog &) = delete;
+    BlockLog &operator=(const BlockLog &) = delete;
+
+    /** Scan the existing log in order (calling cb for each record), rebuild
+     * the index and open the log for appending. Must be called once before
+     * any append.
+     * @return the number of records */
+    size_t recover(const recover_cb_t &cb);
+
+    void append_blk(const uint256_t &blk_hash, const uint8_t *data, size_t len) {
+        append(REC_BLOCK, blk_hash, data, len);
+    }
+
+    void append_commit(const uint256_t &blk_hash) {
+        append(REC_COMMIT, blk_hash, nullptr, 0);
+    }
+
+    /** Whether enough records are buffered to start a flush. */
+    bool need_flush() const { return pending_bytes >= config.sync_bytes; }
+
+    /** Hand the buffered records over to write_inflight().
+     * @return false if there is nothing to flush or a flush is in progress */
+    bool start_flush();
+
+    /** Write the records handed over and wait until they are durable. It
+     * only touches the file and those records, so it may run on a worker
+     * thread between start_flush() and finish_flush(). Throws on failure. */
+    void write_inflight();
+
+    /** Account the records handed over as durable (or give up the log if
+     * ok is false: later appends throw). */
+    void finish_flush(bool ok);
+    /** Whether a flush failed, so that the records from then on are lost
+     * (the replica must not go on as if they were durable). */
+    bool is_failed() const { return failed; }
+
+    /** Write the buffered records and wait until they are durable, on the
+     * calling thread (no flush may be in progress). */
+    void sync();
+
+    bool has_blk(const uint256_t &blk_hash) const { return index.count(blk_hash); }
+    /** Read back the serialized block. */
+    bool read_blk(const uint256_t &blk_hash, bytearray_t &out) const;
+    size_t size() const { return index.size(); }
+    void print_stat() const;
+};
+
+}
+
+#endif
@@ -0,0 +1,44 @@
+/**
+ * Copyright 2018 VMware
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _HOTSTUFF_CLOCK_H
+#define _HOTSTUFF_CLOCK_H
+
+#include <cstdint>
+#include <ctime>
+
+namespace hotstuff {
+
+/** Monotonic clock with nanosecond resolution for stamping commands.
+ * Unlike gettimeofday(), the readings only move forward and are not stepped
+ * by NTP, so two stamps taken on the same host can always be compared. The
+ * readings are not meaningful across hosts. */
+class MonotonicClock {
+    public:
+    static uint64_t now_ns() {
+        struct timespec ts;
+#ifdef CLOCK_MONOTONIC_RAW
+        clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+#else
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+#endif
+        return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+    }
+};
+
+}
+
+#endif
@@ -19,6 +19,7 @@
 #define _HOTSTUFF_CONSENSUS_H
 
 #include <cassert>
+#include <queue>
 #include <set>
 #include <unordered_map>
 #include <boost/lexical_cast.hpp>
@@ -45,8 +46,22 @@ class HotStuffCore {
     block_t b_lock;                            /**< locked block */
     block_t b_exec;                            /**< last executed block */
     uint32_t vheight;          /**< height of the block last voted for */
+    /** the lock recovered from the safety log while its block is missing
+     * (recovered_lock_height is 0 if there is none): until the block is
+     * delivered, only the proposals whose QC is above it are voted for */
+    uint256_t recovered_lock;
+    uint32_t recovered_lock_height;
     /* === auxilliary variables === */
     std::set<block_t> tails;   /**< set of tail blocks */
+    /** delivered blocks in the delivery order, to be pruned */
+    std::queue<block_t> prune_queue;
+    /** pruned blocks still referred elsewhere, to be released later */
+    std::vector<block_t> prune_retry;
+    /** staleness for pruning after each commit (negative to disable) */
+    int32_t prune_staleness;
+    /** height of the last installed checkpoint (the blocks below it are not
+     * committed through the chain) */
+    uint32_t checkpoint_height;
     ReplicaConfig config;                   /**< replica configuration */
     /* === async event queues === */
     std::unordered_map<block_t, promise_t> qc_waiting;
@@ -56,16 +71,24 @@ class HotStuffCore {
     /* == feature switches == */
     /** always vote negatively, useful for some PaceMakers */
     bool vote_disabled;
-    uint64_t delta_max = 1; /** a bound on network delay */
+    uint64_t delta_max = 1000; /** a bound on network delay (in nanoseconds) */
+    /** vote certificates signed ahead of their use (by the block hash) */
+    std::unordered_map<uint256_t, part_cert_bt> signed_ahead;
+    std::queue<uint256_t> signed_ahead_queue;
+    size_t signed_ahead_max = 256; /** the bound on unused signed-ahead certificates */
 
     block_t get_delivered_blk(const uint256_t &blk_hash);
     void sanity_check_delivered(const block_t &blk);
     void update(const block_t &nblk);
     void update_hqc(const block_t &_hqc, const quorum_cert_bt &qc);
+    /** Replace the recovered lock by its block once delivered, or drop it
+     * once a higher block is locked. */
+    void resolve_recovered_lock();
     void on_hqc_update();
     void on_qc_finish(const block_t &blk);
     void on_propose_(const Proposal &prop);
     void on_receive_proposal_(const Proposal &prop);
+    bool release_blk(const block_t &blk);
 
     protected:
     privkey_bt priv_key;            /**< private key for signing votes */
@@ -107,10 +130,23 @@ class HotStuffCore {
     // bool acceptable_fairness_check(const std::vector<uint64_t> check_timestamps, uint64_t delta_max) const;
     bool acceptable_fairness_check(const std::vector<std::vector<uint64_t>> check_timestamps, uint64_t delta_max) const;
 
+    /** Check whether the proposed ordering of a block is acceptable, taking
+     * the commands not seen before as arriving at `now`. It has no side
+     * effects, so it can be done before the block is delivered. */
+    bool check_proposal_fairness(const block_t &blk, uint64_t now) const;
+
+    /** Record the commands first seen in a proposed block as arriving at
+     * `now`. The block should be already delivered. */
+    void record_proposal_cmds(const block_t &blk, uint64_t now);
+
     /** Call upon the delivery of a proposal message.
      * The block mentioned in the message should be already delivered. */
     void on_receive_proposal(const Proposal &prop);
 
+    /** Same as on_receive_proposal(prop), but with the result of
+     * check_proposal_fairness() already known. */
+    void on_receive_proposal(const Proposal &prop, bool fair);
+
     /** Call upon the delivery of a vote message.
      * The block mentioned in the message should be already delivered. */
     void on_receive_vote(const Vote &vote);
@@ -133,6 +169,8 @@ class HotStuffCore {
     protected:
     /** Called by HotStuffCore upon the decision being made for cmd. */
     virtual void do_decide(Finality &&fin) = 0;
+    /** Called by HotStuffCore upon a block being committed, after all its
+     * commands are decided. */
     virtual void do_consensus(const block_t &blk) = 0;
     /** Called by HotStuffCore upon broadcasting a new proposal.
      * The user should send the proposal message to all replicas except for
@@ -148,6 +186,20 @@ class HotStuffCore {
     public:
     /** Create a partial certificate that proves the vote for a block. */
     virtual part_cert_bt create_part_cert(const PrivKey &priv_key, const uint256_t &blk_hash) = 0;
+    /** Start creating the partial certificate for a block so that a later
+     * take_part_cert() does not sign on the calling thread. The returned
+     * promise is resolved once the certificate is ready. The default
+     * implementation signs in place. */
+    virtual promise_t async_create_part_cert(const uint256_t &blk_hash);
+    /** Keep a partial certificate signed ahead for a block. */
+    void add_signed_ahead(const uint256_t &blk_hash, part_cert_bt &&cert);
+    /** Take the partial certificate signed ahead for a block, or sign it now
+     * if there is none. */
+    part_cert_bt take_part_cert(const uint256_t &blk_hash);
+    /** Make the safety state (see get_safety_state()) durable. A vote is
+     * only sent once the returned promise is resolved. The default
+     * implementation does not persist anything. */
+    virtual promise_t async_persist_safety();
     /** Create a partial certificate from its seralized form. */
     virtual part_cert_bt parse_part_cert(DataStream &s) = 0;
     /** Create a quorum certificate that proves 2f+1 votes for a block. */
@@ -161,8 +213,29 @@ class HotStuffCore {
     /** Add a replica to the current configuration. This should only be called
      * before running HotStuffCore protocol. */
     void add_replica(ReplicaID rid, const PeerId &peer_id, pubkey_bt &&pub_key);
-    /** Try to prune blocks lower than last committed height - staleness. */
+    /** Try to prune blocks lower than last committed height - staleness.
+     * Only the blocks delivered since the last call are visited. */
     void prune(uint32_t staleness);
+    /** Restore a block committed before a restart, without executing it
+     * again. Blocks must be restored in the commit order. */
+    void on_recover_commit(const block_t &blk);
+    /** Serialize the state that must survive a restart for safety: vheight,
+     * b_lock (its hash and height) and hqc (with its QC). */
+    void get_safety_state(DataStream &s) const;
+    /** Restore the state written by get_safety_state() before a restart.
+     * The blocks it refers to should be recovered first; a locked block
+     * that is missing is enforced by its height until it is fetched. */
+    void on_recover_safety(DataStream &s);
+    /** Install a committed block received in a checkpoint as the new root
+     * of the chain, skipping (and never executing) its ancestors. The
+     * height is not part of the block, and qc certifies the block; both, and
+     * the commit of the block, must be verified by the caller. */
+    void on_install_checkpoint(const block_t &blk, uint32_t height,
+                                const quorum_cert_bt &qc);
+    /** Prune automatically after each commit with the given staleness
+     * (negative to disable). */
+    void set_prune_staleness(int32_t staleness) { prune_staleness = staleness; }
+    int32_t get_prune_staleness() const { return prune_staleness; }
 
     /* PaceMaker can use these functions to monitor the core protocol state
      * transition */
@@ -178,6 +251,7 @@ class HotStuffCore {
     /* Other useful functions */
     const block_t &get_genesis() const { return b0; }
     const block_t &get_hqc() { return hqc.first; }
+    const block_t &get_b_exec() const { return b_exec; }
     const ReplicaConfig &get_config() const { return config; }
     ReplicaID get_id() const { return id; }
     const std::set<block_t> get_tails() const { return tails; }
@@ -224,7 +298,9 @@ struct Proposal: public Serializable {
 };
 
 /** Abstraction for vote messages. */
-struct Vote : public Serializable
+/** Votes received from the network are pool-allocated and shared through
+ * vote_t while being verified. */
+struct Vote : public Serializable, public IntrusiveRefCounted, public PoolAllocated<Vote>
 {
     ReplicaID voter;
     /** block being voted */
@@ -325,6 +401,8 @@ struct Vote : public Serializable
 };
 
 
+using vote_t = IntrusiveArc<Vote>;
+
 struct Finality : public Serializable
 {
     ReplicaID rid;
@@ -17,6 +17,7 @@
 #ifndef _HOTSTUFF_CRYPTO_H
 #define _HOTSTUFF_CRYPTO_H
 
+#include <atomic>
 #include <openssl/rand.h>
 
 #include "secp256k1.h"
@@ -142,15 +143,18 @@ class QuorumCertDummy: public QuorumCert {
 };
 
 
+/** A secp256k1 context with its precomputed tables. Signing and verification
+ * use the per-thread contexts returned by get_sign() and get_verify(), so
+ * threads (the event loop, VeriPool workers, the signer) never share a
+ * context nor the reference count of one. */
 class Secp256k1Context {
     secp256k1_context *ctx;
-    friend class PubKeySecp256k1;
-    friend class SigSecp256k1;
+    static std::atomic<bool> randomize_sign;
+
     public:
-    Secp256k1Context(bool sign = false):
-        ctx(secp256k1_context_create(
-            sign ? SECP256K1_CONTEXT_SIGN :
-                    SECP256K1_CONTEXT_VERIFY)) {}
+    /** Create a context, randomized for blinding if randomize is set (only
+     * applies to a signing context). */
+    Secp256k1Context(bool sign = false, bool randomize = false);
 
     Secp256k1Context(const Secp256k1Context &) = delete;
 
@@ -161,12 +165,17 @@ class Secp256k1Context {
     ~Secp256k1Context() {
         if (ctx) secp256k1_context_destroy(ctx);
     }
-};
 
-using secp256k1_context_t = ArcObj<Secp256k1Context>;
+    const secp256k1_context *get() const { return ctx; }
 
-extern secp256k1_context_t secp256k1_default_sign_ctx;
-extern secp256k1_context_t secp256k1_default_verify_ctx;
+    /** Get the signing context of the calling thread. */
+    static const secp256k1_context *get_sign();
+    /** Get the verification context of the calling thread. */
+    static const secp256k1_context *get_verify();
+    /** Set whether the signing contexts created from now on are randomized
+     * (enabled by default). */
+    static void set_randomize(bool enabled) { randomize_sign = enabled; }
+};
 
 class PrivKeySecp256k1;
 
@@ -174,36 +183,33 @@ class PubKeySecp256k1: public PubKey {
     static const auto _olen = 33;
     friend class SigSecp256k1;
     secp256k1_pubkey data;
-    secp256k1_context_t ctx;
 
     public:
-    PubKeySecp256k1(const secp256k1_context_t &ctx =
-                            secp256k1_default_sign_ctx):
-        PubKey(), ctx(ctx) {}
-    
-    PubKeySecp256k1(const bytearray_t &raw_bytes,
-                    const secp256k1_context_t &ctx =
-                            secp256k1_default_sign_ctx):
-        PubKeySecp256k1(ctx) { from_bytes(raw_bytes); }
-
-    inline PubKeySecp256k1(const PrivKeySecp256k1 &priv_key,
-                            const secp256k1_context_t &ctx =
-                                    secp256k1_default_sign_ctx);
+    PubKeySecp256k1(): PubKey() {}
 
+    PubKeySecp256k1(const bytearray_t &raw_bytes):
+        PubKeySecp256k1() { from_bytes(raw_bytes); }
+
+    inline PubKeySecp256k1(const PrivKeySecp256k1 &priv_key);
+
+    /* Serialization writes straight into the stream (no shared scratch
+     * buffer), so keys and signatures can be encoded by any thread. */
     void serialize(DataStream &s) const override {
-        static uint8_t output[_olen];
         size_t olen = _olen;
+        size_t pos = s.size();
+        s.resize(pos + _olen);
         (void)secp256k1_ec_pubkey_serialize(
-                ctx->ctx, (unsigned char *)output,
+                Secp256k1Context::get_verify(),
+                (unsigned char *)s.data() + pos,
                 &olen, &data, SECP256K1_EC_COMPRESSED);
-        s.put_data(output, output + _olen);
     }
 
     void unserialize(DataStream &s) override {
         static const auto _exc = std::invalid_argument("ill-formed public key");
         try {
             if (!secp256k1_ec_pubkey_parse(
-                    ctx->ctx, &data, s.get_data_inplace(_olen), _olen))
+                    Secp256k1Context::get_verify(),
+                    &data, s.get_data_inplace(_olen), _olen))
                 throw _exc;
         } catch (std::ios_base::failure &) {
             throw _exc;
@@ -220,17 +226,12 @@ class PrivKeySecp256k1: public PrivKey {
     friend class PubKeySecp256k1;
     friend class SigSecp256k1;
     uint8_t data[nbytes];
-    secp256k1_context_t ctx;
 
     public:
-    PrivKeySecp256k1(const secp256k1_context_t &ctx =
-                            secp256k1_default_sign_ctx):
-        PrivKey(), ctx(ctx) {}
+    PrivKeySecp256k1(): PrivKey() {}
 
-    PrivKeySecp256k1(const bytearray_t &raw_bytes,
-                     const secp256k1_context_t &ctx =
-                            secp256k1_default_sign_ctx):
-        PrivKeySecp256k1(ctx) { from_bytes(raw_bytes); }
+    PrivKeySecp256k1(const bytearray_t &raw_bytes):
+        PrivKeySecp256k1() { from_bytes(raw_bytes); }
 
     void serialize(DataStream &s) const override {
         s.put_data(data, data + nbytes);
@@ -254,19 +255,18 @@ class PrivKeySecp256k1: public PrivKey {
 };
 
 pubkey_bt PrivKeySecp256k1::get_pubkey() const {
-    return new PubKeySecp256k1(*this, ctx);
+    return new PubKeySecp256k1(*this);
 }
 
 PubKeySecp256k1::PubKeySecp256k1(
-        const PrivKeySecp256k1 &priv_key,
-        const secp256k1_context_t &ctx): PubKey(), ctx(ctx) {
-    if (!secp256k1_ec_pubkey_create(ctx->ctx, &data, priv_key.data))
+        const PrivKeySecp256k1 &priv_key): PubKey() {
+    if (!secp256k1_ec_pubkey_create(
+            Secp256k1Context::get_sign(), &data, priv_key.data))
         throw std::invalid_argument("invalid secp256k1 private key");
 }
 
 class SigSecp256k1: public Serializable {
     secp256k1_ecdsa_signature data;
-    secp256k1_context_t ctx;
 
     static void check_msg_length(const bytearray_t &msg) {
         if (msg.size() != 32)
@@ -274,30 +274,28 @@ class SigSecp256k1: public Serializable {
     }
 
     public:
-    SigSecp256k1(const secp256k1_context_t &ctx =
-                        secp256k1_default_sign_ctx):
-        Serializable(), ctx(ctx) {}
+    SigSecp256k1(): Serializable() {}
     SigSecp256k1(const uint256_t &digest,
-                const PrivKeySecp256k1 &priv_key,
-                secp256k1_context_t &ctx =
-                        secp256k1_default_sign_ctx):
-        Serializable(), ctx(ctx) {
+                const PrivKeySecp256k1 &priv_key):
+        Serializable() {
         sign(digest, priv_key);
     }
 
     void serialize(DataStream &s) const override {
-        static uint8_t output[64];
+        size_t pos = s.size();
+        s.resize(pos + 64);
         (void)secp256k1_ecdsa_signature_serialize_compact(
-            ctx->ctx, (unsigned char *)output,
+            Secp256k1Context::get_verify(),
+            (unsigned char *)s.data() + pos,
             &data);
-        s.put_data(output, output + 64);
     }
 
     void unserialize(DataStream &s) override {
         static const auto _exc = std::invalid_argument("ill-formed signature");
         try {
             if (!secp256k1_ecdsa_signature_parse_compact(
-                    ctx->ctx, &data, s.get_data_inplace(64)))
+                    Secp256k1Context::get_verify(),
+                    &data, s.get_data_inplace(64)))
                 throw _exc;
         } catch (std::ios_base::failure &) {
             throw _exc;
@@ -307,7 +305,7 @@ class SigSecp256k1: public Serializable {
     void sign(const bytearray_t &msg, const PrivKeySecp256k1 &priv_key) {
         check_msg_length(msg);
         if (!secp256k1_ecdsa_sign(
-                ctx->ctx, &data,
+                Secp256k1Context::get_sign(), &data,
                 (unsigned char *)&*msg.begin(),
                 (unsigned char *)priv_key.data,
                 NULL, // default nonce function
@@ -315,23 +313,21 @@ class SigSecp256k1: public Serializable {
             throw std::invalid_argument("failed to create secp256k1 signature");
     }
 
-    bool verify(const bytearray_t &msg, const PubKeySecp256k1 &pub_key,
-                const secp256k1_context_t &_ctx) const {
+    bool verify(const bytearray_t &msg, const PubKeySecp256k1 &pub_key) const {
         check_msg_length(msg);
         return secp256k1_ecdsa_verify(
-                _ctx->ctx, &data,
+                Secp256k1Context::get_verify(), &data,
                 (unsigned char *)&*msg.begin(),
                 &pub_key.data) == 1;
     }
-
-    bool verify(const bytearray_t &msg, const PubKeySecp256k1 &pub_key) {
-        return verify(msg, pub_key, ctx);
-    }
 };
 
-class Secp256k1VeriTask: public VeriTask {
+/** The public key is referenced rather than copied, so it must outlive the
+ * task (as the keys held by ReplicaConfig do). Tasks are pool-allocated, as
+ * one is submitted for each vote. */
+class Secp256k1VeriTask: public VeriTask, public PoolAllocated<Secp256k1VeriTask> {
     uint256_t msg;
-    PubKeySecp256k1 pubkey;
+    const PubKeySecp256k1 &pubkey;
     SigSecp256k1 sig;
     public:
     Secp256k1VeriTask(const uint256_t &msg,
@@ -341,7 +337,34 @@ class Secp256k1VeriTask: public VeriTask {
     virtual ~Secp256k1VeriTask() = default;
 
     bool verify() override {
-        return sig.verify(msg, pubkey, secp256k1_default_verify_ctx);
+        return sig.verify(msg, pubkey);
+    }
+};
+
+/** Verifies all signatures of a quorum certificate in one worker invocation,
+ * so that a QC costs a single round-trip through VeriPool. As with
+ * Secp256k1VeriTask, the public keys must outlive the task. */
+class Secp256k1QCVeriTask: public VeriTask, public PoolAllocated<Secp256k1QCVeriTask> {
+    bytearray_t msg;
+    std::vector<const PubKeySecp256k1 *> pubkeys;
+    std::vector<SigSecp256k1> sigs;
+    public:
+    Secp256k1QCVeriTask(const uint256_t &msg, size_t nsigs = 0): msg(msg) {
+        pubkeys.reserve(nsigs);
+        sigs.reserve(nsigs);
+    }
+    virtual ~Secp256k1QCVeriTask() = default;
+
+    void add(const PubKeySecp256k1 &pubkey, const SigSecp256k1 &sig) {
+        pubkeys.push_back(&pubkey);
+        sigs.push_back(sig);
+    }
+
+    bool verify() override {
+        for (size_t i = 0; i < sigs.size(); i++)
+            if (!sigs[i].verify(msg, *pubkeys[i]))
+                return false;
+        return true;
     }
 };
 
@@ -357,14 +380,25 @@ class PartCertSecp256k1: public SigSecp256k1, public PartCert {
 
     bool verify(const PubKey &pub_key) override {
         return SigSecp256k1::verify(obj_hash,
-                                    static_cast<const PubKeySecp256k1 &>(pub_key),
-                                    secp256k1_default_verify_ctx);
+                                    static_cast<const PubKeySecp256k1 &>(pub_key));
     }
 
     promise_t verify(const PubKey &pub_key, VeriPool &vpool) override {
+        /* the digest covers the signed hash, the signature and the signer */
+        DataStream s;
+        serialize(s);
+        pub_key.serialize(s);
+        auto digest = s.get_hash();
+        auto cache = &vpool.get_part_cache();
+        if (cache->lookup(digest))
+            return promise_t([](promise_t &pm) { pm.resolve(true); });
         return vpool.verify(new Secp256k1VeriTask(obj_hash,
                 static_cast<const PubKeySecp256k1 &>(pub_key),
-                static_cast<const SigSecp256k1 &>(*this)));
+                static_cast<const SigSecp256k1 &>(*this)))
+            .then([cache, digest](bool result) {
+                if (result) cache->insert(digest);
+                return result;
+            });
     }
 
     const uint256_t &get_obj_hash() const override { return obj_hash; }
@@ -0,0 +1,322 @@
+/**
+ * Copyright 2018 VMware
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _HOTSTUFF_CRYPTO_BLS_H
+#define _HOTSTUFF_CRYPTO_BLS_H
+
+#include "blst.h"
+#include "hotstuff/crypto.h"
+
+namespace hotstuff {
+
+/* BLS signatures over BLS12-381 (public keys in G1, signatures in G2), with
+ * the ciphersuites of the proof-of-possession scheme */
+static const char bls_sig_dst[] = "BLS_SIG_BLS12381G2_XMD:SHA-256_SSWU_RO_POP_";
+static const char bls_pop_dst[] = "BLS_POP_BLS12381G2_XMD:SHA-256_SSWU_RO_POP_";
+
+class PrivKeyBLS;
+
+/** A BLS public key together with the proof of possession of its secret key
+ * (the key signed by itself). The proof is checked whenever a key is parsed:
+ * the signatures of a QC are checked against the sum of the signers' keys,
+ * which is only sound if nobody could pick a key canceling out the others. */
+class PubKeyBLS: public PubKey {
+    static const auto _olen = 48;
+    static const auto _poplen = 96;
+    friend class SigBLS;
+    blst_p1_affine data;
+    blst_p2_affine pop;
+
+    public:
+    PubKeyBLS(): PubKey() {}
+
+    PubKeyBLS(const bytearray_t &raw_bytes):
+        PubKeyBLS() { from_bytes(raw_bytes); }
+
+    inline PubKeyBLS(const PrivKeyBLS &priv_key);
+
+    void serialize(DataStream &s) const override {
+        size_t pos = s.size();
+        s.resize(pos + _olen + _poplen);
+        blst_p1_affine_compress((byte *)s.data() + pos, &data);
+        blst_p2_affine_compress((byte *)s.data() + pos + _olen, &pop);
+    }
+
+    void unserialize(DataStream &s) override {
+        static const auto _exc = std::invalid_argument("ill-formed public key");
+        try {
+            const byte *raw = s.get_data_inplace(_olen);
+            if (blst_p1_uncompress(&data, raw) != BLST_SUCCESS ||
+                blst_p1_affine_is_inf(&data) ||
+                !blst_p1_affine_in_g1(&data))
+                throw _exc;
+            if (blst_p2_uncompress(&pop, s.get_data_inplace(_poplen)) != BLST_SUCCESS ||
+                blst_core_verify_pk_in_g1(&data, &pop, true, raw, _olen,
+                    (const byte *)bls_pop_dst, sizeof(bls_pop_dst) - 1,
+                    nullptr, 0) != BLST_SUCCESS)
+                throw _exc;
+        } catch (std::ios_base::failure &) {
+            throw _exc;
+        }
+    }
+
+    const blst_p1_affine &get_point() const { return data; }
+
+    PubKeyBLS *clone() override {
+        return new PubKeyBLS(*this);
+    }
+};
+
+class PrivKeyBLS: public PrivKey {
+    static const auto nbytes = 32;
+    friend class PubKeyBLS;
+    friend class SigBLS;
+    blst_scalar data;
+
+    public:
+    PrivKeyBLS(): PrivKey() {}
+
+    PrivKeyBLS(const bytearray_t &raw_bytes):
+        PrivKeyBLS() { from_bytes(raw_bytes); }
+
+    void serialize(DataStream &s) const override {
+        size_t pos = s.size();
+        s.resize(pos + nbytes);
+        blst_bendian_from_scalar((byte *)s.data() + pos, &data);
+    }
+
+    void unserialize(DataStream &s) override {
+        static const auto _exc = std::invalid_argument("ill-formed private key");
+        try {
+            blst_scalar_from_bendian(&data, s.get_data_inplace(nbytes));
+            if (!blst_sk_check(&data)) throw _exc;
+        } catch (std::ios_base::failure &) {
+            throw _exc;
+        }
+    }
+
+    void from_rand() override {
+        uint8_t ikm[nbytes];
+        if (!RAND_bytes(ikm, nbytes))
+            throw std::runtime_error("cannot get rand bytes from openssl");
+        blst_keygen(&data, ikm, nbytes, nullptr, 0);
+    }
+
+    inline pubkey_bt get_pubkey() const override;
+};
+
+class SigBLS: public Serializable {
+    static const auto _olen = 96;
+    blst_p2_affine data;
+
+    public:
+    /* all zeros is the point at infinity (e.g. the genesis QC, which has
+     * no signer) */
+    SigBLS(): Serializable(), data() {}
+    SigBLS(const uint256_t &digest, const PrivKeyBLS &priv_key):
+        Serializable() {
+        sign(digest, priv_key);
+    }
+
+    void serialize(DataStream &s) const override {
+        size_t pos = s.size();
+        s.resize(pos + _olen);
+        blst_p2_affine_compress((byte *)s.data() + pos, &data);
+    }
+
+    void unserialize(DataStream &s) override {
+        static const auto _exc = std::invalid_argument("ill-formed signature");
+        try {
+            if (blst_p2_uncompress(&data, s.get_data_inplace(_olen)) != BLST_SUCCESS)
+                throw _exc;
+        } catch (std::ios_base::failure &) {
+            throw _exc;
+        }
+    }
+
+    static void sign(blst_p2_affine &out, const byte *msg, size_t len,
+                    const char *dst, size_t dst_len, const blst_scalar &sk) {
+        blst_p2 hash, sig;
+        blst_hash_to_g2(&hash, msg, len, (const byte *)dst, dst_len, nullptr, 0);
+        blst_sign_pk_in_g1(&sig, &hash, &sk);
+        blst_p2_to_affine(&out, &sig);
+    }
+
+    void sign(const bytearray_t &msg, const PrivKeyBLS &priv_key) {
+        sign(data, msg.data(), msg.size(),
+            bls_sig_dst, sizeof(bls_sig_dst) - 1, priv_key.data);
+    }
+
+    /** Verify the signature of the message against a (possibly aggregated)
+     * public key. */
+    static bool verify(const blst_p2_affine &sig, const bytearray_t &msg,
+                        const blst_p1_affine &pubkey) {
+        return blst_core_verify_pk_in_g1(&pubkey, &sig, true,
+                    msg.data(), msg.size(),
+                    (const byte *)bls_sig_dst, sizeof(bls_sig_dst) - 1,
+                    nullptr, 0) == BLST_SUCCESS;
+    }
+
+    bool verify(const bytearray_t &msg, const PubKeyBLS &pub_key) const {
+        return verify(data, msg, pub_key.data);
+    }
+
+    const blst_p2_affine &get_point() const { return data; }
+    void set_point(const blst_p2_affine &point) { data = point; }
+};
+
+pubkey_bt PrivKeyBLS::get_pubkey() const {
+    return new PubKeyBLS(*this);
+}
+
+PubKeyBLS::PubKeyBLS(const PrivKeyBLS &priv_key): PubKey() {
+    blst_p1 pk;
+    blst_sk_to_pk_in_g1(&pk, &priv_key.data);
+    blst_p1_to_affine(&data, &pk);
+    byte raw[_olen];
+    blst_p1_affine_compress(raw, &data);
+    SigBLS::sign(pop, raw, _olen,
+                bls_pop_dst, sizeof(bls_pop_dst) - 1, priv_key.data);
+}
+
+/** As Secp256k1VeriTask, the public key must outlive the task. */
+class BLSVeriTask: public VeriTask, public PoolAllocated<BLSVeriTask> {
+    uint256_t msg;
+    const PubKeyBLS &pubkey;
+    SigBLS sig;
+    public:
+    BLSVeriTask(const uint256_t &msg,
+                const PubKeyBLS &pubkey,
+                const SigBLS &sig):
+        msg(msg), pubkey(pubkey), sig(sig) {}
+    virtual ~BLSVeriTask() = default;
+
+    bool verify() override {
+        return sig.verify(msg, pubkey);
+    }
+};
+
+/** Verifies an aggregated signature against the sum of the signers' public
+ * keys: a few point additions per signer and one pairing check in total. */
+class BLSQCVeriTask: public VeriTask, public PoolAllocated<BLSQCVeriTask> {
+    bytearray_t msg;
+    std::vector<const PubKeyBLS *> pubkeys;
+    blst_p2_affine sig;
+    public:
+    BLSQCVeriTask(const uint256_t &msg, const blst_p2_affine &sig,
+                size_t nsigs = 0): msg(msg), sig(sig) {
+        pubkeys.reserve(nsigs);
+    }
+    virtual ~BLSQCVeriTask() = default;
+
+    void add(const PubKeyBLS &pubkey) { pubkeys.push_back(&pubkey); }
+
+    bool verify() override;
+};
+
+class PartCertBLS: public SigBLS, public PartCert {
+    uint256_t obj_hash;
+
+    public:
+    PartCertBLS() = default;
+    PartCertBLS(const PrivKeyBLS &priv_key, const uint256_t &obj_hash):
+        SigBLS(obj_hash, priv_key),
+        PartCert(),
+        obj_hash(obj_hash) {}
+
+    bool verify(const PubKey &pub_key) override {
+        return SigBLS::verify(obj_hash,
+                            static_cast<const PubKeyBLS &>(pub_key));
+    }
+
+    promise_t verify(const PubKey &pub_key, VeriPool &vpool) override {
+        DataStream s;
+        serialize(s);
+        pub_key.serialize(s);
+        auto digest = s.get_hash();
+        auto cache = &vpool.get_part_cache();
+        if (cache->lookup(digest))
+            return promise_t([](promise_t &pm) { pm.resolve(true); });
+        return vpool.verify(new BLSVeriTask(obj_hash,
+                static_cast<const PubKeyBLS &>(pub_key),
+                static_cast<const SigBLS &>(*this)))
+            .then([cache, digest](bool result) {
+                if (result) cache->insert(digest);
+                return result;
+            });
+    }
+
+    const uint256_t &get_obj_hash() const override { return obj_hash; }
+
+    PartCertBLS *clone() override {
+        return new PartCertBLS(*this);
+    }
+
+    void serialize(DataStream &s) const override {
+        s << obj_hash;
+        this->SigBLS::serialize(s);
+    }
+
+    void unserialize(DataStream &s) override {
+        s >> obj_hash;
+        this->SigBLS::unserialize(s);
+    }
+};
+
+/** A quorum certificate carrying the sum of the partial signatures instead
+ * of each of them, so that its size (the signer bitmap and one 96-byte
+ * signature) and its verification (one pairing check) barely depend on the
+ * number of replicas. */
+class QuorumCertBLS: public QuorumCert {
+    uint256_t obj_hash;
+    salticidae::Bits rids;
+    /** the number of parts added (or of signers, once parsed) */
+    size_t nsigs;
+    /** the running sum of the parts, turned into sig by compute() */
+    blst_p2 sum;
+    SigBLS sig;
+
+    public:
+    QuorumCertBLS(): nsigs(0), sum() {}
+    QuorumCertBLS(const ReplicaConfig &config, const uint256_t &obj_hash);
+
+    void add_part(ReplicaID rid, const PartCert &pc) override;
+    void compute() override;
+
+    bool verify(const ReplicaConfig &config) override;
+    promise_t verify(const ReplicaConfig &config, VeriPool &vpool) override;
+
+    const uint256_t &get_obj_hash() const override { return obj_hash; }
+
+    QuorumCertBLS *clone() override {
+        return new QuorumCertBLS(*this);
+    }
+
+    void serialize(DataStream &s) const override {
+        s << obj_hash << rids << sig;
+    }
+
+    void unserialize(DataStream &s) override {
+        s >> obj_hash >> rids >> sig;
+        nsigs = 0;
+        for (size_t i = 0; i < rids.size(); i++)
+            if (rids.get(i)) nsigs++;
+    }
+};
+
+}
+
+#endif
@@ -18,20 +18,23 @@
 #define _HOTSTUFF_ENT_H
 
 #include <vector>
+#include <deque>
 #include <unordered_map>
 #include <unordered_set>
 #include <string>
 #include <cstddef>
 #include <ios>
 #include <sstream>
-#include <sys/time.h>
 #include <algorithm>
+#include <bitset>
 
 #include "salticidae/netaddr.h"
 #include "salticidae/ref.h"
 #include "hotstuff/type.h"
 #include "hotstuff/util.h"
 #include "hotstuff/crypto.h"
+#include "hotstuff/clock.h"
+#include "hotstuff/pool.h"
 
 
 namespace hotstuff {
@@ -94,7 +97,7 @@ class ReplicaConfig {
 class Block;
 class HotStuffCore;
 
-using block_t = salticidae::ArcObj<Block>;
+using block_t = IntrusiveArc<Block>;
 
 class Command: public Serializable {
     friend HotStuffCore;
@@ -111,6 +114,43 @@ class Command: public Serializable {
 
 using command_t = ArcObj<Command>;
 
+/** A batch of client commands made by one replica and broadcast to the
+ * others. Once a quorum has acknowledged storing it, its hash stands for
+ * all its commands in the ordering, so a block carries one hash per batch
+ * instead of one per command. */
+class CmdBatch: public Serializable {
+    ReplicaID creator;
+    uint32_t seq;
+    std::vector<uint256_t> cmd_hashes;
+    /** the commands as sent by the clients */
+    std::vector<bytearray_t> payloads;
+    uint256_t hash;
+
+    public:
+    CmdBatch(): creator(0), seq(0) {}
+    CmdBatch(ReplicaID creator, uint32_t seq,
+            std::vector<uint256_t> &&cmd_hashes,
+            std::vector<bytearray_t> &&payloads):
+        creator(creator), seq(seq),
+        cmd_hashes(std::move(cmd_hashes)),
+        payloads(std::move(payloads)),
+        hash(salticidae::get_hash(*this)) {}
+
+    void serialize(DataStream &s) const override;
+    void unserialize(DataStream &s) override;
+    /** Check that each command hash is the hash of its payload (the
+     * serialized command). */
+    bool verify() const;
+
+    ReplicaID get_creator() const { return creator; }
+    uint32_t get_seq() const { return seq; }
+    const std::vector<uint256_t> &get_cmd_hashes() const { return cmd_hashes; }
+    const std::vector<bytearray_t> &get_payloads() const { return payloads; }
+    const uint256_t &get_hash() const { return hash; }
+};
+
+using batch_t = ArcObj<CmdBatch>;
+
 template<typename Hashable>
 inline static std::vector<uint256_t>
 get_hashes(const std::vector<Hashable> &plist) {
@@ -199,6 +239,56 @@ public:
     */
 };
 
+/** Summary of the preferred orderings of a set of replicas: for each pair
+ * of commands (a, b), the number of replicas having a before b (or having
+ * a but not b), which is all Aequitas needs from the orderings. Summaries
+ * merge associatively (also when they cover different commands), so the
+ * vote aggregators combine them on the way and the proposer gets one
+ * summary whose size depends on the commands, not on the replicas.
+ *
+ * The matrix takes quadratic space in the commands, so a summary of few
+ * orderings (e.g. at the leaves of the vote tree) is sent as the orderings
+ * themselves, as long as they are smaller. */
+class PrecedenceMatrix {
+    std::vector<uint256_t> cmds;
+    std::unordered_map<uint256_t, uint32_t> index;
+    /** the number of orderings having each command */
+    std::vector<uint32_t> present;
+    /** before[a][b]: the number of orderings having cmds[a] before
+     * cmds[b] (or without cmds[b]) */
+    std::vector<std::vector<uint32_t>> before;
+    /** the number of orderings summarized */
+    uint32_t total;
+    /** the orderings summarized, kept while all of them are known and their
+     * encoding is smaller than that of the matrix */
+    std::vector<OrderedList> lists;
+    bool raw;
+    size_t raw_bytes;
+
+    uint32_t get_index(const uint256_t &cmd);
+    void add_matrix(const OrderedList &list);
+    size_t matrix_bytes() const;
+    void drop_raw_if_larger();
+
+    public:
+    PrecedenceMatrix(): total(0), raw(true), raw_bytes(0) {}
+
+    /** Add the ordering of a replica (sorted by its timestamps). */
+    void add(const OrderedList &list);
+    void merge(const PrecedenceMatrix &other);
+    /** The number of orderings having a before b (or without b). */
+    uint32_t get_before(const uint256_t &a, const uint256_t &b) const;
+    uint32_t get_total() const { return total; }
+    /** The number of commands covered. */
+    size_t size() const { return cmds.size(); }
+    bool empty() const { return total == 0; }
+    /** Whether it is sent as the orderings instead of the matrix. */
+    bool is_raw() const { return raw; }
+
+    void serialize(DataStream &s) const;
+    void unserialize(DataStream &s);
+};
+
 
 
 /** This data structure is used only for sending proposed orderering by leader to the replicas. 
@@ -241,7 +331,62 @@ public:
 
 
 
-class Block {
+/** Set of replicas (e.g. those voted for a block) kept inline as a
+ * fixed-width bitmap, so that it needs no allocation. */
+class ReplicaSet {
+    static const size_t max_replicas = 1024;
+    std::bitset<max_replicas> bits;
+    size_t cnt;
+
+    public:
+    ReplicaSet(): cnt(0) {}
+
+    /** Add a replica.
+     * @return false if it was already in the set */
+    bool insert(ReplicaID rid) {
+        if (rid >= max_replicas)
+            throw HotStuffError("replica id %u out of range", rid);
+        if (bits.test(rid)) return false;
+        bits.set(rid);
+        cnt++;
+        return true;
+    }
+
+    bool count(ReplicaID rid) const { return rid < max_replicas && bits.test(rid); }
+    size_t size() const { return cnt; }
+};
+
+/** The wire encoding of a block. It is written once, when the block is
+ * created or received, and then shared by reference by everything that
+ * needs the block bytes: the block hash, proposals, block responses and the
+ * block log. */
+class BlockEncoding {
+    ArcObj<bytearray_t> bytes;
+
+    public:
+    BlockEncoding() {}
+    /** Take over the buffer of a stream holding only the block. */
+    BlockEncoding(DataStream &&s): bytes(new bytearray_t(std::move(s))) {}
+    BlockEncoding(const uint8_t *begin, const uint8_t *end):
+        bytes(new bytearray_t(begin, end)) {}
+
+    const bytearray_t &get_bytes() const { return *bytes; }
+    const uint8_t *data() const { return bytes->data(); }
+    size_t size() const { return bytes ? bytes->size() : 0; }
+    bool empty() const { return size() == 0; }
+
+    /** The hash of the bytes (computed in place). */
+    uint256_t get_hash() const {
+        SHA256 d;
+        d.update(*bytes);
+        return uint256_t(d.digest());
+    }
+};
+
+/** Blocks are allocated from a per-thread pool and carry their own
+ * reference count (see block_t), so a block costs no extra allocation for
+ * its sharing and is recycled when released (e.g. by prune). */
+class Block: public IntrusiveRefCounted, public PoolAllocated<Block> {
     friend HotStuffCore;
     std::vector<uint256_t> parent_hashes;
     quorum_cert_bt qc;
@@ -250,6 +395,9 @@ class Block {
 
     /* the following fields can be derived from above */
     uint256_t hash;
+    /** the canonical wire encoding (kept once computed or received, so the
+     * block is never serialized again) */
+    BlockEncoding encoded;
     std::vector<block_t> parents;
     block_t qc_ref;
     quorum_cert_bt self_qc;
@@ -257,7 +405,7 @@ class Block {
     bool delivered;
     int8_t decision;
 
-    std::unordered_set<ReplicaID> voted;
+    ReplicaSet voted;
 
     public:
     Block():
@@ -268,10 +416,9 @@ class Block {
 
     Block(bool delivered, int8_t decision):
         qc(new QuorumCertDummy()),
-        hash(salticidae::get_hash(*this)),
         qc_ref(nullptr),
         self_qc(nullptr), height(0),
-        delivered(delivered), decision(decision) {}
+        delivered(delivered), decision(decision) { encode(); }
 
     Block(const std::vector<block_t> &parents,
         quorum_cert_bt &&qc,
@@ -285,14 +432,18 @@ class Block {
             qc(std::move(qc)),
             proposed_orderedlist(proposed_orderedlist),
             extra(std::move(extra)),
-            hash(salticidae::get_hash(*this)),
             parents(parents),
             qc_ref(qc_ref),
             self_qc(std::move(self_qc)),
             height(height),
             delivered(0),
-            decision(decision) {}
+            decision(decision) { encode(); }
 
+    /** Serialize the block from its fields. */
+    void serialize_fields(DataStream &s) const;
+    /** Compute the encoding and the hash from the fields. */
+    void encode();
+    /** Write the cached encoding (or the fields, if there is none). */
     void serialize(DataStream &s) const;
 
     void unserialize(DataStream &s, HotStuffCore *hsc);
@@ -331,6 +482,8 @@ class Block {
 
     const bytearray_t &get_extra() const { return extra; }
 
+    const BlockEncoding &get_encoded() const { return encoded; }
+
     operator std::string () const {
         DataStream s;
         s << "<block "
@@ -371,23 +524,41 @@ class CommandTimestampStorage
     std::vector<uint256_t> available_cmd_hashes;
     std::vector<uint64_t> available_timestamps;
 
-    /** for print later on */
-    std::vector<uint256_t> cmd_hashes; // the corresponding hashes
-    std::vector<uint64_t> timestamps;  // the time stamps when corresponding commands are received
+    /** commands of the pruned blocks (the latest ones, in the order they
+     * were pruned), which are not new any more */
+    std::unordered_set<uint256_t> committed_cmds;
+    std::deque<uint256_t> committed_queue;
+
+    /** for print later on (the latest ones only) */
+    std::deque<uint256_t> cmd_hashes; // the corresponding hashes
+    std::deque<uint64_t> timestamps;  // the time stamps when corresponding commands are received
 
     /** storing all replica preferred orderedlist that will be sent with the vote.
      * the key is the block hash for which the vote is being sent.*/
     std::unordered_map<const uint256_t, orderedlist_t> replica_preferred_ordering_cache;
 
 public:
+    /** Get the current time used to stamp commands (monotonic, in
+     * nanoseconds). */
+    static uint64_t get_current_timestamp() { return MonotonicClock::now_ns(); }
     void add_command_to_storage(const uint256_t cmd_hash);
+    /** Record a command with the time it arrived. All calls must be made
+     * from the consensus thread; other threads should stamp the command
+     * with get_current_timestamp() and hand it over. */
+    void add_command_to_storage(const uint256_t &cmd_hash, uint64_t timestamp);
     bool is_new_command(const uint256_t &cmd_hash) const;
     void refresh_available_cmds(const std::vector<uint256_t> cmds);
-    const std::vector<uint256_t> &get_all_cmd_hashes() const { return cmd_hashes; }
-    const std::vector<uint64_t> &get_all_timestamps() const { return timestamps; }
+    const std::deque<uint256_t> &get_all_cmd_hashes() const { return cmd_hashes; }
+    const std::deque<uint64_t> &get_all_timestamps() const { return timestamps; }
     std::vector<uint64_t> get_timestamps(const std::vector<uint256_t> &cmd_hashes_inquired) const;
-    std::vector<std::vector<uint64_t>> get_timestamps_1(const LeaderProposedOrderedList &proposed_orderedlist) const;
+    /** Get the timestamps of a proposed ordered list, rank by rank, taking
+     * `unseen_ts` for the commands not recorded yet. */
+    std::vector<std::vector<uint64_t>> get_timestamps_1(const LeaderProposedOrderedList &proposed_orderedlist, uint64_t unseen_ts) const;
     orderedlist_t get_orderedlist(const uint256_t &blk_hash, uint32_t blk_size);
+    /** Drop the state kept for a pruned block: its preferred ordering and,
+     * if it was committed, the timestamps of the commands it proposed. The
+     * committed commands are still remembered as not new, up to a bound. */
+    void release_blk(const Block &blk);
     
 };
 
@@ -396,18 +567,39 @@ public:
 /** It stores all the orderedlists  that the leader ever received from other replicas
  * sent along with the votes.*/
 class OrderedListStorage {
-    std::unordered_map<uint256_t, std::vector<OrderedList>> ordered_list_cache;
+    /** the ordered list giving the candidate commands (the leader's own, or
+     * else the first one received) */
+    std::unordered_map<uint256_t, OrderedList> ordered_list_cache;
+    /** all the ordered lists received, folded into one summary */
+    std::unordered_map<uint256_t, PrecedenceMatrix> summary_cache;
+    /** the voters whose orderings came in the summaries */
+    std::unordered_map<uint256_t, std::unordered_set<ReplicaID>> summary_voters;
     //std::vector<uint256_t> list_block_hashes;
     //std::vector<std::vector<OrderedList>> ordered_list_cache;
 
 public:
     void add_ordered_list(const uint256_t block_hash, const OrderedList preferred_orderedlist, bool leader, size_t num_peers);
-    std::vector<OrderedList> get_set_of_orderedlists(const uint256_t block_hash) const;
+    /** Add the orderings of the given voters, summarized by the vote
+     * aggregators. */
+    void add_summary(const uint256_t &block_hash, const PrecedenceMatrix &summary,
+                    const std::vector<ReplicaID> &voters);
+    /** Whether the ordering of the voter came in a summary. */
+    bool is_summarized(const uint256_t &block_hash, ReplicaID voter) const {
+        auto it = summary_voters.find(block_hash);
+        return it != summary_voters.end() && it->second.count(voter);
+    }
+    /** The ordered list of the candidate commands. */
+    const OrderedList &get_candidates(const uint256_t &block_hash) const;
+    const PrecedenceMatrix &get_summary(const uint256_t &block_hash) const;
     std::vector<uint256_t> get_all_block_hashes() const;
     std::vector<uint256_t> get_cmds_for_first_one(const uint256_t block_hash) const;
     std::vector<uint64_t> get_timestamps_for_first_one(const uint256_t block_hash) const;
-    std::vector<uint256_t> get_cmds_for_second_one(const uint256_t block_hash) const;
-    std::vector<uint64_t> get_timestamps_for_second_one(const uint256_t block_hash) const;
+    /** Drop the ordered lists received for a pruned block. */
+    void release_blk(const uint256_t &block_hash) {
+        ordered_list_cache.erase(block_hash);
+        summary_cache.erase(block_hash);
+        summary_voters.erase(block_hash);
+    }
 
 
 };
@@ -421,6 +613,7 @@ public:
 class EntityStorage {
     std::unordered_map<const uint256_t, block_t> blk_cache;
     std::unordered_map<const uint256_t, command_t> cmd_cache;
+    std::unordered_map<const uint256_t, batch_t> batch_cache;
     public:
     bool is_blk_delivered(const uint256_t &blk_hash) {
         auto it = blk_cache.find(blk_hash);
@@ -467,6 +660,27 @@ class EntityStorage {
     size_t get_cmd_cache_size() {
         return cmd_cache.size();
     }
+
+    bool is_batch_fetched(const uint256_t &batch_hash) {
+        return batch_cache.count(batch_hash);
+    }
+
+    const batch_t &add_batch(const batch_t &batch) {
+        return batch_cache.insert(std::make_pair(batch->get_hash(), batch)).first->second;
+    }
+
+    batch_t find_batch(const uint256_t &batch_hash) {
+        auto it = batch_cache.find(batch_hash);
+        return it == batch_cache.end() ? nullptr : it->second;
+    }
+
+    void release_batch(const uint256_t &batch_hash) {
+        batch_cache.erase(batch_hash);
+    }
+
+    size_t get_batch_cache_size() {
+        return batch_cache.size();
+    }
     size_t get_blk_cache_size() {
         return blk_cache.size();
     }
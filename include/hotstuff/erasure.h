@@ -0,0 +1,87 @@
+/**
+ * Copyright 2018 VMware
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _HOTSTUFF_ERASURE_H
+#define _HOTSTUFF_ERASURE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "hotstuff/type.h"
+
+namespace hotstuff {
+
+/** Arithmetic in GF(2^8) (with the polynomial x^8 + x^4 + x^3 + x^2 + 1). */
+struct GF256 {
+    static uint8_t mul(uint8_t a, uint8_t b);
+    static uint8_t inv(uint8_t a);
+    /** dst[i] ^= c * src[i] for the len bytes (with SSSE3/AVX2 when the CPU
+     * has them). */
+    static void mul_add_region(uint8_t *dst, const uint8_t *src,
+                                uint8_t c, size_t len);
+    /** The name of the region multiplication in use. */
+    static const char *simd_name();
+};
+
+/** Systematic Reed-Solomon code over GF(2^8): the data is split into k
+ * shards, n - k parity shards are added, and any k of the n shards rebuild
+ * the data. */
+class ReedSolomon {
+    size_t k;
+    size_t n;
+    /** the n x k encoding matrix (its first k rows are the identity) */
+    std::vector<uint8_t> matrix;
+
+    public:
+    ReedSolomon(size_t k, size_t n);
+
+    size_t get_k() const { return k; }
+    size_t get_n() const { return n; }
+    /** The size of each shard for len bytes of data. */
+    size_t shard_size(size_t len) const { return len ? (len + k - 1) / k : 1; }
+
+    /** Split the data into n shards (the last data shard is zero padded). */
+    std::vector<bytearray_t> encode(const uint8_t *data, size_t len) const;
+    /** Rebuild the len bytes of data from the shards (an empty shard is
+     * missing).
+     * @return false if fewer than k shards are given or their sizes differ */
+    bool decode(const std::vector<bytearray_t> &shards, size_t len,
+                bytearray_t &out) const;
+};
+
+/** Merkle tree over the hashes of a list of chunks, for proving that a chunk
+ * is the one at its index under the root. */
+class MerkleTree {
+    /** the levels from the leaves up to the root */
+    std::vector<std::vector<uint256_t>> levels;
+
+    public:
+    MerkleTree(const std::vector<bytearray_t> &chunks);
+
+    const uint256_t &get_root() const { return levels.back()[0]; }
+    /** The sibling hashes from the leaf up. */
+    std::vector<uint256_t> get_proof(size_t idx) const;
+
+    static uint256_t hash_leaf(const bytearray_t &chunk);
+    static bool verify(const uint256_t &root, size_t idx, size_t nleaves,
+                        const bytearray_t &chunk,
+                        const std::vector<uint256_t> &proof);
+};
+
+}
+
+#endif
@@ -19,6 +19,7 @@
 #define _HOTSTUFF_CORE_H
 
 #include <queue>
+#include <deque>
 #include <unordered_map>
 #include <unordered_set>
 //#include <boost/lexical_cast.hpp>
@@ -34,6 +35,13 @@
 #include "salticidae/msg.h"
 #include "hotstuff/util.h"
 #include "hotstuff/consensus.h"
+#include "hotstuff/mempool.h"
+#include "hotstuff/blocklog.h"
+#include "hotstuff/safetylog.h"
+#include "hotstuff/erasure.h"
+#ifdef HOTSTUFF_BLS
+#include "hotstuff/crypto_bls.h"
+#endif
 
 namespace hotstuff {
 
@@ -43,6 +51,8 @@ using salticidae::_1;
 using salticidae::_2;
 
 const double ent_waiting_timeout = 10;
+/** how long to wait at most for the checkpoints when catching up */
+const double catchup_timeout = 2;
 const double double_inf = 1e10;
 
 /** Network message format for HotStuff. */
@@ -85,18 +95,221 @@ struct MsgRespBlock {
     void postponed_parse(HotStuffCore *hsc);
 };
 
+/** Request for the ancestors of a block (itself included, following the
+ * first parents) down to the given height. */
+struct MsgReqBlockRange {
+    static const opcode_t opcode = 0x6;
+    DataStream serialized;
+    uint256_t blk_hash;
+    uint32_t height;
+    MsgReqBlockRange(const uint256_t &blk_hash, uint32_t height);
+    MsgReqBlockRange(DataStream &&s);
+};
+
+/** A chunk of the blocks requested by MsgReqBlockRange, from the top down.
+ * The last chunk is marked, and may be empty. */
+struct MsgRespBlockRange {
+    static const opcode_t opcode = 0x7;
+    DataStream serialized;
+    uint256_t blk_hash;
+    bool last;
+    std::vector<block_t> blks;
+    MsgRespBlockRange(const uint256_t &blk_hash,
+                    const std::vector<block_t> &blks, bool last);
+    MsgRespBlockRange(DataStream &&s): serialized(std::move(s)) {}
+    void postponed_parse(HotStuffCore *hsc);
+};
+
+/** Request for the latest checkpoint, from a replica whose last committed
+ * block is at the given height. */
+struct MsgReqCheckpoint {
+    static const opcode_t opcode = 0x4;
+    DataStream serialized;
+    uint32_t height;
+    MsgReqCheckpoint(uint32_t height);
+    MsgReqCheckpoint(DataStream &&s);
+};
+
+/** A checkpoint: the committed block at the given height, followed by the
+ * chain of its descendants up to the highest certified block (which proves
+ * the commit), the application state and the commands committed since the
+ * previous checkpoint. It has no blocks if there is no checkpoint ahead of
+ * the requester. */
+struct MsgRespCheckpoint {
+    static const opcode_t opcode = 0x5;
+    DataStream serialized;
+    uint32_t height;
+    bytearray_t app_state;
+    std::vector<uint256_t> cmds;
+    std::vector<block_t> blks;
+    MsgRespCheckpoint(uint32_t height,
+                    const bytearray_t &app_state,
+                    const std::vector<uint256_t> &cmds,
+                    const std::vector<block_t> &blks);
+    MsgRespCheckpoint(DataStream &&s): serialized(std::move(s)) {}
+    void postponed_parse(HotStuffCore *hsc);
+};
+
+/** A batch of commands broadcast by its creator (or sent on request). */
+struct MsgBatch {
+    static const opcode_t opcode = 0x8;
+    DataStream serialized;
+    CmdBatch batch;
+    MsgBatch(const CmdBatch &batch);
+    MsgBatch(DataStream &&s);
+};
+
+/** Acknowledgement of a stored batch, sent back to its creator. */
+struct MsgBatchAck {
+    static const opcode_t opcode = 0x9;
+    DataStream serialized;
+    ReplicaID voter;
+    uint256_t batch_hash;
+    part_cert_bt cert;
+    MsgBatchAck(ReplicaID voter, const uint256_t &batch_hash,
+                const PartCert &cert);
+    MsgBatchAck(DataStream &&s): serialized(std::move(s)) {}
+    void postponed_parse(HotStuffCore *hsc);
+};
+
+/** The certificate that a quorum stores a batch, so its hash can be
+ * ordered. */
+struct MsgBatchCert {
+    static const opcode_t opcode = 0xa;
+    DataStream serialized;
+    uint256_t batch_hash;
+    quorum_cert_bt cert;
+    MsgBatchCert(const uint256_t &batch_hash, const QuorumCert &cert);
+    MsgBatchCert(DataStream &&s): serialized(std::move(s)) {}
+    void postponed_parse(HotStuffCore *hsc);
+};
+
+/** Request for the batches missing at the execution. */
+struct MsgReqBatch {
+    static const opcode_t opcode = 0xb;
+    DataStream serialized;
+    std::vector<uint256_t> batch_hashes;
+    MsgReqBatch(const std::vector<uint256_t> &batch_hashes);
+    MsgReqBatch(DataStream &&s);
+};
+
+/** One erasure-coded chunk of a proposal (a serialized MsgPropose), with
+ * the proof that it is the chunk at idx under the Merkle root of all the
+ * chunks. The proposer sends chunk i to replica i, which echoes it to the
+ * others. */
+struct MsgProposeChunk {
+    static const opcode_t opcode = 0xc;
+    DataStream serialized;
+    ReplicaID proposer;
+    uint256_t root;
+    /** the size of the proposal */
+    uint32_t len;
+    uint16_t idx;
+    bytearray_t chunk;
+    std::vector<uint256_t> proof;
+    MsgProposeChunk(ReplicaID proposer, const uint256_t &root, uint32_t len,
+                    uint16_t idx, const bytearray_t &chunk,
+                    const std::vector<uint256_t> &proof);
+    MsgProposeChunk(DataStream &&s);
+};
+
+/** The votes for a block combined by a replica of the aggregation tree
+ * (rooted at the proposer collecting them), with the summary of their
+ * preferred orderings. */
+struct MsgVoteBundle {
+    static const opcode_t opcode = 0xd;
+    DataStream serialized;
+    /** the replica collecting the votes */
+    ReplicaID root;
+    uint256_t blk_hash;
+    std::vector<ReplicaID> voters;
+    std::vector<part_cert_bt> certs;
+    PrecedenceMatrix summary;
+    MsgVoteBundle(ReplicaID root, const uint256_t &blk_hash,
+                const std::vector<ReplicaID> &voters,
+                const std::vector<part_cert_bt> &certs,
+                const PrecedenceMatrix &summary);
+    MsgVoteBundle(DataStream &&s): serialized(std::move(s)) {}
+    void postponed_parse(HotStuffCore *hsc);
+};
+
 using promise::promise_t;
 
 class HotStuffBase;
 using pacemaker_bt = BoxObj<class PaceMaker>;
 
+/** Scheduler of the fetch requests. The hashes requested from a replica
+ * within a short window are coalesced into one MsgReqBlock, each request
+ * goes to the least loaded replica known to have the entity, and the
+ * retransmission timeout of a replica follows the EWMA of its response
+ * times (as in TCP) instead of a fixed timeout. */
+class FetchScheduler {
+    struct PeerState {
+        /** the hashes to be sent in the next batch */
+        std::vector<uint256_t> queued;
+        /** smoothed response time and its variation (in seconds) */
+        double srtt;
+        double rttvar;
+        /** doubled on each timeout, reset by a response */
+        double backoff;
+        size_t inflight;
+        PeerState(): srtt(0), rttvar(0), backoff(1), inflight(0) {}
+    };
+
+    struct Request {
+        PeerId replica;
+        /** when the request was sent (0 while queued) */
+        uint64_t sent_ns;
+        /** no response time is taken from a retransmission */
+        bool retrans;
+    };
+
+    HotStuffBase *hs;
+    TimerEvent flush_timer;
+    bool flush_pending;
+    double window;
+    std::unordered_map<PeerId, PeerState> peers;
+    std::unordered_map<uint256_t, Request> outstanding;
+    /* statistics */
+    uint64_t nreq;
+    uint64_t nbatch;
+    uint64_t nretrans;
+
+    void flush();
+
+    public:
+    /** the timeout of a replica with no response time yet */
+    static constexpr double init_rto = 0.5;
+    static constexpr double min_rto = 0.005;
+
+    FetchScheduler(HotStuffBase *hs);
+
+    void set_window(double _window) { window = _window; }
+    /** Choose the replica to request from (the least loaded one, other than
+     * exclude if possible). */
+    PeerId pick(const std::unordered_set<PeerId> &replicas,
+                const PeerId *exclude = nullptr) const;
+    /** Request the hash from the replica in the next batch. */
+    void enqueue(const uint256_t &ent_hash, const PeerId &replica);
+    /** Called when the entity arrives (replica is the sender, or null if it
+     * came otherwise). */
+    void on_fetched(const uint256_t &ent_hash, const PeerId *replica);
+    /** Called when the request to the replica times out. */
+    void on_timeout(const PeerId &replica);
+    /** The retransmission timeout for the replica (in seconds). */
+    double get_rto(const PeerId &replica) const;
+    void print_stat() const;
+};
+
 template<EntityType ent_type>
 class FetchContext: public promise_t {
     TimerEvent timeout;
     HotStuffBase *hs;
-    MsgReqBlock fetch_msg;
     const uint256_t ent_hash;
     std::unordered_set<PeerId> replicas;
+    /** the replica last requested from */
+    PeerId target;
+    bool sent;
     inline void timeout_cb(TimerEvent &);
     public:
     FetchContext(const FetchContext &) = delete;
@@ -135,6 +348,7 @@ class HotStuffBase: public HotStuffCore {
 
     friend BlockFetchContext;
     friend CmdFetchContext;
+    friend FetchScheduler;
 
     public:
     using Net = PeerNetwork<opcode_t>;
@@ -149,7 +363,11 @@ class HotStuffBase: public HotStuffCore {
     EventContext ec;
     salticidae::ThreadCall tcall;
     VeriPool vpool;
+    /** the worker signing votes off the event loop */
+    VeriPool spool;
     std::vector<PeerId> peers;
+    /** pending commands to be proposed (only used by the proposer) */
+    Mempool mempool;
 
     private:
     /** whether libevent handle is owned by itself */
@@ -165,15 +383,78 @@ class HotStuffBase: public HotStuffCore {
     std::unordered_map<const uint256_t, BlockFetchContext> blk_fetch_waiting;
     std::unordered_map<const uint256_t, BlockDeliveryContext> blk_delivery_waiting;
     std::unordered_map<const uint256_t, commit_cb_t> decision_waiting;
-    using cmd_queue_t = salticidae::MPSCQueueEventDriven<std::pair<uint256_t, commit_cb_t>>;
+    FetchScheduler fetch_sched;
+    /** a range of blocks being fetched, by its top block */
+    struct BlockRangeContext {
+        PeerId replica;
+        /** the blocks received so far, from the top down */
+        std::vector<block_t> blks;
+        /** no more chunks are taken */
+        bool closed;
+        BlockRangeContext(): closed(false) {}
+    };
+    std::unordered_map<uint256_t, BlockRangeContext> blk_range_waiting;
+    /** the maximum number of blocks in a range chunk (0 to disable range
+     * fetching) */
+    size_t blk_range_chunk;
+    struct PendingCmd {
+        uint256_t cmd_hash;
+        NetAddr client;
+        size_t nbytes;
+        /** arrival time, stamped by the thread receiving the command */
+        uint64_t timestamp;
+        commit_cb_t callback;
+        /** the command itself (only kept for the batches) */
+        bytearray_t payload;
+    };
+    using cmd_queue_t = salticidae::MPSCQueueEventDriven<PendingCmd>;
     cmd_queue_t cmd_pending;
-    std::vector<uint256_t> cmd_pending_buffer;
+
+    /* dissemination of the commands in batches (disabled if batch_size is
+     * 0): the hash of a certified batch is ordered in place of its
+     * commands */
+    size_t batch_size;
+    double batch_timeout;
+    /** the commands of the batch being made */
+    std::vector<uint256_t> batch_cmds;
+    std::vector<bytearray_t> batch_payloads;
+    TimerEvent batch_timer;
+    uint32_t batch_seq;
+    /** the batches of this replica waiting for the acknowledgements */
+    struct BatchAcks {
+        quorum_cert_bt cert;
+        std::unordered_set<ReplicaID> voters;
+    };
+    std::unordered_map<uint256_t, BatchAcks> batch_acking;
+    std::unordered_set<uint256_t> batch_certified;
+    /** decided batches, executed in order once they are stored */
+    std::queue<Finality> batch_exec_waiting;
+    TimerEvent batch_fetch_timer;
+    bool batch_fetch_pending;
+    /** the executed batches, kept for a while for the replicas missing them */
+    std::queue<uint256_t> batch_executed;
+    /** the batches and the commands executed lately (bounded FIFO): a batch
+     * certified again, or a command batched by several replicas (the clients
+     * send it to all of them), is only executed once; as every replica
+     * executes the same batches, they are the same everywhere, and they are
+     * part of the checkpoints */
+    std::unordered_set<uint256_t> batch_done;
+    std::deque<uint256_t> batch_done_queue;
+    std::unordered_set<uint256_t> batch_cmd_done;
+    std::deque<uint256_t> batch_cmd_done_queue;
 
     /* statistics */
     uint64_t fetched;
     uint64_t delivered;
     mutable uint64_t nsent;
     mutable uint64_t nrecv;
+    uint64_t nrange_req;
+    uint64_t nrange_blks;
+    uint64_t nbatch_made;
+    uint64_t nbatch_recv;
+    uint64_t nbatch_cert;
+    uint64_t nbatch_exec;
+    uint64_t nbatch_dup_cmds;
 
     mutable uint32_t part_parent_size;
     mutable uint32_t part_fetched;
@@ -184,19 +465,201 @@ class HotStuffBase: public HotStuffCore {
     mutable double part_delivery_time_min;
     mutable double part_delivery_time_max;
     mutable std::unordered_map<const PeerId, uint32_t> part_fetched_replica;
+    /* per-stage latencies of handling a proposal (10s) */
+    mutable LatencyHistogram stage_deliver;
+    mutable LatencyHistogram stage_fairness;
+    mutable LatencyHistogram stage_sign;
+    mutable LatencyHistogram stage_vote;
+
+    /** whether to overlap the fairness check and the vote signing with the
+     * delivery of a proposed block */
+    bool vote_pipeline;
+    /** durable log of the delivered and committed blocks (optional) */
+    BoxObj<BlockLog> blk_log;
+    TimerEvent blk_log_timer;
+    double blk_log_sync_interval;
+    /** the worker writing and syncing the block log */
+    BoxObj<VeriPool> blk_log_pool;
+    /** commit a checkpoint every this many blocks (0 to disable) */
+    uint32_t checkpoint_interval;
+    /** catch up from a checkpoint only if it is this many blocks ahead */
+    uint32_t catchup_lag;
+    /** the latest checkpoint of the committed state */
+    struct Checkpoint {
+        block_t blk;
+        uint32_t height;
+        /** the executed batches and commands remembered for
+         * deduplication, followed by the application state */
+        bytearray_t app_state;
+        /** the commands committed since the previous checkpoint */
+        std::vector<uint256_t> cmds;
+        Checkpoint(): blk(nullptr), height(0) {}
+    } checkpoint;
+    /** the commands committed since the latest checkpoint */
+    std::vector<uint256_t> checkpoint_cmds;
+    /** a checkpoint block committed before its batches were executed, the
+     * number of decided batches to execute before taking its snapshot, and
+     * its commands */
+    block_t checkpoint_waiting;
+    size_t checkpoint_nwaiting;
+    std::vector<uint256_t> checkpoint_waiting_cmds;
+    /* the catch-up in progress */
+    bool catchup_pending;
+    TimerEvent catchup_timer;
+    ElapsedTime catchup_elapsed;
+    size_t catchup_nresp;
+    /** the replicas vouching for each (checkpoint block, height, state,
+     * commands), by its digest */
+    std::unordered_map<uint256_t, std::unordered_set<PeerId>> catchup_votes;
+    /** proposals received during the catch-up */
+    std::vector<std::pair<Proposal, PeerId>> catchup_deferred;
+    uint64_t ncheckpoint;
+    uint64_t ncatchup;
+    /** send the proposals as erasure-coded chunks instead of whole */
+    bool ec_proposal;
+    /** the coder for the current replica set (made on first use) */
+    BoxObj<ReedSolomon> ec_coder;
+    /** the chunks received for each proposal (by Merkle root) */
+    struct ChunkContext {
+        /** the proposer and the length of the proposal (only set from the
+         * chunk sent by the proposer itself) */
+        ReplicaID proposer;
+        uint32_t len;
+        /** the replica got its own chunk from the proposer, so the root
+         * is the proposer's */
+        bool authentic;
+        std::vector<bytearray_t> chunks;
+        size_t nchunks;
+        /** when the first chunk arrived (in nanoseconds) */
+        uint64_t created;
+    };
+    std::unordered_map<uint256_t, ChunkContext> chunk_waiting;
+    /** the roots of chunk_waiting by age, to evict the stale ones */
+    std::queue<std::pair<uint256_t, uint64_t>> chunk_waiting_queue;
+    /** the proposals already rebuilt (bounded), to drop late chunks */
+    std::unordered_set<uint256_t> chunk_done;
+    std::queue<uint256_t> chunk_done_queue;
+    uint64_t nec_prop;
+    uint64_t nec_sent_bytes;
+    uint64_t nec_full_bytes;
+    uint64_t nec_rebuilt;
+    /* aggregation of the votes along a tree of the given fan-in rooted at
+     * the proposer collecting them (disabled if vote_fanin is 0); only the
+     * votes are signed, so the aggregators are trusted with the orderings
+     * of their subtrees */
+    size_t vote_fanin;
+    /** how long a replica waits for each level of its subtree */
+    double vote_agg_timeout;
+    /** the votes combined by this replica for a block */
+    struct VoteAggContext {
+        ReplicaID root;
+        std::vector<ReplicaID> voters;
+        std::vector<part_cert_bt> certs;
+        PrecedenceMatrix summary;
+        /** the number of replicas in the subtree (including itself) */
+        size_t expected;
+        /** sent to the parent (later votes are passed on as they come) */
+        bool flushed;
+        TimerEvent timer;
+        /** the vote of this replica, sent to the root directly if no
+         * certificate for the block shows up in time (e.g. a replica
+         * above it crashed) */
+        BoxObj<MsgVote> own_vote;
+        TimerEvent fallback_timer;
+    };
+    std::unordered_map<uint256_t, VoteAggContext> vote_agg;
+    /** the contexts by age, the oldest ones are dropped */
+    std::queue<uint256_t> vote_agg_queue;
+    uint64_t nagg_sent;
+    uint64_t nagg_recv;
+    uint64_t nagg_votes;
+    /** the commands covered by the summaries received */
+    uint64_t nagg_summary_cmds;
+    uint64_t nagg_fallback;
+    /** write-ahead log of the safety state (optional) */
+    BoxObj<SafetyLog> safety_log;
+    /** the worker writing the safety log (group and async modes) */
+    BoxObj<VeriPool> safety_pool;
+    /** the latest state not yet handed to the worker */
+    DataStream safety_pending;
+    bool safety_dirty;
+    bool safety_flushing;
+    /** votes waiting for the pending state, with their start time */
+    std::vector<std::pair<promise_t, ElapsedTime>> safety_waiting;
+    /* safety log latencies (10s): the write and sync itself, and the delay
+     * it adds to a vote */
+    mutable LatencyHistogram safety_write_lat;
+    mutable LatencyHistogram safety_persist_lat;
 
     void on_fetch_cmd(const command_t &cmd);
-    void on_fetch_blk(const block_t &blk);
+    void on_fetch_blk(const block_t &blk, const PeerId *replica = nullptr);
     bool on_deliver_blk(const block_t &blk);
+    void log_blk(const block_t &blk);
+    void flush_blk_log();
+    void recover_blk_log();
+    void flush_safety();
+    void take_checkpoint(const block_t &blk);
+    void make_checkpoint(const block_t &blk, std::vector<uint256_t> &&cmds);
+    void start_catchup();
+    void finish_catchup(bool installed);
+    /** count a checkpoint response that was not installed */
+    void on_catchup_resp();
+    bool check_checkpoint(const MsgRespCheckpoint &msg) const;
+    bool install_checkpoint(MsgRespCheckpoint &msg);
+    void accept_proposal(Proposal &&prop, const PeerId &peer);
+    void on_proposal(Proposal &&prop, const PeerId &peer);
+    const ReedSolomon &get_ec_coder();
+    void broadcast_proposal_chunks(const Proposal &prop);
+    void rebuild_proposal(const uint256_t &root);
+    void mark_chunk_done(const uint256_t &root);
+    size_t agg_pos(ReplicaID rid, ReplicaID root) const;
+    ReplicaID agg_parent(ReplicaID root) const;
+    bool agg_is_child(const PeerId &peer, ReplicaID root) const;
+    VoteAggContext &get_vote_agg(ReplicaID root, const uint256_t &blk_hash);
+    void aggregate_vote(ReplicaID root, const Vote &vote);
+    void flush_vote_agg(const uint256_t &blk_hash);
+    void on_vote_bundle(MsgVoteBundle &&msg, const PeerId &peer);
+    void deliver_blk(const uint256_t &blk_hash, const PeerId &replica);
+    promise_t async_deliver_blk_range(const uint256_t &blk_hash, const PeerId &replica);
+    void deliver_blk_range(const uint256_t &blk_hash);
+    void recover_safety_log();
+    void beat_and_propose();
+    void decide_cmd(Finality &&fin);
+    void add_to_batch(const uint256_t &cmd_hash, bytearray_t &&payload);
+    void seal_batch();
+    void check_batch_acks(const uint256_t &batch_hash);
+    void on_batch_certified(const uint256_t &batch_hash);
+    void exec_batches();
+    void pop_batch_exec();
 
     /** deliver consensus message: <propose> */
     inline void propose_handler(MsgPropose &&, const Net::conn_t &);
+    /** receives a chunk of a proposal */
+    inline void propose_chunk_handler(MsgProposeChunk &&, const Net::conn_t &);
     /** deliver consensus message: <vote> */
     inline void vote_handler(MsgVote &&, const Net::conn_t &);
+    /** combines the votes of a subtree, or collects them at the root */
+    inline void vote_bundle_handler(MsgVoteBundle &&, const Net::conn_t &);
     /** fetches full block data */
     inline void req_blk_handler(MsgReqBlock &&, const Net::conn_t &);
     /** receives a block */
     inline void resp_blk_handler(MsgRespBlock &&, const Net::conn_t &);
+    /** walks the parents of a block and sends them in chunks */
+    inline void req_blk_range_handler(MsgReqBlockRange &&, const Net::conn_t &);
+    /** receives a chunk of blocks */
+    inline void resp_blk_range_handler(MsgRespBlockRange &&, const Net::conn_t &);
+    /** sends the latest checkpoint */
+    inline void req_checkpoint_handler(MsgReqCheckpoint &&, const Net::conn_t &);
+    /** receives a checkpoint */
+    inline void resp_checkpoint_handler(MsgRespCheckpoint &&, const Net::conn_t &);
+    /** stores a batch and acknowledges it */
+    inline void batch_handler(MsgBatch &&, const Net::conn_t &);
+    /** collects the acknowledgements of a batch made by this replica */
+    inline void batch_ack_handler(MsgBatchAck &&, const Net::conn_t &);
+    /** receives the certificate of a batch */
+    inline void batch_cert_handler(MsgBatchCert &&, const Net::conn_t &);
+    /** sends the requested batches */
+    inline void req_batch_handler(MsgReqBatch &&, const Net::conn_t &);
 
     inline bool conn_handler(const salticidae::ConnPool::conn_t &, bool);
 
@@ -204,12 +667,20 @@ class HotStuffBase: public HotStuffCore {
     void do_vote(ReplicaID, const Vote &) override;
     void do_decide(Finality &&) override;
     void do_consensus(const block_t &blk) override;
+    promise_t async_create_part_cert(const uint256_t &blk_hash) override;
+    promise_t async_persist_safety() override;
 
     protected:
 
     /** Called to replicate the execution of a command, the application should
      * implement this to make transition for the application state. */
     virtual void state_machine_execute(const Finality &) = 0;
+    /** Called to save the application state at a checkpoint (nothing by
+     * default). */
+    virtual void state_machine_snapshot(DataStream &) const {}
+    /** Called to replace the application state by the one saved at a
+     * checkpoint, when catching up from it (nothing by default). */
+    virtual void state_machine_restore(DataStream &) {}
 
     public:
     HotStuffBase(uint32_t blk_size,
@@ -227,6 +698,17 @@ class HotStuffBase: public HotStuffCore {
 
     /* Submit the command to be decided. */
     void exec_command(uint256_t cmd_hash, commit_cb_t callback);
+    /** Submit the command on behalf of a client, so the mempool can account
+     * for the client quota and the command size. A command refused by the
+     * mempool is answered with a Finality having decision -1.
+     * It is safe to call from any thread: the command is stamped with its
+     * arrival time here and recorded by the consensus thread. */
+    void exec_command(uint256_t cmd_hash, const NetAddr &client,
+                    size_t nbytes, commit_cb_t callback);
+    /** Submit the command with its content, to be disseminated in a batch
+     * (see set_batching()). */
+    void exec_command(uint256_t cmd_hash, const NetAddr &client,
+                    bytearray_t &&payload, commit_cb_t callback);
     void start(std::vector<std::tuple<NetAddr, pubkey_bt, uint256_t>> &&replicas,
                 bool ec_loop = false);
 
@@ -235,7 +717,57 @@ class HotStuffBase: public HotStuffCore {
     const auto &get_decision_waiting() const { return decision_waiting; }
     ThreadCall &get_tcall() { return tcall; }
     PaceMaker *get_pace_maker() { return pmaker.get(); }
+    void set_vote_pipeline(bool enabled) { vote_pipeline = enabled; }
+    /** Persist the delivered and committed blocks to a log, syncing it every
+     * sync_interval seconds, and rebuild the chain from the existing log
+     * when started. If a sync fails, the replica stops voting. Should be
+     * called before start(). */
+    void enable_block_log(const BlockLog::Config &config, double sync_interval);
+    /** Persist the safety state to a write-ahead log before each vote, and
+     * restore it (after the block log) when started. Should be called before
+     * start(). */
+    void enable_safety_log(const SafetyLog::Config &config);
+    /** Fetch a missing chain of blocks as ranges sent in chunks of at most
+     * chunk blocks (0 to fetch the blocks one parent after another). */
+    void set_blk_range_chunk(size_t chunk) { blk_range_chunk = chunk; }
+    /** Coalesce the fetch requests to a replica made within window seconds
+     * into one message. */
+    void set_fetch_window(double window) { fetch_sched.set_window(window); }
+    /** Disseminate the client commands in batches of up to size commands
+     * (or those received within timeout seconds), and order the hashes of
+     * the certified batches instead of the commands (0 to disable). A block
+     * then holds up to blk_size batches. */
+    void set_batching(size_t size, double timeout) {
+        batch_size = size;
+        batch_timeout = timeout;
+    }
+    bool is_batching() const { return batch_size > 0; }
+    /** Send each proposal as n Reed-Solomon chunks (one per replica, any
+     * n - 2f of which rebuild it) that the replicas echo to each other,
+     * instead of sending the whole proposal to every replica. */
+    void set_ec_proposal(bool enabled) { ec_proposal = enabled; }
+    /** Send the votes up a tree of the given fan-in rooted at the next
+     * proposer (0 to send them to it directly): each replica combines the
+     * votes of its subtree, waiting up to timeout seconds per level below
+     * it, so the proposer receives fanin messages instead of n - 1. A
+     * replica whose vote is not certified after one more timeout per level
+     * of the tree sends it to the proposer directly. */
+    void set_vote_aggregation(size_t fanin, double timeout) {
+        vote_fanin = fanin;
+        vote_agg_timeout = timeout;
+    }
+    /** Take a checkpoint every interval committed blocks (0 to disable), and
+     * catch up from the checkpoint of the other replicas instead of fetching
+     * the missing blocks when falling behind by more than lag blocks. The
+     * interval should be below the prune staleness, so that the blocks
+     * proving a checkpoint are still there. */
+    void set_checkpoint(uint32_t interval, uint32_t lag) {
+        checkpoint_interval = interval;
+        catchup_lag = lag;
+    }
     void print_stat() const;
+    /** Start a new interval for the peak values shown by print_stat(). */
+    void reset_stat() { mempool.reset_peak(); }
     virtual void do_elected() {}
 //#ifdef HOTSTUFF_AUTOCLI
 //    virtual void do_demand_commands(size_t) {}
@@ -317,33 +849,34 @@ class HotStuff: public HotStuffBase {
 using HotStuffNoSig = HotStuff<>;
 using HotStuffSecp256k1 = HotStuff<PrivKeySecp256k1, PubKeySecp256k1,
                                     PartCertSecp256k1, QuorumCertSecp256k1>;
+#ifdef HOTSTUFF_BLS
+using HotStuffBLS = HotStuff<PrivKeyBLS, PubKeyBLS,
+                            PartCertBLS, QuorumCertBLS>;
+#endif
 
 template<EntityType ent_type>
 FetchContext<ent_type>::FetchContext(FetchContext && other):
         promise_t(static_cast<const promise_t &>(other)),
         hs(other.hs),
-        fetch_msg(std::move(other.fetch_msg)),
         ent_hash(other.ent_hash),
-        replicas(std::move(other.replicas)) {
+        replicas(std::move(other.replicas)),
+        target(other.target),
+        sent(other.sent) {
     other.timeout.del();
     timeout = TimerEvent(hs->ec,
             std::bind(&FetchContext::timeout_cb, this, _1));
     reset_timeout();
 }
 
-template<>
-inline void FetchContext<ENT_TYPE_CMD>::timeout_cb(TimerEvent &) {
-    HOTSTUFF_LOG_WARN("cmd fetching %.10s timeout", get_hex(ent_hash).c_str());
-    for (const auto &replica: replicas)
-        send(replica);
-    reset_timeout();
-}
-
-template<>
-inline void FetchContext<ENT_TYPE_BLK>::timeout_cb(TimerEvent &) {
-    HOTSTUFF_LOG_WARN("block fetching %.10s timeout", get_hex(ent_hash).c_str());
-    for (const auto &replica: replicas)
-        send(replica);
+template<EntityType ent_type>
+void FetchContext<ent_type>::timeout_cb(TimerEvent &) {
+    HOTSTUFF_LOG_WARN("%s fetching %.10s timeout",
+                    ent_type == ENT_TYPE_BLK ? "block" : "cmd",
+                    get_hex(ent_hash).c_str());
+    /* retry with another replica having it, if any */
+    if (sent) hs->fetch_sched.on_timeout(target);
+    if (!replicas.empty())
+        send(hs->fetch_sched.pick(replicas, sent ? &target : nullptr));
     reset_timeout();
 }
 
@@ -351,9 +884,7 @@ template<EntityType ent_type>
 FetchContext<ent_type>::FetchContext(
                                 const uint256_t &ent_hash, HotStuffBase *hs):
             promise_t([](promise_t){}),
-            hs(hs), ent_hash(ent_hash) {
-    fetch_msg = std::vector<uint256_t>{ent_hash};
-
+            hs(hs), ent_hash(ent_hash), sent(false) {
     timeout = TimerEvent(hs->ec,
             std::bind(&FetchContext::timeout_cb, this, _1));
     reset_timeout();
@@ -362,19 +893,26 @@ FetchContext<ent_type>::FetchContext(
 template<EntityType ent_type>
 void FetchContext<ent_type>::send(const PeerId &replica) {
     hs->part_fetched_replica[replica]++;
-    hs->pn.send_msg(fetch_msg, replica);
+    hs->fetch_sched.enqueue(ent_hash, replica);
+    target = replica;
+    sent = true;
 }
 
 template<EntityType ent_type>
 void FetchContext<ent_type>::reset_timeout() {
-    timeout.add(salticidae::gen_rand_timeout(ent_waiting_timeout));
+    /* an entity not requested yet (e.g. coming with a range) waits long */
+    timeout.add(sent ? hs->fetch_sched.get_rto(target) :
+                salticidae::gen_rand_timeout(ent_waiting_timeout));
 }
 
 template<EntityType ent_type>
 void FetchContext<ent_type>::add_replica(const PeerId &replica, bool fetch_now) {
-    if (replicas.empty() && fetch_now)
-        send(replica);
     replicas.insert(replica);
+    if (!sent && fetch_now)
+    {
+        send(hs->fetch_sched.pick(replicas));
+        reset_timeout();
+    }
 }
 
 }
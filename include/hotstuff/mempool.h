@@ -0,0 +1,115 @@
+/**
+ * Copyright 2018 VMware
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _HOTSTUFF_MEMPOOL_H
+#define _HOTSTUFF_MEMPOOL_H
+
+#include <list>
+#include <deque>
+#include <vector>
+#include <unordered_map>
+#include <unordered_set>
+
+#include "hotstuff/type.h"
+
+namespace hotstuff {
+
+/** Pool of pending commands kept by the proposer between the client request
+ * handler and the block proposal. It drops duplicated commands (re-sent by
+ * retrying clients or already proposed), bounds the number of pending
+ * commands per client and in total, and reports why a command is refused so
+ * that the caller can push back on the client. */
+class Mempool {
+    public:
+    enum AdmitResult {
+        ADMITTED = 0,
+        DUPLICATE,      /**< the command is pending or was recently proposed */
+        CLIENT_QUOTA,   /**< the client has too many pending commands */
+        OVERLOADED      /**< the pool is full (by entries or bytes) */
+    };
+
+    struct Config {
+        /** maximum number of pending commands (0 for unlimited) */
+        size_t max_cmds;
+        /** maximum total size of pending commands in bytes (0 for unlimited) */
+        size_t max_bytes;
+        /** maximum number of pending commands per client (0 for unlimited) */
+        size_t client_quota;
+        /** how many proposed command hashes to remember for deduplication */
+        size_t recent_size;
+        Config(): max_cmds(0), max_bytes(0), client_quota(0), recent_size(65536) {}
+    };
+
+    private:
+    struct Entry {
+        uint256_t cmd_hash;
+        NetAddr client;
+        size_t nbytes;
+        Entry(const uint256_t &cmd_hash, const NetAddr &client, size_t nbytes):
+            cmd_hash(cmd_hash), client(client), nbytes(nbytes) {}
+    };
+    using entry_list_t = std::list<Entry>;
+
+    Config config;
+    /** pending commands in arrival order */
+    entry_list_t entries;
+    std::unordered_map<uint256_t, entry_list_t::iterator> index;
+    std::unordered_map<NetAddr, size_t> client_pending;
+    size_t nbytes;
+    /** recently proposed commands (bounded FIFO) */
+    std::unordered_set<uint256_t> recent;
+    std::deque<uint256_t> recent_queue;
+
+    /* statistics */
+    uint64_t nadmitted;
+    uint64_t nduplicate;
+    uint64_t nquota;
+    uint64_t noverloaded;
+    uint64_t nproposed;
+    size_t peak_size;
+    size_t peak_bytes;
+
+    void erase(entry_list_t::iterator it);
+    void remember(const uint256_t &cmd_hash);
+
+    public:
+    Mempool(const Config &config = Config());
+
+    void set_config(const Config &_config) { config = _config; }
+    const Config &get_config() const { return config; }
+
+    /** Try to add a command to the pool. */
+    AdmitResult admit(const uint256_t &cmd_hash, const NetAddr &client, size_t cmd_size);
+    /** Remove up to n commands in arrival order, marking them proposed. */
+    std::vector<uint256_t> take(size_t n);
+    /** Mark a command as proposed, removing it from the pool if present.
+     * @return true if the command was pending */
+    bool mark_proposed(const uint256_t &cmd_hash);
+
+    bool contains(const uint256_t &cmd_hash) const { return index.count(cmd_hash); }
+    size_t size() const { return entries.size(); }
+    size_t get_nbytes() const { return nbytes; }
+    void print_stat() const;
+    /** Start a new interval for the peak size reported by print_stat(). */
+    void reset_peak() {
+        peak_size = entries.size();
+        peak_bytes = nbytes;
+    }
+};
+
+}
+
+#endif
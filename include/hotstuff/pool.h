@@ -0,0 +1,200 @@
+/**
+ * Copyright 2018 VMware
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _HOTSTUFF_POOL_H
+#define _HOTSTUFF_POOL_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <new>
+#include <utility>
+#include <vector>
+
+namespace hotstuff {
+
+/** Per-thread free list of memory chunks for objects of type T. Freed
+ * objects are kept for reuse (up to a bound) instead of returning to the
+ * heap, so a steady flow of consensus objects (blocks, votes) stops hitting
+ * the allocator once the pool is warm. */
+template<typename T>
+class ObjectPool {
+    struct FreeList {
+        std::vector<void *> chunks;
+        size_t max_free;
+        uint64_t nfresh;
+        uint64_t nreused;
+        FreeList(): max_free(4096), nfresh(0), nreused(0) {}
+        ~FreeList() {
+            for (auto p: chunks) ::operator delete(p);
+            closed() = true;
+        }
+    };
+
+    static FreeList &local() {
+        thread_local FreeList fl;
+        return fl;
+    }
+
+    /* set once the free list of the thread is destroyed (e.g. objects freed
+     * during the static destruction) */
+    static bool &closed() {
+        thread_local bool c = false;
+        return c;
+    }
+
+    public:
+    static void *alloc() {
+        if (closed()) return ::operator new(sizeof(T));
+        auto &fl = local();
+        if (!fl.chunks.empty())
+        {
+            void *p = fl.chunks.back();
+            fl.chunks.pop_back();
+            fl.nreused++;
+            return p;
+        }
+        fl.nfresh++;
+        return ::operator new(sizeof(T));
+    }
+
+    static void free(void *p) {
+        if (!closed())
+        {
+            auto &fl = local();
+            if (fl.chunks.size() < fl.max_free)
+            {
+                fl.chunks.push_back(p);
+                return;
+            }
+        }
+        ::operator delete(p);
+    }
+
+    /** Preallocate n objects for the calling thread (e.g. the expected
+     * number of live objects in an epoch), and keep at least that many when
+     * they are freed. */
+    static void reserve(size_t n) {
+        auto &fl = local();
+        if (fl.max_free < n) fl.max_free = n;
+        fl.chunks.reserve(fl.max_free);
+        while (fl.chunks.size() < n)
+            fl.chunks.push_back(::operator new(sizeof(T)));
+    }
+
+    /** Set the maximum number of freed objects kept by the calling thread. */
+    static void set_max_free(size_t n) {
+        auto &fl = local();
+        fl.max_free = n;
+        while (fl.chunks.size() > n)
+        {
+            ::operator delete(fl.chunks.back());
+            fl.chunks.pop_back();
+        }
+    }
+
+    /** The number of objects taken from the heap by the calling thread. */
+    static uint64_t get_nfresh() { return local().nfresh; }
+    /** The number of objects recycled by the calling thread. */
+    static uint64_t get_nreused() { return local().nreused; }
+    static size_t get_nfree() { return local().chunks.size(); }
+};
+
+/** Make the heap allocation of T go through ObjectPool<T>. */
+template<typename T>
+class PoolAllocated {
+    public:
+    static void *operator new(size_t size) {
+        /* a derived class of a different size uses the heap */
+        if (size != sizeof(T)) return ::operator new(size);
+        return ObjectPool<T>::alloc();
+    }
+
+    static void operator delete(void *p, size_t size) {
+        if (size != sizeof(T)) return ::operator delete(p);
+        ObjectPool<T>::free(p);
+    }
+};
+
+template<typename T> class IntrusiveArc;
+
+/** Base of objects shared by IntrusiveArc. The reference count lives in the
+ * object itself, so sharing needs no separately allocated control block. */
+class IntrusiveRefCounted {
+    template<typename T> friend class IntrusiveArc;
+    mutable std::atomic<size_t> refcnt;
+
+    protected:
+    IntrusiveRefCounted(): refcnt(0) {}
+    /* a copy is a new object with no references */
+    IntrusiveRefCounted(const IntrusiveRefCounted &): refcnt(0) {}
+    IntrusiveRefCounted &operator=(const IntrusiveRefCounted &) { return *this; }
+};
+
+/** Atomically reference-counted pointer to an IntrusiveRefCounted object,
+ * with the same interface as ArcObj. */
+template<typename T>
+class IntrusiveArc {
+    T *obj;
+
+    void acquire() const {
+        if (obj) obj->refcnt.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    void release() {
+        if (obj && obj->refcnt.fetch_sub(1, std::memory_order_acq_rel) == 1)
+            delete obj;
+    }
+
+    public:
+    using type = T;
+
+    IntrusiveArc(T *obj = nullptr): obj(obj) { acquire(); }
+    IntrusiveArc(const IntrusiveArc &other): obj(other.obj) { acquire(); }
+    IntrusiveArc(IntrusiveArc &&other): obj(other.obj) { other.obj = nullptr; }
+    ~IntrusiveArc() { release(); }
+
+    IntrusiveArc &operator=(IntrusiveArc other) {
+        std::swap(obj, other.obj);
+        return *this;
+    }
+
+    T *get() const { return obj; }
+    T *operator->() const { return obj; }
+    T &operator*() const { return *obj; }
+    operator bool() const { return obj != nullptr; }
+    size_t get_cnt() const { return obj ? obj->refcnt.load() : 0; }
+
+    bool operator==(const IntrusiveArc &other) const { return obj == other.obj; }
+    bool operator!=(const IntrusiveArc &other) const { return obj != other.obj; }
+    bool operator==(std::nullptr_t) const { return obj == nullptr; }
+    bool operator!=(std::nullptr_t) const { return obj != nullptr; }
+    bool operator<(const IntrusiveArc &other) const { return obj < other.obj; }
+};
+
+}
+
+namespace std {
+    template<typename T>
+    struct hash<hotstuff::IntrusiveArc<T>> {
+        size_t operator()(const hotstuff::IntrusiveArc<T> &k) const {
+            return hash<T *>()(k.get());
+        }
+    };
+}
+
+#endif
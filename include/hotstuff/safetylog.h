@@ -0,0 +1,102 @@
+/**
+ * Copyright 2018 VMware
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _HOTSTUFF_SAFETYLOG_H
+#define _HOTSTUFF_SAFETYLOG_H
+
+#include <string>
+
+#include "hotstuff/type.h"
+
+namespace hotstuff {
+
+/** Write-ahead log of the safety state of the replica (the voted height, the
+ * locked block and the highest QC), so that a restarted replica does not
+ * vote twice or unlock.
+ *
+ * Only the latest state matters, so the log is a fixed-size file that is
+ * preallocated (and zero-filled) once and then written round-robin: a write
+ * is a single pwrite of a slot-aligned record followed by fdatasync, which
+ * does not touch the file metadata. Each record carries a sequence number
+ * and a CRC-32C; on recovery the valid record with the highest sequence
+ * number wins, so a torn write just falls back to the previous state. */
+class SafetyLog {
+    public:
+    /** when a vote may be sent relative to the persistence of the state */
+    enum Mode {
+        MODE_SYNC,      /**< write and sync before each vote */
+        MODE_GROUP,     /**< votes wait for a sync shared by all the states
+                             changed meanwhile (group commit) */
+        MODE_ASYNC      /**< votes do not wait; the state is synced in the
+                             background and may be lost on a crash */
+    };
+
+    struct Config {
+        std::string path;
+        Mode mode;
+        /** the size of the preallocated file */
+        size_t file_size;
+        /** records start at multiples of this (a multiple of 4096 for
+         * O_DIRECT) */
+        size_t slot_size;
+        /** bypass the page cache with O_DIRECT */
+        bool direct;
+        Config(): mode(MODE_GROUP), file_size(1 << 20),
+                slot_size(4096), direct(false) {}
+    };
+
+    private:
+    static const uint32_t magic = 0x48535346; /* "HSSF" */
+    static const size_t header_size = 24;
+
+    Config config;
+    int fd;
+    uint64_t seq;
+    /** offset of the next record */
+    uint64_t next_off;
+    /** slot-aligned write buffer (aligned for O_DIRECT) */
+    uint8_t *buf;
+    size_t buf_size;
+
+    void prepare_file();
+    void reserve_buf(size_t size);
+
+    public:
+    SafetyLog(const Config &config);
+    ~SafetyLog();
+
+    SafetyLog(const SafetyLog &) = delete;
+    SafetyLog &operator=(const SafetyLog &) = delete;
+
+    /** Find the latest state in the log and open it for writing. Must be
+     * called once before write().
+     * @return false if there is no valid state */
+    bool recover(bytearray_t &state);
+
+    /** Write a state and wait until it is durable. It does not touch other
+     * members than the file position, so it may run on a worker thread as
+     * long as the calls are not concurrent. */
+    void write(const uint8_t *data, size_t len);
+
+    Mode get_mode() const { return config.mode; }
+    static const char *mode_name(Mode mode);
+    /** @return false if the name is not a mode */
+    static bool parse_mode(const std::string &name, Mode &mode);
+};
+
+}
+
+#endif
@@ -17,51 +17,161 @@
 #ifndef _HOTSTUFF_WORKER_H
 #define _HOTSTUFF_WORKER_H
 
+#include <algorithm>
+#include <functional>
+#include <list>
 #include <thread>
 #include <unordered_map>
 #include <unistd.h>
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
 
 #include "salticidae/event.h"
+#include "hotstuff/type.h"
 #include "hotstuff/util.h"
+#include "hotstuff/pool.h"
 
 namespace hotstuff {
 
 class VeriTask {
     friend class VeriPool;
     bool result;
+    /** index of the VeriPool slot holding the task */
+    uint32_t slot;
+    /** index of the worker the task was dealt to */
+    uint32_t worker;
     public:
     virtual bool verify() = 0;
     virtual ~VeriTask() = default;
 };
 
+/** A task running an arbitrary function on a VeriPool worker, e.g. to move
+ * signing off the event loop. The return value is used as the result. */
+class FuncTask: public VeriTask, public PoolAllocated<FuncTask> {
+    std::function<bool()> func;
+    public:
+    FuncTask(std::function<bool()> func): func(std::move(func)) {}
+    bool verify() override { return func(); }
+};
+
+/** Bounded LRU set of digests of certificates that were successfully
+ * verified, so the same certificate seen again costs a lookup instead of
+ * signature checks. Only accessed from the thread owning the VeriPool. */
+class VeriCache {
+    using lru_t = std::list<uint256_t>;
+    size_t capacity;
+    lru_t lru;
+    std::unordered_map<uint256_t, lru_t::iterator> index;
+    uint64_t nhit;
+    uint64_t nmiss;
+
+    public:
+    VeriCache(size_t capacity): capacity(capacity), nhit(0), nmiss(0) {}
+
+    bool lookup(const uint256_t &digest) {
+        auto it = index.find(digest);
+        if (it == index.end())
+        {
+            nmiss++;
+            return false;
+        }
+        lru.splice(lru.begin(), lru, it->second);
+        nhit++;
+        return true;
+    }
+
+    void insert(const uint256_t &digest) {
+        if (!capacity || index.count(digest)) return;
+        if (lru.size() >= capacity)
+        {
+            index.erase(lru.back());
+            lru.pop_back();
+        }
+        index.insert(std::make_pair(digest, lru.insert(lru.begin(), digest)));
+    }
+
+    size_t size() const { return lru.size(); }
+    uint64_t get_nhit() const { return nhit; }
+    uint64_t get_nmiss() const { return nmiss; }
+};
+
 using salticidae::ThreadCall;
 using veritask_ut = BoxObj<VeriTask>;
 using mpmc_queue_t = salticidae::MPMCQueueEventDriven<VeriTask *>;
 using mpsc_queue_t = salticidae::MPSCQueueEventDriven<VeriTask *>;
 
+/** Pool of verification workers. Each worker has its own input queue, and
+ * each task is dealt to the worker with the fewest unfinished tasks, so that
+ * the workers do not all contend on one queue head and an idle worker gets
+ * the next task while another is busy with a long one (e.g. a whole QC). A
+ * worker that drains its queue also steals from the queues of the others. */
 class VeriPool {
-    mpmc_queue_t in_queue;
     mpsc_queue_t out_queue;
 
     struct Worker {
         std::thread handle;
         EventContext ec;
         BoxObj<ThreadCall> tcall;
+        BoxObj<mpmc_queue_t> queue;
+        /** tasks dealt to the worker and not completed yet (only accessed
+         * by the thread owning the pool) */
+        size_t nqueued;
+        Worker(): nqueued(0) {}
+    };
+
+    /** A pending task and the promise resolved with its result. Slots are
+     * addressed by the index stored in the task, so that submitting and
+     * completing a task needs neither hashing nor allocating map nodes. */
+    struct Slot {
+        veritask_ut task;
+        promise_t pm;
+        Slot(): task(nullptr) {}
     };
 
     std::vector<Worker> workers;
-    std::unordered_map<VeriTask *, std::pair<veritask_ut, promise_t>> pms;
+    size_t next_worker;
+    std::vector<Slot> slots;
+    std::vector<uint32_t> free_slots;
+    VeriCache cache;
+    VeriCache part_cache;
+
+    bool steal(size_t i, VeriTask *&task) {
+        for (size_t j = 1; j < workers.size(); j++)
+            if (workers[(i + j) % workers.size()].queue->try_dequeue(task))
+                return true;
+        return false;
+    }
+
+    void grow_slots() {
+        size_t old_size = slots.size();
+        size_t new_size = old_size ? old_size << 1 : 1024;
+        slots.resize(new_size);
+        for (size_t i = new_size; i > old_size; i--)
+            free_slots.push_back(i - 1);
+    }
 
     public:
-    VeriPool(EventContext ec, size_t nworker, size_t burst_size = 128) {
+    VeriPool(EventContext ec, size_t nworker, size_t burst_size = 128,
+            size_t cache_size = 4096, size_t part_cache_size = 1024):
+            next_worker(0), cache(cache_size), part_cache(part_cache_size) {
+        grow_slots();
         out_queue.reg_handler(ec, [this, burst_size](mpsc_queue_t &q) {
             size_t cnt = burst_size;
             VeriTask *task;
             while (q.try_dequeue(task))
             {
-                auto it = pms.find(task);
-                it->second.second.resolve(task->result);
-                pms.erase(it);
+                auto idx = task->slot;
+                bool result = task->result;
+                if (!workers.empty()) workers[task->worker].nqueued--;
+                auto &slot = slots[idx];
+                /* release the slot before resolving, as the callbacks may
+                 * submit new tasks */
+                promise_t pm = std::move(slot.pm);
+                slot.task = nullptr;
+                free_slots.push_back(idx);
+                pm.resolve(result);
                 if (!--cnt) return true;
             }
             return false;
@@ -70,10 +180,12 @@ class VeriPool {
         workers.resize(nworker);
         for (size_t i = 0; i < nworker; i++)
         {
-            in_queue.reg_handler(workers[i].ec, [this, burst_size](mpmc_queue_t &q) {
+            auto &w = workers[i];
+            w.queue = new mpmc_queue_t();
+            w.queue->reg_handler(w.ec, [this, i, burst_size](mpmc_queue_t &q) {
                 size_t cnt = burst_size;
                 VeriTask *task;
-                while (q.try_dequeue(task))
+                while (q.try_dequeue(task) || steal(i, task))
                 {
                     HOTSTUFF_LOG_DEBUG("%lx working on %u",
                                         std::this_thread::get_id(), (uintptr_t)task);
@@ -101,13 +213,65 @@ class VeriPool {
     }
 
     promise_t verify(veritask_ut &&task) {
+        if (free_slots.empty()) grow_slots();
+        auto idx = free_slots.back();
+        free_slots.pop_back();
+        auto &slot = slots[idx];
         auto ptr = task.get();
-        auto ret = pms.insert(std::make_pair(ptr,
-                std::make_pair(std::move(task), promise_t([](promise_t &){}))));
-        assert(ret.second);
-        in_queue.enqueue(ptr);
-        return ret.first->second.second;
+        ptr->slot = idx;
+        slot.task = std::move(task);
+        slot.pm = promise_t([](promise_t &){});
+        if (workers.empty())
+        {
+            /* no worker thread, verify in place */
+            ptr->result = ptr->verify();
+            out_queue.enqueue(ptr);
+        }
+        else
+        {
+            /* the least loaded worker, starting from the next one in turn */
+            size_t i = next_worker;
+            for (size_t j = 1; j < workers.size(); j++)
+            {
+                size_t k = (next_worker + j) % workers.size();
+                if (workers[k].nqueued < workers[i].nqueued) i = k;
+            }
+            if (++next_worker == workers.size()) next_worker = 0;
+            ptr->worker = i;
+            workers[i].nqueued++;
+            workers[i].queue->enqueue(ptr);
+        }
+        return slot.pm;
     }
+
+    /** Pin the i-th worker to CPU (cpu_base + i) modulo the number of CPUs.
+     * @return false if it is not supported or fails for some worker */
+    bool set_affinity(size_t cpu_base) {
+#ifdef __linux__
+        size_t ncpu = std::max(std::thread::hardware_concurrency(), 1u);
+        bool ok = true;
+        for (size_t i = 0; i < workers.size(); i++)
+        {
+            cpu_set_t cpuset;
+            CPU_ZERO(&cpuset);
+            CPU_SET((cpu_base + i) % ncpu, &cpuset);
+            if (pthread_setaffinity_np(workers[i].handle.native_handle(),
+                                        sizeof(cpu_set_t), &cpuset))
+                ok = false;
+        }
+        return ok;
+#else
+        (void)cpu_base;
+        return false;
+#endif
+    }
+
+    /** The cache of verified quorum certificates, keyed by their digests. */
+    VeriCache &get_cache() { return cache; }
+    /** The cache of verified partial certificates. It is kept apart (and
+     * smaller), as almost every vote is seen once and would otherwise evict
+     * the QCs that are verified again and again. */
+    VeriCache &get_part_cache() { return part_cache; }
 };
 
 }
@@ -77,6 +77,60 @@ extern Logger logger;
 
 #define HOTSTUFF_LOG_ERROR(...) hotstuff::logger.error(__VA_ARGS__)
 
+/** Compute the CRC-32C (Castagnoli) checksum of a buffer, continuing from
+ * a previous value of crc. Used to detect torn or corrupted records on disk. */
+uint32_t crc32c(const uint8_t *data, size_t len, uint32_t crc = 0);
+
+/** Histogram of latencies using power-of-two buckets in microseconds. */
+class LatencyHistogram {
+    static const size_t nbuckets = 32;
+    uint64_t buckets[nbuckets];
+    uint64_t cnt;
+    double sum;
+    double max;
+
+    public:
+    LatencyHistogram() { clear(); }
+
+    void clear() {
+        for (auto &b: buckets) b = 0;
+        cnt = 0;
+        sum = 0;
+        max = 0;
+    }
+
+    void add(double sec) {
+        uint64_t us = sec * 1e6;
+        size_t i = 0;
+        for (; us && i + 1 < nbuckets; i++) us >>= 1;
+        buckets[i]++;
+        cnt++;
+        sum += sec;
+        if (sec > max) max = sec;
+    }
+
+    /** Get the upper bound (in seconds) of the bucket holding the p-th
+     * percentile. */
+    double percentile(double p) const {
+        uint64_t target = cnt * p / 100;
+        uint64_t acc = 0;
+        for (size_t i = 0; i < nbuckets; i++)
+            if ((acc += buckets[i]) > target)
+                return (1ull << i) / 1e6;
+        return max;
+    }
+
+    size_t size() const { return cnt; }
+
+    void print(const char *name) const {
+        HOTSTUFF_LOG_INFO("%s: %lu, %.3f ms avg, p50 < %.3f ms, p99 < %.3f ms, %.3f ms max",
+                name, cnt,
+                cnt ? sum / cnt * 1e3 : 0,
+                percentile(50) * 1e3, percentile(99) * 1e3,
+                max * 1e3);
+    }
+};
+
 #ifdef HOTSTUFF_BLK_PROFILE
 class BlockProfiler {
     enum BlockState {
@@ -0,0 +1,16 @@
+#!/bin/bash
+# Run the replicas as in run_demo.sh, with the client commands disseminated in
+# batches, and one client per replica sending each command to a single
+# replica. Compare the throughput with run_demo.sh + run_demo_client.sh.
+batch_size=${BATCH_SIZE:-100}
+rep=({0..3})
+for i in "${rep[@]}"; do
+    echo "starting replica $i"
+    ./examples/hotstuff-app --conf ./hotstuff-sec${i}.conf --batch-size "$batch_size" > log${i} 2>&1 &
+done
+sleep 1
+for i in "${rep[@]}"; do
+    echo "starting client $i"
+    ./examples/hotstuff-client --idx "$i" --iter -1 --max-async 400 --nsend 1 > clog${i} 2>&1 &
+done
+wait
@@ -0,0 +1,324 @@
+/**
+ * Copyright 2018 VMware
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "hotstuff/util.h"
+#include "hotstuff/blocklog.h"
+
+#define LOG_INFO HOTSTUFF_LOG_INFO
+#define LOG_WARN HOTSTUFF_LOG_WARN
+
+namespace hotstuff {
+
+const uint32_t BlockLog::magic;
+const size_t BlockLog::header_size;
+
+static std::runtime_error log_error(const std::string &what) {
+    return std::runtime_error("block log: " + what + ": " + strerror(errno));
+}
+
+static void write_all(int fd, const uint8_t *data, size_t len) {
+    while (len)
+    {
+        ssize_t ret = write(fd, data, len);
+        if (ret < 0)
+        {
+            if (errno == EINTR) continue;
+            throw log_error("cannot write");
+        }
+        data += ret;
+        len -= ret;
+    }
+}
+
+static void sync_fd(int fd) {
+#ifdef __linux__
+    if (fdatasync(fd) < 0)
+#else
+    if (fsync(fd) < 0)
+#endif
+        throw log_error("cannot sync");
+}
+
+BlockLog::BlockLog(const Config &config):
+    config(config), fd(-1), fd_seg(0), seg_id(0), seg_size(0),
+    pending_bytes(0), flushing(false), failed(false),
+    nrecord(0), nsync(0), nsync_bytes(0) {
+    if (mkdir(config.dir.c_str(), 0755) < 0 && errno != EEXIST)
+        throw log_error("cannot create " + config.dir);
+}
+
+BlockLog::~BlockLog() {
+    if (fd < 0) return;
+    /* the records of an unfinished flush are lost as in a crash */
+    if (!flushing)
+    {
+        try {
+            sync();
+        } catch (std::runtime_error &err) {
+            LOG_WARN("%s", err.what());
+        }
+    }
+    close(fd);
+}
+
+std::string BlockLog::seg_path(uint32_t id) const {
+    char name[32];
+    snprintf(name, sizeof name, "/blk-%08u.log", id);
+    return config.dir + name;
+}
+
+void BlockLog::open_segment(uint32_t id, uint64_t size) {
+    if (fd >= 0) close(fd);
+    auto path = seg_path(id);
+    bool created = true;
+    fd = open(path.c_str(), O_WRONLY | O_CREAT | O_EXCL, 0644);
+    if (fd < 0 && errno == EEXIST)
+    {
+        created = false;
+        fd = open(path.c_str(), O_WRONLY);
+    }
+    if (fd < 0)
+        throw log_error("cannot open " + path);
+    /* also drops a torn record at the tail */
+    if (ftruncate(fd, size) < 0 || lseek(fd, size, SEEK_SET) < 0)
+        throw log_error("cannot truncate " + path);
+    /* a new segment is not durable until its directory entry is */
+    if (created) sync_dir();
+    fd_seg = id;
+}
+
+void BlockLog::sync_dir() const {
+    int dfd = open(config.dir.c_str(), O_RDONLY | O_DIRECTORY);
+    if (dfd < 0)
+        throw log_error("cannot open " + config.dir);
+    int ret = fsync(dfd);
+    close(dfd);
+    if (ret < 0)
+        throw log_error("cannot sync " + config.dir);
+}
+
+uint64_t BlockLog::scan_segment(uint32_t id, const recover_cb_t &cb) {
+    auto path = seg_path(id);
+    int rfd = open(path.c_str(), O_RDONLY);
+    if (rfd < 0)
+        throw log_error("cannot open " + path);
+    struct stat st;
+    if (fstat(rfd, &st) < 0)
+    {
+        close(rfd);
+        throw log_error("cannot stat " + path);
+    }
+    uint64_t size = st.st_size;
+    if (size == 0)
+    {
+        close(rfd);
+        return 0;
+    }
+    auto base = (const uint8_t *)mmap(nullptr, size, PROT_READ, MAP_PRIVATE, rfd, 0);
+    close(rfd);
+    if (base == MAP_FAILED)
+        throw log_error("cannot map " + path);
+    madvise((void *)base, size, MADV_SEQUENTIAL);
+    uint64_t off = 0;
+    try {
+        while (off + header_size + 32 <= size)
+        {
+            const uint8_t *rec = base + off;
+            uint32_t m, len, crc;
+            memcpy(&m, rec, 4);
+            memcpy(&len, rec + 8, 4);
+            memcpy(&crc, rec + 12, 4);
+            uint8_t type = rec[4];
+            if (letoh(m) != magic) break;
+            len = letoh(len);
+            if (len > size - off - header_size - 32) break;
+            const uint8_t *body = rec + header_size;
+            if (crc32c(body, 32 + len, crc32c(&type, 1)) != letoh(crc)) break;
+            uint256_t blk_hash(bytearray_t(body, body + 32));
+            if (type == REC_BLOCK)
+                index[blk_hash] = Location{id, (uint32_t)off, len};
+            nrecord++;
+            cb((RecordType)type, blk_hash, body + 32, len);
+            off += header_size + 32 + len;
+        }
+    } catch (...) {
+        munmap((void *)base, size);
+        throw;
+    }
+    munmap((void *)base, size);
+    if (off < size)
+        LOG_WARN("block log: %s has %lu invalid bytes after offset %lu",
+                path.c_str(), size - off, off);
+    return off;
+}
+
+size_t BlockLog::recover(const recover_cb_t &cb) {
+    struct stat st;
+    uint32_t nseg = 0;
+    while (stat(seg_path(nseg).c_str(), &st) == 0) nseg++;
+    uint64_t tail = 0;
+    for (uint32_t id = 0; id < nseg; id++)
+    {
+        tail = scan_segment(id, cb);
+        /* only the last segment may end with a torn record */
+        if (id + 1 < nseg &&
+            (stat(seg_path(id).c_str(), &st) < 0 || (uint64_t)st.st_size != tail))
+            throw std::runtime_error("block log: corrupted segment " + seg_path(id));
+    }
+    open_segment(nseg ? nseg - 1 : 0, tail);
+    seg_id = fd_seg;
+    seg_size = tail;
+    return nrecord;
+}
+
+void BlockLog::append(RecordType type, const uint256_t &blk_hash,
+                    const uint8_t *data, size_t len) {
+    if (fd < 0)
+        throw std::runtime_error("block log: append before recovery");
+    if (failed)
+        throw std::runtime_error("block log: append after a failed flush");
+    size_t rec_size = header_size + 32 + len;
+    if (seg_size && seg_size + rec_size > config.segment_size)
+    {
+        /* the new segment is opened by the flush reaching it */
+        seg_id++;
+        seg_size = 0;
+    }
+    if (pending.empty() || pending.back().seg != seg_id)
+        pending.push_back(Chunk{seg_id, seg_size, bytearray_t()});
+    auto &wbuf = pending.back().data;
+    DataStream hs;
+    hs << blk_hash;
+    size_t pos = wbuf.size();
+    wbuf.resize(pos + rec_size);
+    uint8_t *rec = &wbuf[pos];
+    uint8_t t = type;
+    uint32_t v = htole(magic);
+    memset(rec, 0, header_size);
+    memcpy(rec, &v, 4);
+    rec[4] = t;
+    v = htole((uint32_t)len);
+    memcpy(rec + 8, &v, 4);
+    memcpy(rec + header_size, hs.data(), 32);
+    if (len) memcpy(rec + header_size + 32, data, len);
+    v = htole(crc32c(rec + header_size, 32 + len, crc32c(&t, 1)));
+    memcpy(rec + 12, &v, 4);
+    if (type == REC_BLOCK)
+        index[blk_hash] = Location{seg_id, (uint32_t)seg_size, (uint32_t)len};
+    seg_size += rec_size;
+    pending_bytes += rec_size;
+    nrecord++;
+}
+
+bool BlockLog::start_flush() {
+    if (flushing || failed || pending.empty()) return false;
+    inflight = std::move(pending);
+    pending.clear();
+    pending_bytes = 0;
+    flushing = true;
+    return true;
+}
+
+void BlockLog::write_inflight() {
+    for (const auto &c: inflight)
+    {
+        if (c.seg != fd_seg)
+        {
+            /* the previous segment is complete */
+            sync_fd(fd);
+            open_segment(c.seg, c.off);
+        }
+        write_all(fd, c.data.data(), c.data.size());
+    }
+    sync_fd(fd);
+}
+
+void BlockLog::finish_flush(bool ok) {
+    flushing = false;
+    if (!ok)
+    {
+        LOG_WARN("block log: giving up after a failed flush");
+        failed = true;
+        /* forget the blocks that did not make it */
+        for (auto it = index.begin(); it != index.end();)
+        {
+            bool lost = false;
+            for (const auto *chunks: {&inflight, &pending})
+                for (const auto &c: *chunks)
+                    lost |= c.seg == it->second.seg && it->second.off >= c.off;
+            if (lost) it = index.erase(it);
+            else it++;
+        }
+        pending.clear();
+        pending_bytes = 0;
+    }
+    else
+    {
+        nsync++;
+        for (const auto &c: inflight)
+            nsync_bytes += c.data.size();
+    }
+    inflight.clear();
+}
+
+void BlockLog::sync() {
+    if (!start_flush()) return;
+    try {
+        write_inflight();
+    } catch (...) {
+        finish_flush(false);
+        throw;
+    }
+    finish_flush(true);
+}
+
+bool BlockLog::read_blk(const uint256_t &blk_hash, bytearray_t &out) const {
+    auto it = index.find(blk_hash);
+    if (it == index.end()) return false;
+    const auto &loc = it->second;
+    out.resize(loc.len);
+    for (const auto *chunks: {&inflight, &pending})
+        for (const auto &c: *chunks)
+            if (c.seg == loc.seg && loc.off >= c.off &&
+                loc.off < c.off + c.data.size())
+            {
+                /* still buffered (the worker only reads it) */
+                memcpy(out.data(), &c.data[loc.off - c.off + header_size + 32], loc.len);
+                return true;
+            }
+    int rfd = open(seg_path(loc.seg).c_str(), O_RDONLY);
+    if (rfd < 0) return false;
+    ssize_t ret = pread(rfd, out.data(), loc.len, loc.off + header_size + 32);
+    close(rfd);
+    return ret == (ssize_t)loc.len;
+}
+
+void BlockLog::print_stat() const {
+    LOG_INFO("-------- blk_log ------");
+    LOG_INFO("records: %lu, blocks: %lu, segment: %u%s",
+            nrecord, index.size(), seg_id, failed ? " (failed)" : "");
+    LOG_INFO("syncs: %lu, avg. batch: %.1f bytes",
+            nsync, nsync ? nsync_bytes / double(nsync) : 0);
+}
+
+}
@@ -16,7 +16,6 @@
  */
 
 #include <cassert>
-#include <stack>
 
 #include "hotstuff/util.h"
 #include "hotstuff/consensus.h"
@@ -37,8 +36,11 @@ HotStuffCore::HotStuffCore(ReplicaID id,
         b_lock(b0),
         b_exec(b0),
         vheight(0),
+        recovered_lock_height(0),
         priv_key(std::move(priv_key)),
         tails{b0},
+        prune_staleness(-1),
+        checkpoint_height(0),
         vote_disabled(false),
         id(id),
         storage(new EntityStorage()),
@@ -122,6 +124,7 @@ bool HotStuffCore::on_deliver_blk(const block_t &blk) {
     tails.insert(blk);
 
     blk->delivered = true;
+    prune_queue.push(blk);
     LOG_DEBUG("deliver %s", std::string(*blk).c_str());
     return true;
 }
@@ -170,6 +173,8 @@ void HotStuffCore::update(const block_t &nblk) {
     /* commit requires direct parent */
     if (blk1->parents[0] != blk) return;
 #endif
+    /* the history below an installed checkpoint was skipped */
+    if (blk->height <= checkpoint_height) return;
     /* otherwise commit */
     std::vector<block_t> commit_queue;
     block_t b;
@@ -185,14 +190,15 @@ void HotStuffCore::update(const block_t &nblk) {
     {
         const block_t &blk = *it;
         blk->decision = 1;
-        do_consensus(blk);
         LOG_PROTO("commit %s", std::string(*blk).c_str());
         std::vector<uint256_t> vectorized_cmds = blk->get_proposed_orderedlist().convert_to_vec();
         for (size_t i = 0; i < vectorized_cmds.size(); i++)
             do_decide(Finality(id, 1, i, blk->height,
                                vectorized_cmds[i], blk->get_hash()));
+        do_consensus(blk);
     }
     b_exec = blk;
+    if (prune_staleness >= 0) prune(prune_staleness);
 }
 
 block_t HotStuffCore::on_propose(const std::vector<block_t> &parents,
@@ -221,51 +227,76 @@ block_t HotStuffCore::on_propose(const std::vector<block_t> &parents,
     if (bnew->height <= vheight)
         throw std::runtime_error("new block should be higher than vheight");
     vheight = bnew->height;
-    on_receive_vote(
-        Vote(id, bnew_hash,
-            create_part_cert(*priv_key, bnew_hash), this));
+    if (recovered_lock_height) resolve_recovered_lock();
+    /* as in on_receive_proposal(), no vote below a missing locked block */
+    if (!recovered_lock_height || hqc.first->height > recovered_lock_height)
+        promise::all(std::vector<promise_t>{
+            async_create_part_cert(bnew_hash),
+            async_persist_safety()
+        }).then([this, bnew_hash]() {
+            on_receive_vote(Vote(id, bnew_hash, take_part_cert(bnew_hash), this));
+        });
     on_propose_(prop);
     /* boradcast to other replicas */
     do_broadcast_proposal(prop);
     return bnew;
 }
 
-void HotStuffCore::on_receive_proposal(const Proposal &prop) {
-    LOG_PROTO("got %s", std::string(prop).c_str());
-    block_t bnew = prop.blk;
-    sanity_check_delivered(bnew);
-    // checking for any new commands the replica is seeing for first time
-    for (auto &cmd : bnew->get_proposed_orderedlist().convert_to_vec())
+bool HotStuffCore::check_proposal_fairness(const block_t &bnew, uint64_t now) const {
+    // commands the replica has not seen yet are taken as seen now; they are
+    // only recorded by record_proposal_cmds() once the block is delivered
+    HOTSTUFF_LOG_PROTO("The timestamps in the proposed ordered list received at the replica are");
+    std::vector<std::vector<uint64_t>> vectorized_timestamps = command_timestamp_storage->get_timestamps_1(bnew->get_proposed_orderedlist(), now);
+    for (auto rank = 0; rank < vectorized_timestamps.size(); rank++)
     {
-        if (command_timestamp_storage->is_new_command(cmd))
+        for (auto &ts : vectorized_timestamps[rank])
         {
-            command_timestamp_storage->add_command_to_storage(cmd);
+            HOTSTUFF_LOG_PROTO("(Rank, timestamp): (%lu, %s)", rank, boost::lexical_cast<std::string>(ts).c_str());
         }
     }
+    return acceptable_fairness_check(vectorized_timestamps, delta_max);
+}
 
-    // get timestamps associated with the leader proposed orderedlist
-    HOTSTUFF_LOG_PROTO("The timestamps in the proposed ordered list received at the replica are");
-    std::vector<std::vector<uint64_t>> vectorized_timestamps = command_timestamp_storage->get_timestamps_1(bnew->get_proposed_orderedlist());
-    for (auto rank = 0; rank < vectorized_timestamps.size(); rank++)
+void HotStuffCore::record_proposal_cmds(const block_t &bnew, uint64_t now) {
+    // checking for any new commands the replica is seeing for first time,
+    // they all arrive with this proposal so one clock read stamps them all
+    for (auto &cmd : bnew->get_proposed_orderedlist().convert_to_vec())
     {
-        for (auto &ts : vectorized_timestamps[rank])
+        if (command_timestamp_storage->is_new_command(cmd))
         {
-            HOTSTUFF_LOG_PROTO("(Rank, timestamp): (%lu, %s)", rank, boost::lexical_cast<std::string>(ts).c_str());
+            command_timestamp_storage->add_command_to_storage(cmd, now);
         }
     }
-    if (acceptable_fairness_check(vectorized_timestamps, delta_max))
+}
+
+void HotStuffCore::on_receive_proposal(const Proposal &prop) {
+    sanity_check_delivered(prop.blk);
+    uint64_t now = CommandTimestampStorage::get_current_timestamp();
+    bool fair = check_proposal_fairness(prop.blk, now);
+    record_proposal_cmds(prop.blk, now);
+    on_receive_proposal(prop, fair);
+}
+
+void HotStuffCore::on_receive_proposal(const Proposal &prop, bool fair) {
+    LOG_PROTO("got %s", std::string(prop).c_str());
+    block_t bnew = prop.blk;
+    sanity_check_delivered(bnew);
+    if (fair)
     {
         command_timestamp_storage->refresh_available_cmds(bnew->get_proposed_orderedlist().convert_to_vec());
         update(bnew);
+        if (recovered_lock_height) resolve_recovered_lock();
         bool opinion = false;
         if (bnew->height > vheight)
         {
-            if (bnew->qc_ref && bnew->qc_ref->height > b_lock->height)
+            if (bnew->qc_ref && bnew->qc_ref->height > b_lock->height &&
+                bnew->qc_ref->height > recovered_lock_height)
             {
                 opinion = true; // liveness condition
                 vheight = bnew->height;
             }
-            else
+            /* a branch cannot be checked against a missing locked block */
+            else if (!recovered_lock_height)
             {   // safety condition (extend the locked branch)
                 block_t b;
                 for (b = bnew;
@@ -287,9 +318,16 @@ void HotStuffCore::on_receive_proposal(const Proposal &prop) {
         // std::vector<uint64_t> test_ts = replica_orderedlist->extract_timestamps();
 
         if (opinion && !vote_disabled)
-            do_vote(prop.proposer,
-                    Vote(id, bnew->get_hash(), 
-                        create_part_cert(*priv_key, bnew->get_hash()), this));
+        {
+            /* the new vheight (and b_lock) must be durable before the vote
+             * leaves the replica */
+            const uint256_t bnew_hash = bnew->get_hash();
+            ReplicaID proposer = prop.proposer;
+            async_persist_safety().then([this, proposer, bnew_hash]() {
+                do_vote(proposer,
+                        Vote(id, bnew_hash, take_part_cert(bnew_hash), this));
+            });
+        }
     }
 }
 
@@ -300,7 +338,7 @@ void HotStuffCore::on_receive_vote(const Vote &vote) {
     assert(vote.cert);
     size_t qsize = blk->voted.size();
     if (qsize >= config.nmajority) return;
-    if (!blk->voted.insert(vote.voter).second)
+    if (!blk->voted.insert(vote.voter))
     {
         LOG_WARN("duplicate vote for %s from %d", get_hex10(vote.blk_hash).c_str(), vote.voter);
         return;
@@ -320,9 +358,43 @@ void HotStuffCore::on_receive_vote(const Vote &vote) {
     }
 }
 /*** end HotStuff protocol logic ***/
+promise_t HotStuffCore::async_create_part_cert(const uint256_t &blk_hash) {
+    add_signed_ahead(blk_hash, create_part_cert(*priv_key, blk_hash));
+    return promise_t([](promise_t &pm) { pm.resolve(); });
+}
+
+promise_t HotStuffCore::async_persist_safety() {
+    return promise_t([](promise_t &pm) { pm.resolve(); });
+}
+
+void HotStuffCore::add_signed_ahead(const uint256_t &blk_hash, part_cert_bt &&cert) {
+    if (!signed_ahead.insert(std::make_pair(blk_hash, std::move(cert))).second)
+        return;
+    signed_ahead_queue.push(blk_hash);
+    /* drop the oldest ones that were never used (e.g. not voted) */
+    while (signed_ahead_queue.size() > signed_ahead_max)
+    {
+        signed_ahead.erase(signed_ahead_queue.front());
+        signed_ahead_queue.pop();
+    }
+}
+
+part_cert_bt HotStuffCore::take_part_cert(const uint256_t &blk_hash) {
+    auto it = signed_ahead.find(blk_hash);
+    if (it == signed_ahead.end())
+        return create_part_cert(*priv_key, blk_hash);
+    part_cert_bt cert = std::move(it->second);
+    /* the queue entry is left and skipped by erase() when it expires */
+    signed_ahead.erase(it);
+    return cert;
+}
+
 void HotStuffCore::on_init(uint32_t nfaulty) {
     config.nmajority = config.nreplicas - nfaulty;
     b0->qc = create_quorum_cert(b0->get_hash());
+    /* the genesis is identified by its hash with the dummy certificate, but
+     * is sent with the real one */
+    b0->encoded = BlockEncoding();
     b0->qc->compute();
     b0->self_qc = b0->qc->clone();
     b0->qc_ref = b0;
@@ -334,24 +406,126 @@ void HotStuffCore::prune(uint32_t staleness) {
     /* skip the blocks */
     for (start = b_exec; staleness; staleness--, start = start->parents[0])
         if (!start->parents.size()) return;
-    std::stack<block_t> s;
-    start->qc_ref = nullptr;
-    s.push(start);
-    while (!s.empty())
+    /* cut the links of the blocks below start (including the branches that
+     * were never committed), visiting each delivered block once */
+    while (!prune_queue.empty() &&
+            prune_queue.front()->height < start->height)
+    {
+        auto &blk = prune_queue.front();
+        blk->parents.clear();
+        blk->qc_ref = nullptr;
+        tails.erase(blk);
+        if (!release_blk(blk))
+            prune_retry.push_back(blk);
+        prune_queue.pop();
+    }
+    /* retry the blocks that were still in use */
+    for (size_t i = 0; i < prune_retry.size();)
     {
-        auto &blk = s.top();
-        if (blk->parents.empty())
+        if (release_blk(prune_retry[i]))
         {
-            storage->try_release_blk(blk);
-            s.pop();
-            continue;
+            prune_retry[i] = std::move(prune_retry.back());
+            prune_retry.pop_back();
         }
-        blk->qc_ref = nullptr;
-        s.push(blk->parents.back());
-        blk->parents.pop_back();
+        else i++;
+    }
+}
+
+void HotStuffCore::on_recover_commit(const block_t &blk) {
+    blk->decision = 1;
+    if (blk->height > b_exec->height) b_exec = blk;
+    /* a committed block was locked and voted */
+    if (blk->height > b_lock->height) b_lock = blk;
+    if (blk->height > vheight) vheight = blk->height;
+    if (prune_staleness >= 0) prune(prune_staleness);
+}
+
+void HotStuffCore::get_safety_state(DataStream &s) const {
+    s << htole(vheight);
+    /* a recovered lock still missing its block is kept as it is */
+    if (recovered_lock_height)
+        s << recovered_lock << htole(recovered_lock_height);
+    else
+        s << b_lock->get_hash() << htole(b_lock->height);
+    s << hqc.first->get_hash() << *hqc.second;
+}
+
+void HotStuffCore::resolve_recovered_lock() {
+    if (b_lock->height > recovered_lock_height)
+    {
+        recovered_lock_height = 0;
+        return;
+    }
+    block_t blk = storage->find_blk(recovered_lock);
+    if (blk && blk->is_delivered())
+    {
+        if (blk->height > b_lock->height) b_lock = blk;
+        recovered_lock_height = 0;
+        LOG_INFO("recovered locked block %s is delivered",
+                get_hex10(recovered_lock).c_str());
     }
 }
 
+void HotStuffCore::on_recover_safety(DataStream &s) {
+    uint32_t _vheight, lock_height;
+    uint256_t lock_hash, hqc_hash;
+    s >> _vheight >> lock_hash >> lock_height >> hqc_hash;
+    quorum_cert_bt qc = parse_quorum_cert(s);
+    _vheight = letoh(_vheight);
+    lock_height = letoh(lock_height);
+    if (_vheight > vheight) vheight = _vheight;
+    block_t blk = storage->find_blk(lock_hash);
+    if (blk && blk->is_delivered())
+    {
+        if (blk->height > b_lock->height) b_lock = blk;
+    }
+    else if (lock_height > b_lock->height)
+    {
+        /* e.g. no block log, or the block was not synced to it yet */
+        recovered_lock = lock_hash;
+        recovered_lock_height = lock_height;
+        LOG_WARN("locked block %s (height %u) is not recovered, only voting "
+                "above it until it is fetched",
+                get_hex10(lock_hash).c_str(), lock_height);
+    }
+    blk = storage->find_blk(hqc_hash);
+    if (blk && blk->is_delivered() && blk->height > hqc.first->height)
+        hqc = std::make_pair(blk, std::move(qc));
+    LOG_INFO("recovered safety state: %s", std::string(*this).c_str());
+}
+
+void HotStuffCore::on_install_checkpoint(const block_t &blk, uint32_t height,
+                                        const quorum_cert_bt &qc) {
+    if (blk->delivered || height <= b_exec->height) return;
+    /* the ancestors are skipped, so the block becomes the root of the
+     * chain, like the genesis block */
+    blk->parents.clear();
+    blk->qc_ref = nullptr;
+    blk->height = height;
+    blk->delivered = true;
+    blk->decision = 1;
+    checkpoint_height = height;
+    tails.clear();
+    tails.insert(blk);
+    prune_queue.push(blk);
+    b_exec = blk;
+    if (height > b_lock->height) b_lock = blk;
+    if (height > vheight) vheight = height;
+    if (height > hqc.first->height)
+    {
+        hqc = std::make_pair(blk, qc->clone());
+        on_hqc_update();
+    }
+    LOG_INFO("installed checkpoint: %s", std::string(*this).c_str());
+}
+
+bool HotStuffCore::release_blk(const block_t &blk) {
+    if (!storage->try_release_blk(blk)) return false;
+    orderedlist_storage->release_blk(blk->get_hash());
+    command_timestamp_storage->release_blk(*blk);
+    return true;
+}
+
 void HotStuffCore::add_replica(ReplicaID rid, const PeerId &peer_id,
                                 pubkey_bt &&pub_key) {
     config.add_replica(rid,
@@ -19,8 +19,31 @@
 
 namespace hotstuff {
 
-secp256k1_context_t secp256k1_default_sign_ctx = new Secp256k1Context(true);
-secp256k1_context_t secp256k1_default_verify_ctx = new Secp256k1Context(false);
+std::atomic<bool> Secp256k1Context::randomize_sign(true);
+
+Secp256k1Context::Secp256k1Context(bool sign, bool randomize):
+        ctx(secp256k1_context_create(
+            sign ? SECP256K1_CONTEXT_SIGN :
+                    SECP256K1_CONTEXT_VERIFY)) {
+    if (sign && randomize)
+    {
+        uint8_t seed[32];
+        if (!RAND_bytes(seed, sizeof seed) ||
+            !secp256k1_context_randomize(ctx, seed))
+            throw std::runtime_error("cannot randomize secp256k1 context");
+    }
+}
+
+const secp256k1_context *Secp256k1Context::get_sign() {
+    /* created on the first use by each thread */
+    thread_local Secp256k1Context ctx(true, randomize_sign);
+    return ctx.ctx;
+}
+
+const secp256k1_context *Secp256k1Context::get_verify() {
+    thread_local Secp256k1Context ctx(false);
+    return ctx.ctx;
+}
 
 QuorumCertSecp256k1::QuorumCertSecp256k1(
         const ReplicaConfig &config, const uint256_t &obj_hash):
@@ -36,8 +59,7 @@ bool QuorumCertSecp256k1::verify(const ReplicaConfig &config) {
             HOTSTUFF_LOG_DEBUG("checking cert(%d), obj_hash=%s",
                                 i, get_hex10(obj_hash).c_str());
             if (!sigs[i].verify(obj_hash,
-                            static_cast<const PubKeySecp256k1 &>(config.get_pubkey(i)),
-                            secp256k1_default_verify_ctx))
+                            static_cast<const PubKeySecp256k1 &>(config.get_pubkey(i))))
             return false;
         }
     return true;
@@ -46,20 +68,23 @@ bool QuorumCertSecp256k1::verify(const ReplicaConfig &config) {
 promise_t QuorumCertSecp256k1::verify(const ReplicaConfig &config, VeriPool &vpool) {
     if (sigs.size() < config.nmajority)
         return promise_t([](promise_t &pm) { pm.resolve(false); });
-    std::vector<promise_t> vpm;
+    /* the digest covers obj_hash, the signer set and all signatures */
+    auto digest = salticidae::get_hash(*this);
+    auto cache = &vpool.get_cache();
+    if (cache->lookup(digest))
+        return promise_t([](promise_t &pm) { pm.resolve(true); });
+    auto task = new Secp256k1QCVeriTask(obj_hash, sigs.size());
     for (size_t i = 0; i < rids.size(); i++)
         if (rids.get(i))
         {
             HOTSTUFF_LOG_DEBUG("checking cert(%d), obj_hash=%s",
                                 i, get_hex10(obj_hash).c_str());
-            vpm.push_back(vpool.verify(new Secp256k1VeriTask(obj_hash,
-                            static_cast<const PubKeySecp256k1 &>(config.get_pubkey(i)),
-                            sigs[i])));
+            task->add(static_cast<const PubKeySecp256k1 &>(config.get_pubkey(i)),
+                    sigs[i]);
         }
-    return promise::all(vpm).then([](const promise::values_t &values) {
-        for (const auto &v: values)
-            if (!promise::any_cast<bool>(v)) return false;
-        return true;
+    return vpool.verify(task).then([cache, digest](bool result) {
+        if (result) cache->insert(digest);
+        return result;
     });
 }
 
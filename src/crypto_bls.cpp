@@ -0,0 +1,86 @@
+/**
+ * Copyright 2018 VMware
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "hotstuff/entity.h"
+#include "hotstuff/crypto_bls.h"
+
+namespace hotstuff {
+
+bool BLSQCVeriTask::verify() {
+    if (pubkeys.empty()) return false;
+    blst_p1 agg;
+    blst_p1_from_affine(&agg, &pubkeys[0]->get_point());
+    for (size_t i = 1; i < pubkeys.size(); i++)
+        blst_p1_add_or_double_affine(&agg, &agg, &pubkeys[i]->get_point());
+    blst_p1_affine agg_pk;
+    blst_p1_to_affine(&agg_pk, &agg);
+    return SigBLS::verify(sig, msg, agg_pk);
+}
+
+QuorumCertBLS::QuorumCertBLS(
+        const ReplicaConfig &config, const uint256_t &obj_hash):
+            QuorumCert(), obj_hash(obj_hash), rids(config.nreplicas), nsigs(0), sum() {
+    rids.clear();
+}
+
+void QuorumCertBLS::add_part(ReplicaID rid, const PartCert &pc) {
+    if (pc.get_obj_hash() != obj_hash)
+        throw std::invalid_argument("PartCert does match the block hash");
+    if (rids.get(rid)) return;
+    const auto &part = static_cast<const PartCertBLS &>(pc).get_point();
+    if (nsigs)
+        blst_p2_add_or_double_affine(&sum, &sum, &part);
+    else
+        blst_p2_from_affine(&sum, &part);
+    rids.set(rid);
+    nsigs++;
+}
+
+void QuorumCertBLS::compute() {
+    if (!nsigs) return;
+    blst_p2_affine agg;
+    blst_p2_to_affine(&agg, &sum);
+    sig.set_point(agg);
+}
+
+bool QuorumCertBLS::verify(const ReplicaConfig &config) {
+    if (nsigs < config.nmajority || rids.size() != config.nreplicas)
+        return false;
+    BLSQCVeriTask task(obj_hash, sig.get_point(), nsigs);
+    for (size_t i = 0; i < rids.size(); i++)
+        if (rids.get(i))
+            task.add(static_cast<const PubKeyBLS &>(config.get_pubkey(i)));
+    return task.verify();
+}
+
+promise_t QuorumCertBLS::verify(const ReplicaConfig &config, VeriPool &vpool) {
+    if (nsigs < config.nmajority || rids.size() != config.nreplicas)
+        return promise_t([](promise_t &pm) { pm.resolve(false); });
+    auto digest = salticidae::get_hash(*this);
+    auto cache = &vpool.get_cache();
+    if (cache->lookup(digest))
+        return promise_t([](promise_t &pm) { pm.resolve(true); });
+    auto task = new BLSQCVeriTask(obj_hash, sig.get_point(), nsigs);
+    for (size_t i = 0; i < rids.size(); i++)
+        if (rids.get(i))
+            task->add(static_cast<const PubKeyBLS &>(config.get_pubkey(i)));
+    return vpool.verify(task).then([cache, digest](bool result) {
+        if (result) cache->insert(digest);
+        return result;
+    });
+}
+
+}
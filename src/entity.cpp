@@ -19,6 +19,11 @@
 
 namespace hotstuff {
 
+/* the number of commands of the pruned blocks remembered as not new */
+static const size_t committed_cmds_max = 1 << 20;
+/* the number of command arrivals kept for print */
+static const size_t cmd_history_max = 1 << 16;
+
 void OrderedList::serialize(DataStream &s) const {
     s << htole((uint32_t)cmds.size());
     for (const auto &cmd : cmds)
@@ -30,6 +35,10 @@ void OrderedList::serialize(DataStream &s) const {
 void OrderedList::unserialize(DataStream &s, HotStuffCore *hsc) {
     uint32_t n;
     s >> n;
+    n = letoh(n);
+    /* each command takes its hash and its timestamp */
+    if ((uint64_t)n * 40 > s.size())
+        throw std::runtime_error("truncated ordered list");
     cmds.resize(n);
     for (auto &cmd : cmds)
         s >> cmd;
@@ -38,7 +47,234 @@ void OrderedList::unserialize(DataStream &s, HotStuffCore *hsc) {
         s >> timestamp;
 }
 
+uint32_t PrecedenceMatrix::get_index(const uint256_t &cmd) {
+    auto it = index.find(cmd);
+    if (it != index.end()) return it->second;
+    uint32_t idx = cmds.size();
+    /* none of the orderings so far has the new command, so each has its
+     * commands before it */
+    for (uint32_t a = 0; a < idx; a++)
+        before[a].push_back(present[a]);
+    cmds.push_back(cmd);
+    present.push_back(0);
+    before.push_back(std::vector<uint32_t>(idx + 1, 0));
+    index.insert(std::make_pair(cmd, idx));
+    return idx;
+}
+
+/* the encoding of an ordered list (see OrderedList::serialize()) */
+static size_t list_bytes(const OrderedList &list) {
+    return 4 + list.cmds.size() * 40;
+}
+
+size_t PrecedenceMatrix::matrix_bytes() const {
+    size_t n = cmds.size();
+    return 8 + n * 34 + n * (n - 1) * 2;
+}
+
+void PrecedenceMatrix::drop_raw_if_larger() {
+    if (raw && raw_bytes > matrix_bytes())
+    {
+        raw = false;
+        lists.clear();
+        lists.shrink_to_fit();
+    }
+}
+
+void PrecedenceMatrix::add(const OrderedList &list) {
+    if (raw)
+    {
+        lists.push_back(list);
+        raw_bytes += list_bytes(list);
+    }
+    add_matrix(list);
+    drop_raw_if_larger();
+}
+
+void PrecedenceMatrix::add_matrix(const OrderedList &list) {
+    OrderedList sorted = list;
+    sorted.sort_cmds();
+    std::vector<uint32_t> idx;
+    for (const auto &cmd: sorted.cmds)
+        idx.push_back(get_index(cmd));
+    /* the position of each command in the ordering (-1 if absent) */
+    std::vector<int> pos(cmds.size(), -1);
+    for (size_t p = 0; p < idx.size(); p++)
+        pos[idx[p]] = p;
+    for (size_t p = 0; p < idx.size(); p++)
+    {
+        uint32_t a = idx[p];
+        auto &row = before[a];
+        present[a]++;
+        for (size_t b = 0; b < cmds.size(); b++)
+            if (b != a && (pos[b] < 0 || pos[b] > (int)p)) row[b]++;
+    }
+    total++;
+}
+
+void PrecedenceMatrix::merge(const PrecedenceMatrix &other) {
+    std::vector<uint32_t> idx;
+    for (const auto &cmd: other.cmds)
+        idx.push_back(get_index(cmd));
+    std::vector<bool> in_other(cmds.size(), false);
+    for (auto i: idx) in_other[i] = true;
+    for (size_t a = 0; a < idx.size(); a++)
+    {
+        auto &row = before[idx[a]];
+        /* the other orderings do not have the commands it does not cover */
+        for (size_t b = 0; b < cmds.size(); b++)
+            if (!in_other[b]) row[b] += other.present[a];
+        for (size_t b = 0; b < idx.size(); b++)
+            row[idx[b]] += other.before[a][b];
+        present[idx[a]] += other.present[a];
+    }
+    total += other.total;
+    if (raw && other.raw)
+    {
+        lists.insert(lists.end(), other.lists.begin(), other.lists.end());
+        raw_bytes += other.raw_bytes;
+        drop_raw_if_larger();
+    }
+    else
+    {
+        raw = false;
+        lists.clear();
+    }
+}
+
+uint32_t PrecedenceMatrix::get_before(const uint256_t &a, const uint256_t &b) const {
+    auto ia = index.find(a);
+    if (ia == index.end()) return 0;
+    auto ib = index.find(b);
+    if (ib == index.end()) return present[ia->second];
+    return before[ia->second][ib->second];
+}
+
+void PrecedenceMatrix::serialize(DataStream &s) const {
+    /* the counts are at most the number of replicas */
+    if (total > UINT16_MAX)
+        throw std::runtime_error("too many orderings in a summary");
+    s << (uint8_t)raw;
+    if (raw)
+    {
+        s << htole((uint32_t)lists.size());
+        for (const auto &list: lists)
+            list.serialize(s);
+        return;
+    }
+    s << htole(total) << htole((uint32_t)cmds.size());
+    for (size_t a = 0; a < cmds.size(); a++)
+        s << cmds[a] << htole((uint16_t)present[a]);
+    for (size_t a = 0; a < cmds.size(); a++)
+        for (size_t b = 0; b < cmds.size(); b++)
+            if (a != b) s << htole((uint16_t)before[a][b]);
+}
+
+void PrecedenceMatrix::unserialize(DataStream &s) {
+    uint8_t is_raw;
+    uint32_t n;
+    s >> is_raw;
+    *this = PrecedenceMatrix();
+    if (is_raw)
+    {
+        s >> n;
+        n = letoh(n);
+        if ((uint64_t)n * 4 > s.size())
+            throw std::runtime_error("truncated summary");
+        for (uint32_t i = 0; i < n; i++)
+        {
+            OrderedList list;
+            list.unserialize(s, nullptr);
+            if (list.timestamps.size() != list.cmds.size())
+                throw std::runtime_error("invalid ordering in a summary");
+            add(list);
+        }
+        return;
+    }
+    raw = false;
+    s >> total >> n;
+    total = letoh(total);
+    n = letoh(n);
+    /* each command takes its hash, its count and a count for each other */
+    if ((uint64_t)n * (32 + 2 * (uint64_t)n) > s.size())
+        throw std::runtime_error("truncated summary");
+    cmds.resize(n);
+    present.resize(n);
+    for (uint32_t a = 0; a < n; a++)
+    {
+        uint16_t cnt;
+        s >> cmds[a] >> cnt;
+        present[a] = letoh(cnt);
+        if (present[a] > total ||
+            !index.insert(std::make_pair(cmds[a], a)).second)
+            throw std::runtime_error("invalid summary");
+    }
+    before.assign(n, std::vector<uint32_t>(n, 0));
+    for (uint32_t a = 0; a < n; a++)
+        for (uint32_t b = 0; b < n; b++)
+        {
+            if (a == b) continue;
+            uint16_t cnt;
+            s >> cnt;
+            before[a][b] = letoh(cnt);
+            if (before[a][b] > present[a])
+                throw std::runtime_error("invalid summary");
+        }
+}
+
+void CmdBatch::serialize(DataStream &s) const {
+    s << creator << htole(seq) << htole((uint32_t)cmd_hashes.size());
+    for (size_t i = 0; i < cmd_hashes.size(); i++)
+        s << cmd_hashes[i]
+          << htole((uint32_t)payloads[i].size()) << payloads[i];
+}
+
+void CmdBatch::unserialize(DataStream &s) {
+    uint32_t n;
+    s >> creator >> seq >> n;
+    seq = letoh(seq);
+    n = letoh(n);
+    /* each command takes at least its hash and its length */
+    if ((uint64_t)n * 36 > s.size())
+        throw std::runtime_error("truncated batch");
+    cmd_hashes.resize(n);
+    payloads.resize(n);
+    for (uint32_t i = 0; i < n; i++)
+    {
+        uint32_t len;
+        s >> cmd_hashes[i] >> len;
+        len = letoh(len);
+        auto base = s.get_data_inplace(len);
+        payloads[i] = bytearray_t(base, base + len);
+    }
+    hash = salticidae::get_hash(*this);
+}
+
+bool CmdBatch::verify() const {
+    for (size_t i = 0; i < cmd_hashes.size(); i++)
+    {
+        SHA256 d;
+        d.update(payloads[i]);
+        if (uint256_t(d.digest()) != cmd_hashes[i]) return false;
+    }
+    return true;
+}
+
 void Block::serialize(DataStream &s) const {
+    if (encoded.empty())
+        serialize_fields(s);
+    else
+        s << encoded.get_bytes();
+}
+
+void Block::encode() {
+    DataStream s;
+    serialize_fields(s);
+    hash = s.get_hash();
+    encoded = BlockEncoding(std::move(s));
+}
+
+void Block::serialize_fields(DataStream &s) const {
     s << htole((uint32_t)parent_hashes.size());
     for (const auto &hash: parent_hashes)
         s << hash;
@@ -60,6 +296,9 @@ void Block::serialize(DataStream &s) const {
 }
 
 void Block::unserialize(DataStream &s, HotStuffCore *hsc) {
+    /* the bytes taken by the block are kept as its encoding */
+    const uint8_t *start = s.data();
+    size_t avail = s.size();
     uint32_t n;
     s >> n;
     n = letoh(n);
@@ -100,7 +339,8 @@ void Block::unserialize(DataStream &s, HotStuffCore *hsc) {
         auto base = s.get_data_inplace(n);
         extra = bytearray_t(base, base + n);
     }
-    this->hash = salticidae::get_hash(*this);
+    encoded = BlockEncoding(start, start + (avail - s.size()));
+    this->hash = encoded.get_hash();
 }
 
 bool Block::verify(const HotStuffCore *hsc) const {
@@ -121,30 +361,28 @@ promise_t Block::verify(const HotStuffCore *hsc, VeriPool &vpool) const {
 
 void CommandTimestampStorage::add_command_to_storage(const uint256_t cmd_hash)
 {
-    struct timeval tv;
-    gettimeofday(&tv, nullptr);
-    uint64_t timestamp_us = tv.tv_sec;
-    timestamp_us *= 1000 * 1000;
-    timestamp_us += tv.tv_usec;
-    HOTSTUFF_LOG_PROTO("(cmd,timestamp): (%s,%s)",get_hex10(cmd_hash).c_str(),boost::lexical_cast<std::string>(timestamp_us).c_str());
-    cmd_ts_storage.insert(std::make_pair(cmd_hash, timestamp_us));
+    add_command_to_storage(cmd_hash, get_current_timestamp());
+}
+
+void CommandTimestampStorage::add_command_to_storage(const uint256_t &cmd_hash, uint64_t timestamp)
+{
+    HOTSTUFF_LOG_PROTO("(cmd,timestamp): (%s,%s)",get_hex10(cmd_hash).c_str(),boost::lexical_cast<std::string>(timestamp).c_str());
+    cmd_ts_storage.insert(std::make_pair(cmd_hash, timestamp));
     available_cmd_hashes.push_back(cmd_hash);
-    available_timestamps.push_back(timestamp_us);
+    available_timestamps.push_back(timestamp);
     cmd_hashes.push_back(cmd_hash);
-    timestamps.push_back(timestamp_us);
+    timestamps.push_back(timestamp);
+    if (cmd_hashes.size() > cmd_history_max)
+    {
+        cmd_hashes.pop_front();
+        timestamps.pop_front();
+    }
 }
 
 /** return true if it is a new command */
 bool CommandTimestampStorage::is_new_command(const uint256_t &cmd_hash) const
 {
-    if (std::find(cmd_hashes.begin(), cmd_hashes.end(), cmd_hash) == cmd_hashes.end())
-    {
-        return true;
-    }
-    else
-    {
-        return false;
-    }
+    return !cmd_ts_storage.count(cmd_hash) && !committed_cmds.count(cmd_hash);
 }
 
 /** Updating the available cmds and timestamps on receiving acceptable proposals.
@@ -174,24 +412,21 @@ std::vector<uint64_t> CommandTimestampStorage::get_timestamps(const std::vector<
 {
     std::vector<uint64_t> timestamps_list;
     for (auto& cmd_hash : cmd_hashes_inquired)
-    {
-        auto it = std::find(cmd_hashes.begin(), cmd_hashes.end(), cmd_hash);
-        timestamps_list.push_back(timestamps[std::distance(cmd_hashes.begin(), it)]);
-    }
+        timestamps_list.push_back(cmd_ts_storage.at(cmd_hash));
     return timestamps_list;
 }
 
-std::vector<std::vector<uint64_t>> CommandTimestampStorage::get_timestamps_1(const LeaderProposedOrderedList &proposed_orderedlist_inquired) const
+std::vector<std::vector<uint64_t>> CommandTimestampStorage::get_timestamps_1(const LeaderProposedOrderedList &proposed_orderedlist_inquired, uint64_t unseen_ts) const
 {
     std::vector<std::vector<uint64_t>> proposed_orderedlist_timestamp;
     for (auto &cmd_vec : proposed_orderedlist_inquired.cmds) 
     {
         std::vector<uint64_t> timestamp_vec;
         timestamp_vec.clear();
-        for (auto& cmd_hash: cmd_vec) 
+        for (auto& cmd_hash: cmd_vec)
         {
-            auto it = std::find(cmd_hashes.begin(), cmd_hashes.end(), cmd_hash);
-            timestamp_vec.push_back(timestamps[std::distance(cmd_hashes.begin(), it)]);
+            auto it = cmd_ts_storage.find(cmd_hash);
+            timestamp_vec.push_back(it == cmd_ts_storage.end() ? unseen_ts : it->second);
         }
         proposed_orderedlist_timestamp.push_back(timestamp_vec);
     }
@@ -231,45 +466,70 @@ orderedlist_t CommandTimestampStorage::get_orderedlist(const uint256_t &blk_hash
                 proposed_available_timestamps))).first->second;
 }
 
+void CommandTimestampStorage::release_blk(const Block &blk)
+{
+    replica_preferred_ordering_cache.erase(blk.get_hash());
+    /* the commands of a pruned fork were never ordered, so they stay
+     * pending (with their arrival time) */
+    if (blk.get_decision() != 1) return;
+    for (auto &cmd_vec: blk.get_proposed_orderedlist().cmds)
+        for (auto &cmd_hash: cmd_vec)
+        {
+            cmd_ts_storage.erase(cmd_hash);
+            if (committed_cmds.insert(cmd_hash).second)
+                committed_queue.push_back(cmd_hash);
+        }
+    while (committed_queue.size() > committed_cmds_max)
+    {
+        committed_cmds.erase(committed_queue.front());
+        committed_queue.pop_front();
+    }
+}
+
 void OrderedListStorage::add_ordered_list(const uint256_t block_hash, const OrderedList preferred_orderedlist, bool leader, size_t num_peers)
 {
     HOTSTUFF_LOG_PROTO("The block hash is: %s", get_hex10(block_hash).c_str());
     // size_t num_faulty = num_peers / 3;
     // HOTSTUFF_LOG_PROTO("Number of faulty is: %lu", num_faulty);
     // size_t test_num = num_peers + 1 - num_faulty
+    // for now the assumption is that all replicas are honest
+    summary_cache[block_hash].add(preferred_orderedlist);
     auto it = ordered_list_cache.find(block_hash);
     if (it == ordered_list_cache.end())
     {
         HOTSTUFF_LOG_PROTO("It is a new addition!");
-        std::vector<OrderedList> temp{preferred_orderedlist};
-        ordered_list_cache.insert(std::make_pair(block_hash, temp));
+        ordered_list_cache.insert(std::make_pair(block_hash, preferred_orderedlist));
         if(leader ==true) {HOTSTUFF_LOG_PROTO("It is leader");}
     }
-    else
+    else if (leader == true)
     {
-        HOTSTUFF_LOG_PROTO("It is a new addition to existing record!");
-        if (leader == true) 
-        {
-            it->second.insert(it->second.begin(), preferred_orderedlist);
-            HOTSTUFF_LOG_PROTO("It is leader");
-        }
-        else 
-        {
-            // for now the assumption is that all replicas are honest
-            it->second.push_back(preferred_orderedlist);
-            HOTSTUFF_LOG_PROTO("It is replica");
-            
-        }
-        // HOTSTUFF_LOG_PROTO("Size of cache for this index is %lu", it->second.size());
+        /* the leader's own list gives the candidates */
+        it->second = preferred_orderedlist;
+        HOTSTUFF_LOG_PROTO("It is leader");
     }
 }
 
-std::vector<OrderedList> OrderedListStorage::get_set_of_orderedlists(const uint256_t block_hash) const
+void OrderedListStorage::add_summary(const uint256_t &block_hash, const PrecedenceMatrix &summary,
+                                    const std::vector<ReplicaID> &voters)
+{
+    summary_cache[block_hash].merge(summary);
+    summary_voters[block_hash].insert(voters.begin(), voters.end());
+}
+
+const OrderedList &OrderedListStorage::get_candidates(const uint256_t &block_hash) const
 {
-    if(ordered_list_cache.find(block_hash)->second.size() == 0){
+    auto it = ordered_list_cache.find(block_hash);
+    if (it == ordered_list_cache.end())
         throw std::runtime_error("Empty orderedlist...");
-    }
-    return ordered_list_cache.find(block_hash)->second;
+    return it->second;
+}
+
+const PrecedenceMatrix &OrderedListStorage::get_summary(const uint256_t &block_hash) const
+{
+    auto it = summary_cache.find(block_hash);
+    if (it == summary_cache.end())
+        throw std::runtime_error("Empty orderedlist...");
+    return it->second;
 }
 
 std::vector<uint256_t> OrderedListStorage::get_all_block_hashes() const {
@@ -282,18 +542,10 @@ std::vector<uint256_t> OrderedListStorage::get_all_block_hashes() const {
 }
 
 std::vector<uint256_t> OrderedListStorage::get_cmds_for_first_one(const uint256_t block_hash) const {
-    return ordered_list_cache.find(block_hash)->second[0].extract_cmds();
+    return ordered_list_cache.find(block_hash)->second.extract_cmds();
 }
 std::vector<uint64_t> OrderedListStorage::get_timestamps_for_first_one(const uint256_t block_hash) const
 {
-    return ordered_list_cache.find(block_hash)->second[0].extract_timestamps();
-}
-std::vector<uint256_t> OrderedListStorage::get_cmds_for_second_one(const uint256_t block_hash) const
-{
-    return ordered_list_cache.find(block_hash)->second[1].extract_cmds();
-}
-std::vector<uint64_t> OrderedListStorage::get_timestamps_for_second_one(const uint256_t block_hash) const
-{
-    return ordered_list_cache.find(block_hash)->second[1].extract_timestamps();
+    return ordered_list_cache.find(block_hash)->second.extract_timestamps();
 }
 }
@@ -0,0 +1,330 @@
+/**
+ * Copyright 2018 VMware
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <cstring>
+#include <stdexcept>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HOTSTUFF_GF_X86
+#endif
+
+#include "hotstuff/erasure.h"
+
+namespace hotstuff {
+
+namespace {
+
+struct GFTables {
+    uint8_t exp[512];
+    uint8_t log[256];
+    GFTables() {
+        unsigned x = 1;
+        for (int i = 0; i < 255; i++)
+        {
+            exp[i] = x;
+            log[x] = i;
+            x <<= 1;
+            if (x & 0x100) x ^= 0x11d;
+        }
+        for (int i = 255; i < 512; i++)
+            exp[i] = exp[i - 255];
+        log[0] = 0;
+    }
+};
+
+const GFTables gf;
+
+/* the products of c with all the low and high nibbles */
+inline void nibble_tables(uint8_t c, uint8_t *lo, uint8_t *hi) {
+    for (int x = 0; x < 16; x++)
+    {
+        lo[x] = GF256::mul(c, x);
+        hi[x] = GF256::mul(c, x << 4);
+    }
+}
+
+void mul_add_scalar(uint8_t *dst, const uint8_t *src, uint8_t c, size_t len) {
+    uint8_t lo[16], hi[16];
+    nibble_tables(c, lo, hi);
+    for (size_t i = 0; i < len; i++)
+        dst[i] ^= lo[src[i] & 0xf] ^ hi[src[i] >> 4];
+}
+
+#ifdef HOTSTUFF_GF_X86
+/* each byte is multiplied by looking up its two nibbles with pshufb */
+__attribute__((target("ssse3")))
+void mul_add_ssse3(uint8_t *dst, const uint8_t *src, uint8_t c, size_t len) {
+    uint8_t lo[16], hi[16];
+    nibble_tables(c, lo, hi);
+    const __m128i tlo = _mm_loadu_si128((const __m128i *)lo);
+    const __m128i thi = _mm_loadu_si128((const __m128i *)hi);
+    const __m128i mask = _mm_set1_epi8(0x0f);
+    size_t i = 0;
+    for (; i + 16 <= len; i += 16)
+    {
+        __m128i s = _mm_loadu_si128((const __m128i *)(src + i));
+        __m128i d = _mm_loadu_si128((const __m128i *)(dst + i));
+        __m128i pl = _mm_shuffle_epi8(tlo, _mm_and_si128(s, mask));
+        __m128i ph = _mm_shuffle_epi8(thi, _mm_and_si128(_mm_srli_epi64(s, 4), mask));
+        d = _mm_xor_si128(d, _mm_xor_si128(pl, ph));
+        _mm_storeu_si128((__m128i *)(dst + i), d);
+    }
+    mul_add_scalar(dst + i, src + i, c, len - i);
+}
+
+__attribute__((target("avx2")))
+void mul_add_avx2(uint8_t *dst, const uint8_t *src, uint8_t c, size_t len) {
+    uint8_t lo[16], hi[16];
+    nibble_tables(c, lo, hi);
+    const __m256i tlo = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)lo));
+    const __m256i thi = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)hi));
+    const __m256i mask = _mm256_set1_epi8(0x0f);
+    size_t i = 0;
+    for (; i + 32 <= len; i += 32)
+    {
+        __m256i s = _mm256_loadu_si256((const __m256i *)(src + i));
+        __m256i d = _mm256_loadu_si256((const __m256i *)(dst + i));
+        __m256i pl = _mm256_shuffle_epi8(tlo, _mm256_and_si256(s, mask));
+        __m256i ph = _mm256_shuffle_epi8(thi, _mm256_and_si256(_mm256_srli_epi64(s, 4), mask));
+        d = _mm256_xor_si256(d, _mm256_xor_si256(pl, ph));
+        _mm256_storeu_si256((__m256i *)(dst + i), d);
+    }
+    mul_add_scalar(dst + i, src + i, c, len - i);
+}
+#endif
+
+using mul_add_t = void (*)(uint8_t *, const uint8_t *, uint8_t, size_t);
+
+struct MulAdd {
+    mul_add_t func;
+    const char *name;
+    MulAdd(): func(mul_add_scalar), name("scalar") {
+#ifdef HOTSTUFF_GF_X86
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2"))
+        {
+            func = mul_add_avx2;
+            name = "avx2";
+        }
+        else if (__builtin_cpu_supports("ssse3"))
+        {
+            func = mul_add_ssse3;
+            name = "ssse3";
+        }
+#endif
+    }
+};
+
+const MulAdd mul_add;
+
+/* invert the m x m matrix in place (Gauss-Jordan) */
+bool invert(std::vector<uint8_t> &a, size_t m) {
+    std::vector<uint8_t> b(m * m, 0);
+    for (size_t i = 0; i < m; i++) b[i * m + i] = 1;
+    for (size_t col = 0; col < m; col++)
+    {
+        size_t piv = col;
+        while (piv < m && !a[piv * m + col]) piv++;
+        if (piv == m) return false;
+        if (piv != col)
+            for (size_t j = 0; j < m; j++)
+            {
+                std::swap(a[piv * m + j], a[col * m + j]);
+                std::swap(b[piv * m + j], b[col * m + j]);
+            }
+        uint8_t f = GF256::inv(a[col * m + col]);
+        for (size_t j = 0; j < m; j++)
+        {
+            a[col * m + j] = GF256::mul(a[col * m + j], f);
+            b[col * m + j] = GF256::mul(b[col * m + j], f);
+        }
+        for (size_t i = 0; i < m; i++)
+        {
+            uint8_t g = a[i * m + col];
+            if (i == col || !g) continue;
+            for (size_t j = 0; j < m; j++)
+            {
+                a[i * m + j] ^= GF256::mul(g, a[col * m + j]);
+                b[i * m + j] ^= GF256::mul(g, b[col * m + j]);
+            }
+        }
+    }
+    a.swap(b);
+    return true;
+}
+
+}
+
+uint8_t GF256::mul(uint8_t a, uint8_t b) {
+    if (!a || !b) return 0;
+    return gf.exp[gf.log[a] + gf.log[b]];
+}
+
+uint8_t GF256::inv(uint8_t a) {
+    if (!a) throw std::invalid_argument("zero has no inverse");
+    return gf.exp[255 - gf.log[a]];
+}
+
+void GF256::mul_add_region(uint8_t *dst, const uint8_t *src,
+                            uint8_t c, size_t len) {
+    if (!c) return;
+    if (c == 1)
+    {
+        for (size_t i = 0; i < len; i++) dst[i] ^= src[i];
+        return;
+    }
+    mul_add.func(dst, src, c, len);
+}
+
+const char *GF256::simd_name() { return mul_add.name; }
+
+ReedSolomon::ReedSolomon(size_t k, size_t n): k(k), n(n), matrix(n * k) {
+    if (k == 0 || k > n || n > 256)
+        throw std::invalid_argument("invalid Reed-Solomon parameters");
+    /* a Vandermonde matrix (any k rows are independent), times the inverse
+     * of its top k x k block so that the data shards come out unchanged */
+    std::vector<uint8_t> vand(n * k);
+    for (size_t i = 0; i < n; i++)
+    {
+        uint8_t x = 1;
+        for (size_t j = 0; j < k; j++)
+        {
+            vand[i * k + j] = x;
+            x = GF256::mul(x, i);
+        }
+    }
+    std::vector<uint8_t> top(vand.begin(), vand.begin() + k * k);
+    if (!invert(top, k))
+        throw std::runtime_error("singular Vandermonde matrix");
+    for (size_t i = 0; i < n; i++)
+        for (size_t j = 0; j < k; j++)
+        {
+            uint8_t v = 0;
+            for (size_t t = 0; t < k; t++)
+                v ^= GF256::mul(vand[i * k + t], top[t * k + j]);
+            matrix[i * k + j] = v;
+        }
+}
+
+std::vector<bytearray_t> ReedSolomon::encode(const uint8_t *data, size_t len) const {
+    size_t size = shard_size(len);
+    std::vector<bytearray_t> shards(n, bytearray_t(size, 0));
+    for (size_t i = 0; i < k; i++)
+    {
+        size_t off = i * size;
+        if (off < len)
+            memcpy(shards[i].data(), data + off, std::min(size, len - off));
+    }
+    for (size_t i = k; i < n; i++)
+        for (size_t j = 0; j < k; j++)
+            GF256::mul_add_region(shards[i].data(), shards[j].data(),
+                                matrix[i * k + j], size);
+    return shards;
+}
+
+bool ReedSolomon::decode(const std::vector<bytearray_t> &shards, size_t len,
+                        bytearray_t &out) const {
+    size_t size = shard_size(len);
+    /* take the first k shards at hand, preferring the data shards */
+    std::vector<size_t> rows;
+    for (size_t i = 0; i < shards.size() && i < n && rows.size() < k; i++)
+    {
+        if (shards[i].empty()) continue;
+        if (shards[i].size() != size) return false;
+        rows.push_back(i);
+    }
+    if (rows.size() < k) return false;
+    out.assign(k * size, 0);
+    bool systematic = rows.back() == k - 1;
+    if (systematic)
+    {
+        for (size_t i = 0; i < k; i++)
+            memcpy(&out[i * size], shards[i].data(), size);
+    }
+    else
+    {
+        std::vector<uint8_t> sub(k * k);
+        for (size_t i = 0; i < k; i++)
+            memcpy(&sub[i * k], &matrix[rows[i] * k], k);
+        if (!invert(sub, k)) return false;
+        for (size_t i = 0; i < k; i++)
+            for (size_t j = 0; j < k; j++)
+                GF256::mul_add_region(&out[i * size], shards[rows[j]].data(),
+                                    sub[i * k + j], size);
+    }
+    out.resize(len);
+    return true;
+}
+
+uint256_t MerkleTree::hash_leaf(const bytearray_t &chunk) {
+    DataStream s;
+    s << (uint8_t)0 << chunk;
+    return s.get_hash();
+}
+
+static uint256_t hash_node(const uint256_t &left, const uint256_t &right) {
+    DataStream s;
+    s << (uint8_t)1 << left << right;
+    return s.get_hash();
+}
+
+MerkleTree::MerkleTree(const std::vector<bytearray_t> &chunks) {
+    if (chunks.empty())
+        throw std::invalid_argument("empty Merkle tree");
+    levels.emplace_back();
+    for (const auto &c: chunks)
+        levels.back().push_back(hash_leaf(c));
+    while (levels.back().size() > 1)
+    {
+        const auto &cur = levels.back();
+        std::vector<uint256_t> next;
+        for (size_t i = 0; i < cur.size(); i += 2)
+            /* an odd node is carried up as is */
+            next.push_back(i + 1 < cur.size() ? hash_node(cur[i], cur[i + 1]) : cur[i]);
+        levels.push_back(std::move(next));
+    }
+}
+
+std::vector<uint256_t> MerkleTree::get_proof(size_t idx) const {
+    std::vector<uint256_t> proof;
+    for (size_t l = 0; l + 1 < levels.size(); l++, idx >>= 1)
+    {
+        size_t sib = idx ^ 1;
+        if (sib < levels[l].size())
+            proof.push_back(levels[l][sib]);
+    }
+    return proof;
+}
+
+bool MerkleTree::verify(const uint256_t &root, size_t idx, size_t nleaves,
+                        const bytearray_t &chunk,
+                        const std::vector<uint256_t> &proof) {
+    if (idx >= nleaves) return false;
+    uint256_t h = hash_leaf(chunk);
+    size_t p = 0;
+    for (size_t m = nleaves; m > 1; m = (m + 1) >> 1, idx >>= 1)
+    {
+        size_t sib = idx ^ 1;
+        if (sib >= m) continue;
+        if (p == proof.size()) return false;
+        h = idx & 1 ? hash_node(proof[p], h) : hash_node(h, proof[p]);
+        p++;
+    }
+    return p == proof.size() && h == root;
+}
+
+}
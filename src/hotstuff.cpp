@@ -15,6 +15,8 @@
  * limitations under the License.
  */
 
+#include <cmath>
+
 #include "hotstuff/hotstuff.h"
 #include "hotstuff/client.h"
 #include "hotstuff/liveness.h"
@@ -28,6 +30,30 @@ using salticidae::static_pointer_cast;
 
 namespace hotstuff {
 
+#ifndef HOTSTUFF_TWO_STEP
+/* the blocks carrying the direct certificates that commit a block */
+static const size_t commit_chain_len = 3;
+#else
+static const size_t commit_chain_len = 2;
+#endif
+
+/* the number of executed batches kept for the replicas missing them */
+static const size_t batch_retained = 1024;
+/* the number of executed batches and commands remembered for deduplication */
+static const size_t batch_done_max = 1 << 16;
+static const double batch_fetch_timeout = 1;
+/* the number of blocks whose votes are being combined at a time */
+static const size_t vote_agg_max = 64;
+/* the bound on the proposals whose chunks are being collected, and how
+ * long (in nanoseconds) their chunks are kept */
+static const size_t chunk_waiting_max = 128;
+static const uint64_t chunk_waiting_timeout = 10000000000ull;
+/* the bound on the objects preallocated for each pool */
+static const size_t pool_reserve_max = 4096;
+/* a lower bound on the size of a serialized block (its parent count and the
+ * hash certified by its QC), to bound the counts received */
+static const size_t min_blk_size = 36;
+
 const opcode_t MsgPropose::opcode;
 MsgPropose::MsgPropose(const Proposal &proposal) { serialized << proposal; }
 void MsgPropose::postponed_parse(HotStuffCore *hsc) {
@@ -53,6 +79,8 @@ MsgReqBlock::MsgReqBlock(DataStream &&s) {
     uint32_t size;
     s >> size;
     size = letoh(size);
+    if ((uint64_t)size * 32 > s.size())
+        throw std::runtime_error("truncated block request");
     blk_hashes.resize(size);
     for (auto &h: blk_hashes) s >> h;
 }
@@ -67,6 +95,8 @@ void MsgRespBlock::postponed_parse(HotStuffCore *hsc) {
     uint32_t size;
     serialized >> size;
     size = letoh(size);
+    if ((uint64_t)size * min_blk_size > serialized.size())
+        throw std::runtime_error("truncated block response");
     blks.resize(size);
     for (auto &blk: blks)
     {
@@ -76,12 +106,504 @@ void MsgRespBlock::postponed_parse(HotStuffCore *hsc) {
     }
 }
 
-// TODO: improve this function
+const opcode_t MsgReqBlockRange::opcode;
+MsgReqBlockRange::MsgReqBlockRange(const uint256_t &blk_hash, uint32_t height):
+        blk_hash(blk_hash), height(height) {
+    serialized << blk_hash << htole(height);
+}
+
+MsgReqBlockRange::MsgReqBlockRange(DataStream &&s) {
+    s >> blk_hash >> height;
+    height = letoh(height);
+}
+
+const opcode_t MsgRespBlockRange::opcode;
+MsgRespBlockRange::MsgRespBlockRange(const uint256_t &blk_hash,
+                                    const std::vector<block_t> &blks,
+                                    bool last) {
+    serialized << blk_hash << (uint8_t)last
+               << htole((uint32_t)blks.size());
+    for (const auto &blk: blks) serialized << *blk;
+}
+
+void MsgRespBlockRange::postponed_parse(HotStuffCore *hsc) {
+    uint8_t _last;
+    uint32_t size;
+    serialized >> blk_hash >> _last >> size;
+    last = _last;
+    size = letoh(size);
+    if ((uint64_t)size * min_blk_size > serialized.size())
+        throw std::runtime_error("truncated block range");
+    blks.resize(size);
+    for (auto &blk: blks)
+    {
+        Block _blk;
+        _blk.unserialize(serialized, hsc);
+        blk = hsc->storage->add_blk(std::move(_blk), hsc->get_config());
+    }
+}
+
+const opcode_t MsgReqCheckpoint::opcode;
+MsgReqCheckpoint::MsgReqCheckpoint(uint32_t height): height(height) {
+    serialized << htole(height);
+}
+
+MsgReqCheckpoint::MsgReqCheckpoint(DataStream &&s) {
+    s >> height;
+    height = letoh(height);
+}
+
+const opcode_t MsgRespCheckpoint::opcode;
+MsgRespCheckpoint::MsgRespCheckpoint(uint32_t height,
+                                    const bytearray_t &app_state,
+                                    const std::vector<uint256_t> &cmds,
+                                    const std::vector<block_t> &blks):
+        height(height) {
+    serialized << htole(height)
+               << htole((uint32_t)app_state.size()) << app_state
+               << htole((uint32_t)cmds.size());
+    for (const auto &cmd: cmds) serialized << cmd;
+    serialized << htole((uint32_t)blks.size());
+    for (const auto &blk: blks) serialized << *blk;
+}
+
+void MsgRespCheckpoint::postponed_parse(HotStuffCore *hsc) {
+    uint32_t size;
+    serialized >> height >> size;
+    height = letoh(height);
+    size = letoh(size);
+    auto p = serialized.get_data_inplace(size);
+    app_state = bytearray_t(p, p + size);
+    serialized >> size;
+    size = letoh(size);
+    if ((uint64_t)size * 32 > serialized.size())
+        throw std::runtime_error("truncated checkpoint");
+    cmds.resize(size);
+    for (auto &cmd: cmds) serialized >> cmd;
+    serialized >> size;
+    size = letoh(size);
+    if ((uint64_t)size * min_blk_size > serialized.size())
+        throw std::runtime_error("truncated checkpoint");
+    blks.resize(size);
+    /* the blocks are only added to the storage once the checkpoint is
+     * trusted (see install_checkpoint()) */
+    for (auto &blk: blks)
+    {
+        Block _blk;
+        _blk.unserialize(serialized, hsc);
+        blk = new Block(std::move(_blk));
+    }
+}
+
+const opcode_t MsgProposeChunk::opcode;
+MsgProposeChunk::MsgProposeChunk(ReplicaID proposer, const uint256_t &root,
+                                uint32_t len, uint16_t idx,
+                                const bytearray_t &chunk,
+                                const std::vector<uint256_t> &proof) {
+    serialized << proposer << root << htole(len) << htole(idx)
+               << htole((uint32_t)chunk.size()) << chunk
+               << (uint8_t)proof.size();
+    for (const auto &h: proof) serialized << h;
+}
+
+MsgProposeChunk::MsgProposeChunk(DataStream &&s) {
+    uint32_t size;
+    uint8_t nproof;
+    s >> proposer >> root >> len >> idx >> size;
+    len = letoh(len);
+    idx = letoh(idx);
+    size = letoh(size);
+    auto base = s.get_data_inplace(size);
+    chunk = bytearray_t(base, base + size);
+    s >> nproof;
+    proof.resize(nproof);
+    for (auto &h: proof) s >> h;
+}
+
+const opcode_t MsgVoteBundle::opcode;
+MsgVoteBundle::MsgVoteBundle(ReplicaID root, const uint256_t &blk_hash,
+                            const std::vector<ReplicaID> &voters,
+                            const std::vector<part_cert_bt> &certs,
+                            const PrecedenceMatrix &summary) {
+    serialized << root << blk_hash << htole((uint32_t)voters.size());
+    for (size_t i = 0; i < voters.size(); i++)
+        serialized << voters[i] << *certs[i];
+    summary.serialize(serialized);
+}
+
+void MsgVoteBundle::postponed_parse(HotStuffCore *hsc) {
+    uint32_t n;
+    serialized >> root >> blk_hash >> n;
+    n = letoh(n);
+    if (n > hsc->get_config().nreplicas)
+        throw HotStuffError("too many votes in a bundle: %u", n);
+    voters.resize(n);
+    for (auto &voter: voters)
+    {
+        serialized >> voter;
+        certs.push_back(hsc->parse_part_cert(serialized));
+    }
+    summary.unserialize(serialized);
+}
+
+const opcode_t MsgBatch::opcode;
+MsgBatch::MsgBatch(const CmdBatch &batch) { serialized << batch; }
+MsgBatch::MsgBatch(DataStream &&s) { s >> batch; }
+
+const opcode_t MsgBatchAck::opcode;
+MsgBatchAck::MsgBatchAck(ReplicaID voter, const uint256_t &batch_hash,
+                        const PartCert &cert) {
+    serialized << voter << batch_hash << cert;
+}
+
+void MsgBatchAck::postponed_parse(HotStuffCore *hsc) {
+    serialized >> voter >> batch_hash;
+    cert = hsc->parse_part_cert(serialized);
+}
+
+const opcode_t MsgBatchCert::opcode;
+MsgBatchCert::MsgBatchCert(const uint256_t &batch_hash, const QuorumCert &cert) {
+    serialized << batch_hash << cert;
+}
+
+void MsgBatchCert::postponed_parse(HotStuffCore *hsc) {
+    serialized >> batch_hash;
+    cert = hsc->parse_quorum_cert(serialized);
+}
+
+const opcode_t MsgReqBatch::opcode;
+MsgReqBatch::MsgReqBatch(const std::vector<uint256_t> &batch_hashes) {
+    serialized << htole((uint32_t)batch_hashes.size());
+    for (const auto &h: batch_hashes)
+        serialized << h;
+}
+
+MsgReqBatch::MsgReqBatch(DataStream &&s) {
+    uint32_t size;
+    s >> size;
+    size = letoh(size);
+    batch_hashes.resize(size);
+    for (auto &h: batch_hashes) s >> h;
+}
+
+const double FetchScheduler::init_rto;
+const double FetchScheduler::min_rto;
+
+FetchScheduler::FetchScheduler(HotStuffBase *hs):
+        hs(hs), flush_pending(false), window(0.001),
+        nreq(0), nbatch(0), nretrans(0) {
+    flush_timer = TimerEvent(hs->ec, [this](TimerEvent &) { flush(); });
+}
+
+PeerId FetchScheduler::pick(const std::unordered_set<PeerId> &replicas,
+                            const PeerId *exclude) const {
+    const PeerId *best = nullptr;
+    double best_cost = 0;
+    for (const auto &replica: replicas)
+    {
+        if (exclude && replica == *exclude && replicas.size() > 1) continue;
+        /* the expected wait behind the requests already in flight */
+        auto it = peers.find(replica);
+        double cost = init_rto;
+        if (it != peers.end())
+        {
+            const auto &ps = it->second;
+            cost = (ps.srtt > 0 ? ps.srtt : init_rto) *
+                    (ps.inflight + ps.queued.size() + 1) * ps.backoff;
+        }
+        if (!best || cost < best_cost)
+        {
+            best = &replica;
+            best_cost = cost;
+        }
+    }
+    assert(best);
+    return *best;
+}
+
+void FetchScheduler::enqueue(const uint256_t &ent_hash, const PeerId &replica) {
+    auto it = outstanding.find(ent_hash);
+    if (it != outstanding.end())
+    {
+        /* a retransmission: the previous request no longer counts */
+        auto &req = it->second;
+        if (req.sent_ns) peers[req.replica].inflight--;
+        req = Request{replica, 0, true};
+        nretrans++;
+    }
+    else
+        outstanding.insert(std::make_pair(ent_hash, Request{replica, 0, false}));
+    peers[replica].queued.push_back(ent_hash);
+    nreq++;
+    if (!flush_pending)
+    {
+        flush_pending = true;
+        flush_timer.add(window);
+    }
+}
+
+void FetchScheduler::flush() {
+    flush_pending = false;
+    uint64_t now = MonotonicClock::now_ns();
+    for (auto &p: peers)
+    {
+        auto &ps = p.second;
+        if (ps.queued.empty()) continue;
+        std::vector<uint256_t> hashes;
+        for (const auto &h: ps.queued)
+        {
+            /* skip the ones fetched or redirected in the meantime */
+            auto it = outstanding.find(h);
+            if (it == outstanding.end() || it->second.replica != p.first ||
+                it->second.sent_ns) continue;
+            it->second.sent_ns = now;
+            hashes.push_back(h);
+        }
+        ps.queued.clear();
+        if (hashes.empty()) continue;
+        ps.inflight += hashes.size();
+        hs->pn.send_msg(MsgReqBlock(hashes), p.first);
+        nbatch++;
+    }
+}
+
+void FetchScheduler::on_fetched(const uint256_t &ent_hash, const PeerId *replica) {
+    auto it = outstanding.find(ent_hash);
+    if (it == outstanding.end()) return;
+    const auto &req = it->second;
+    if (req.sent_ns)
+    {
+        auto &ps = peers[req.replica];
+        ps.inflight--;
+        if (replica && *replica == req.replica)
+        {
+            ps.backoff = 1;
+            /* Karn's algorithm: an ambiguous sample is not taken */
+            if (!req.retrans)
+            {
+                double rtt = (MonotonicClock::now_ns() - req.sent_ns) / 1e9;
+                if (ps.srtt == 0)
+                {
+                    ps.srtt = rtt;
+                    ps.rttvar = rtt / 2;
+                }
+                else
+                {
+                    ps.rttvar = 0.75 * ps.rttvar + 0.25 * std::abs(ps.srtt - rtt);
+                    ps.srtt = 0.875 * ps.srtt + 0.125 * rtt;
+                }
+            }
+        }
+    }
+    outstanding.erase(it);
+}
+
+void FetchScheduler::on_timeout(const PeerId &replica) {
+    auto &ps = peers[replica];
+    if (ps.backoff < 64) ps.backoff *= 2;
+}
+
+double FetchScheduler::get_rto(const PeerId &replica) const {
+    auto it = peers.find(replica);
+    double rto = init_rto;
+    if (it != peers.end())
+    {
+        const auto &ps = it->second;
+        if (ps.srtt > 0)
+            rto = std::max(ps.srtt + 4 * ps.rttvar, min_rto);
+        rto *= ps.backoff;
+    }
+    return std::min(rto + window, ent_waiting_timeout);
+}
+
+void FetchScheduler::print_stat() const {
+    LOG_INFO("-------- fetch ------");
+    LOG_INFO("requests: %lu, batches: %lu, retransmitted: %lu, outstanding: %lu",
+            nreq, nbatch, nretrans, outstanding.size());
+    for (const auto &p: peers)
+        if (p.second.srtt > 0)
+            LOG_INFO("%s: srtt %.3f ms, rto %.3f ms",
+                    get_hex10(p.first).c_str(),
+                    p.second.srtt * 1e3, get_rto(p.first) * 1e3);
+}
+
 void HotStuffBase::exec_command(uint256_t cmd_hash, commit_cb_t callback) {
-    cmd_pending.enqueue(std::make_pair(cmd_hash, callback));
+    exec_command(cmd_hash, NetAddr(), 0, std::move(callback));
+}
+
+void HotStuffBase::exec_command(uint256_t cmd_hash, const NetAddr &client,
+                                size_t nbytes, commit_cb_t callback) {
+    cmd_pending.enqueue(PendingCmd{cmd_hash, client, nbytes,
+                        CommandTimestampStorage::get_current_timestamp(),
+                        std::move(callback)});
+}
+
+void HotStuffBase::exec_command(uint256_t cmd_hash, const NetAddr &client,
+                                bytearray_t &&payload, commit_cb_t callback) {
+    size_t nbytes = payload.size();
+    cmd_pending.enqueue(PendingCmd{cmd_hash, client, nbytes,
+                        CommandTimestampStorage::get_current_timestamp(),
+                        std::move(callback), std::move(payload)});
+}
+
+void HotStuffBase::add_to_batch(const uint256_t &cmd_hash, bytearray_t &&payload) {
+    batch_cmds.push_back(cmd_hash);
+    batch_payloads.push_back(std::move(payload));
+    if (batch_cmds.size() >= batch_size)
+        seal_batch();
+    else if (batch_cmds.size() == 1)
+        batch_timer.add(batch_timeout);
+}
+
+void HotStuffBase::seal_batch() {
+    batch_timer.del();
+    if (batch_cmds.empty()) return;
+    batch_t batch = new CmdBatch(get_id(), batch_seq++,
+                                std::move(batch_cmds), std::move(batch_payloads));
+    batch_cmds.clear();
+    batch_payloads.clear();
+    storage->add_batch(batch);
+    const auto &batch_hash = batch->get_hash();
+    auto &acks = batch_acking[batch_hash];
+    acks.cert = create_quorum_cert(batch_hash);
+    nbatch_made++;
+    pn.multicast_msg(MsgBatch(*batch), peers);
+    /* the creator acknowledges its own batch */
+    RcObj<part_cert_bt> cert(new part_cert_bt());
+    spool.verify(new FuncTask([this, cert, batch_hash]() {
+        *cert = create_part_cert(*priv_key, batch_hash);
+        return true;
+    })).then([this, cert, batch_hash]() {
+        auto it = batch_acking.find(batch_hash);
+        if (it == batch_acking.end()) return;
+        it->second.cert->add_part(get_id(), **cert);
+        it->second.voters.insert(get_id());
+        check_batch_acks(batch_hash);
+    });
+}
+
+void HotStuffBase::check_batch_acks(const uint256_t &batch_hash) {
+    auto it = batch_acking.find(batch_hash);
+    if (it->second.voters.size() < get_config().nmajority) return;
+    auto cert = std::move(it->second.cert);
+    batch_acking.erase(it);
+    cert->compute();
+    pn.multicast_msg(MsgBatchCert(batch_hash, *cert), peers);
+    on_batch_certified(batch_hash);
+}
+
+/* add a hash to a bounded FIFO set, returning false if it is already there */
+static bool remember_done(std::unordered_set<uint256_t> &done,
+                        std::deque<uint256_t> &queue, const uint256_t &h) {
+    if (!done.insert(h).second) return false;
+    queue.push_back(h);
+    if (queue.size() > batch_done_max)
+    {
+        done.erase(queue.front());
+        queue.pop_front();
+    }
+    return true;
+}
+
+static void save_done(DataStream &s, const std::deque<uint256_t> &queue) {
+    s << htole((uint32_t)queue.size());
+    for (const auto &h: queue) s << h;
 }
 
-void HotStuffBase::on_fetch_blk(const block_t &blk) {
+static void load_done(DataStream &s, std::unordered_set<uint256_t> &done,
+                    std::deque<uint256_t> &queue) {
+    uint32_t n;
+    s >> n;
+    n = letoh(n);
+    if ((uint64_t)n * 32 > s.size())
+        throw std::runtime_error("truncated checkpoint");
+    done.clear();
+    queue.clear();
+    for (uint32_t i = 0; i < n; i++)
+    {
+        uint256_t h;
+        s >> h;
+        remember_done(done, queue, h);
+    }
+}
+
+void HotStuffBase::on_batch_certified(const uint256_t &batch_hash) {
+    if (batch_done.count(batch_hash) ||
+        !batch_certified.insert(batch_hash).second) return;
+    nbatch_cert++;
+    /* from here on, the batch is ordered as a single command */
+    if (command_timestamp_storage->is_new_command(batch_hash))
+        command_timestamp_storage->add_command_to_storage(batch_hash,
+            CommandTimestampStorage::get_current_timestamp());
+    if (pmaker->get_proposer() != get_id()) return;
+    if (mempool.admit(batch_hash, NetAddr(), 0) != Mempool::ADMITTED) return;
+    if (mempool.size() >= blk_size) beat_and_propose();
+}
+
+void HotStuffBase::exec_batches() {
+    while (!batch_exec_waiting.empty())
+    {
+        auto &fin = batch_exec_waiting.front();
+        /* a batch ordered again is skipped (every replica skips the same
+         * ones, as they execute the same sequence of batches) */
+        if (batch_done.count(fin.cmd_hash))
+        {
+            pop_batch_exec();
+            continue;
+        }
+        auto batch = storage->find_batch(fin.cmd_hash);
+        if (!batch)
+        {
+            /* wait for the batch, which a quorum has stored */
+            if (!batch_fetch_pending)
+            {
+                batch_fetch_pending = true;
+                pn.multicast_msg(MsgReqBatch(std::vector<uint256_t>{fin.cmd_hash}), peers);
+                batch_fetch_timer.add(batch_fetch_timeout);
+            }
+            return;
+        }
+        if (batch_fetch_pending)
+        {
+            batch_fetch_pending = false;
+            batch_fetch_timer.del();
+        }
+        batch_certified.erase(fin.cmd_hash);
+        remember_done(batch_done, batch_done_queue, fin.cmd_hash);
+        const auto &cmds = batch->get_cmd_hashes();
+        for (size_t i = 0; i < cmds.size(); i++)
+        {
+            if (!remember_done(batch_cmd_done, batch_cmd_done_queue, cmds[i]))
+            {
+                nbatch_dup_cmds++;
+                continue;
+            }
+            decide_cmd(Finality(fin.rid, fin.decision, i, fin.cmd_height,
+                                cmds[i], fin.blk_hash));
+        }
+        nbatch_exec++;
+        batch_executed.push(fin.cmd_hash);
+        if (batch_executed.size() > batch_retained)
+        {
+            storage->release_batch(batch_executed.front());
+            batch_executed.pop();
+        }
+        pop_batch_exec();
+    }
+}
+
+void HotStuffBase::pop_batch_exec() {
+    batch_exec_waiting.pop();
+    if (checkpoint_waiting && !--checkpoint_nwaiting)
+    {
+        block_t blk = std::move(checkpoint_waiting);
+        checkpoint_waiting = nullptr;
+        make_checkpoint(blk, std::move(checkpoint_waiting_cmds));
+        checkpoint_waiting_cmds.clear();
+    }
+}
+
+void HotStuffBase::on_fetch_blk(const block_t &blk, const PeerId *replica) {
 #ifdef HOTSTUFF_BLK_PROFILE
     blk_profiler.get_tx(blk->get_hash());
 #endif
@@ -93,6 +615,7 @@ void HotStuffBase::on_fetch_blk(const block_t &blk) {
     auto it = blk_fetch_waiting.find(blk_hash);
     if (it != blk_fetch_waiting.end())
     {
+        fetch_sched.on_fetched(blk_hash, replica);
         it->second.resolve(blk);
         blk_fetch_waiting.erase(it);
     }
@@ -111,6 +634,7 @@ bool HotStuffBase::on_deliver_blk(const block_t &blk) {
         part_parent_size += blk->get_parent_hashes().size();
         part_delivered++;
         delivered++;
+        log_blk(blk);
     }
     else
     {
@@ -143,6 +667,191 @@ bool HotStuffBase::on_deliver_blk(const block_t &blk) {
     return res;
 }
 
+void HotStuffBase::log_blk(const block_t &blk) {
+    if (!blk_log || blk_log->is_failed()) return;
+    const auto &enc = blk->get_encoded();
+    if (!enc.empty())
+        blk_log->append_blk(blk->get_hash(), enc.data(), enc.size());
+    else
+    {
+        DataStream s;
+        s << *blk;
+        blk_log->append_blk(blk->get_hash(), s.data(), s.size());
+    }
+    if (blk_log->need_flush()) flush_blk_log();
+}
+
+void HotStuffBase::flush_blk_log() {
+    /* one flush at a time: the records appended meanwhile go with the next
+     * one, so the event loop never waits for the disk */
+    if (!blk_log->start_flush()) return;
+    blk_log_pool->verify(new FuncTask([this]() {
+        try {
+            blk_log->write_inflight();
+        } catch (std::runtime_error &err) {
+            LOG_WARN("%s", err.what());
+            return false;
+        }
+        return true;
+    })).then([this](bool ok) {
+        blk_log->finish_flush(ok);
+        if (!ok)
+        {
+            HOTSTUFF_LOG_ERROR("block log failed: no more votes until restarted");
+            return;
+        }
+        if (blk_log->need_flush()) flush_blk_log();
+    });
+}
+
+void HotStuffBase::enable_block_log(const BlockLog::Config &config, double sync_interval) {
+    blk_log = new BlockLog(config);
+    blk_log_sync_interval = sync_interval;
+    blk_log_pool = new VeriPool(ec, 1);
+}
+
+void HotStuffBase::enable_safety_log(const SafetyLog::Config &config) {
+    safety_log = new SafetyLog(config);
+    if (config.mode != SafetyLog::MODE_SYNC)
+        safety_pool = new VeriPool(ec, 1);
+}
+
+void HotStuffBase::recover_safety_log() {
+    bytearray_t state;
+    if (!safety_log->recover(state)) return;
+    DataStream s(state.begin(), state.end());
+    on_recover_safety(s);
+}
+
+promise_t HotStuffBase::async_persist_safety() {
+    /* the blocks must be durable as well: once the block log fails, the
+     * replica stops voting (as for a failed safety write) */
+    if (blk_log && blk_log->is_failed())
+        return promise_t([](promise_t &) {});
+    if (!safety_log) return HotStuffCore::async_persist_safety();
+    DataStream s;
+    get_safety_state(s);
+    switch (safety_log->get_mode())
+    {
+        case SafetyLog::MODE_SYNC:
+        {
+            ElapsedTime et;
+            et.start();
+            try {
+                safety_log->write(s.data(), s.size());
+            } catch (std::runtime_error &err) {
+                /* never vote on a state that is not durable */
+                LOG_WARN("%s", err.what());
+                return promise_t([](promise_t &) {});
+            }
+            et.stop(false);
+            safety_write_lat.add(et.elapsed_sec);
+            safety_persist_lat.add(et.elapsed_sec);
+            return promise_t([](promise_t &pm) { pm.resolve(); });
+        }
+        case SafetyLog::MODE_GROUP:
+        {
+            promise_t pm([](promise_t &) {});
+            ElapsedTime et;
+            et.start();
+            safety_waiting.push_back(std::make_pair(pm, et));
+            safety_pending = std::move(s);
+            safety_dirty = true;
+            flush_safety();
+            return pm;
+        }
+        default:
+            safety_pending = std::move(s);
+            safety_dirty = true;
+            flush_safety();
+            return promise_t([](promise_t &pm) { pm.resolve(); });
+    }
+}
+
+void HotStuffBase::flush_safety() {
+    /* one write at a time: the states changed meanwhile are coalesced into
+     * the next one, which releases all the votes waiting for them */
+    if (safety_flushing || !safety_dirty) return;
+    safety_flushing = true;
+    safety_dirty = false;
+    RcObj<DataStream> state(new DataStream(std::move(safety_pending)));
+    safety_pending = DataStream();
+    RcObj<double> elapsed(new double(0));
+    auto waiting = std::move(safety_waiting);
+    safety_waiting.clear();
+    safety_pool->verify(new FuncTask([this, state, elapsed]() {
+        ElapsedTime et;
+        et.start();
+        try {
+            safety_log->write(state->data(), state->size());
+        } catch (std::runtime_error &err) {
+            LOG_WARN("%s", err.what());
+            return false;
+        }
+        et.stop(false);
+        *elapsed = et.elapsed_sec;
+        return true;
+    })).then([this, elapsed, waiting](bool ok) {
+        safety_flushing = false;
+        if (ok)
+        {
+            safety_write_lat.add(*elapsed);
+            for (auto &w: waiting)
+            {
+                ElapsedTime e = w.second;
+                e.stop(false);
+                safety_persist_lat.add(e.elapsed_sec);
+                promise_t pm = w.first;
+                pm.resolve();
+            }
+        }
+        flush_safety();
+    });
+}
+
+void HotStuffBase::recover_blk_log() {
+    ElapsedTime et;
+    et.start();
+    size_t nblk = 0, nskipped = 0;
+    blk_log->recover([this, &nblk, &nskipped](BlockLog::RecordType type,
+                        const uint256_t &blk_hash,
+                        const uint8_t *data, size_t len) {
+        if (type == BlockLog::REC_COMMIT)
+        {
+            block_t blk = storage->find_blk(blk_hash);
+            if (blk && blk->is_delivered())
+            {
+                on_recover_commit(blk);
+                /* the batches executed, in the same order (their commands
+                 * are not logged) */
+                if (batch_size)
+                    for (const auto &h: blk->get_proposed_orderedlist().convert_to_vec())
+                        remember_done(batch_done, batch_done_queue, h);
+            }
+            return;
+        }
+        if (storage->is_blk_delivered(blk_hash)) return;
+        DataStream s(data, data + len);
+        Block _blk;
+        _blk.unserialize(s, this);
+        /* parents are logged before their children, unless they were
+         * pruned during the replay (then the block is stale anyway) */
+        bool ready = storage->is_blk_fetched(_blk.get_qc()->get_obj_hash());
+        for (const auto &p: _blk.get_parent_hashes())
+            ready = ready && storage->is_blk_delivered(p);
+        if (!ready)
+        {
+            nskipped++;
+            return;
+        }
+        HotStuffCore::on_deliver_blk(storage->add_blk(std::move(_blk), get_config()));
+        nblk++;
+    });
+    et.stop(false);
+    LOG_INFO("recovered %lu blocks (%lu skipped) from the block log in %.3f sec",
+            nblk, nskipped, et.elapsed_sec);
+}
+
 promise_t HotStuffBase::async_fetch_blk(const uint256_t &blk_hash,
                                         const PeerId *replica,
                                         bool fetch_now) {
@@ -178,8 +887,12 @@ promise_t HotStuffBase::async_deliver_blk(const uint256_t &blk_hash,
     BlockDeliveryContext pm{[](promise_t){}};
     it = blk_delivery_waiting.insert(std::make_pair(blk_hash, pm)).first;
     /* otherwise the on_deliver_batch will resolve */
+    deliver_blk(blk_hash, replica);
+    return static_cast<promise_t &>(pm);
+}
+
+void HotStuffBase::deliver_blk(const uint256_t &blk_hash, const PeerId &replica) {
     async_fetch_blk(blk_hash, &replica).then([this, replica](block_t blk) {
-        /* qc_ref should be fetched */
         std::vector<promise_t> pms;
         const auto &qc = blk->get_qc();
         assert(qc);
@@ -187,30 +900,284 @@ promise_t HotStuffBase::async_deliver_blk(const uint256_t &blk_hash,
             pms.push_back(promise_t([](promise_t &pm){ pm.resolve(true); }));
         else
             pms.push_back(blk->verify(this, vpool));
-        pms.push_back(async_fetch_blk(qc->get_obj_hash(), &replica));
-        /* the parents should be delivered */
+        /* the parents should be delivered; an unknown parent means the
+         * replica is missing a whole range of blocks, which is fetched at
+         * once instead of one parent after another */
         for (const auto &phash: blk->get_parent_hashes())
-            pms.push_back(async_deliver_blk(phash, replica));
+            pms.push_back(blk_range_chunk &&
+                        !storage->is_blk_fetched(phash) &&
+                        !blk_fetch_waiting.count(phash) ?
+                async_deliver_blk_range(phash, replica) :
+                async_deliver_blk(phash, replica));
+        /* qc_ref should be fetched (usually the parent, which may be coming
+         * with a range) */
+        const auto &qc_hash = qc->get_obj_hash();
+        pms.push_back(async_fetch_blk(qc_hash, &replica,
+                                    !blk_range_waiting.count(qc_hash)));
         promise::all(pms).then([this, blk](const promise::values_t values) {
             auto ret = promise::any_cast<bool>(values[0]) && this->on_deliver_blk(blk);
             if (!ret)
                 HOTSTUFF_LOG_WARN("verification failed during async delivery");
         });
     });
+}
+
+promise_t HotStuffBase::async_deliver_blk_range(const uint256_t &blk_hash,
+                                            const PeerId &replica) {
+    auto it = blk_delivery_waiting.find(blk_hash);
+    if (it != blk_delivery_waiting.end())
+        return static_cast<promise_t &>(it->second);
+    BlockDeliveryContext pm{[](promise_t){}};
+    blk_delivery_waiting.insert(std::make_pair(blk_hash, pm));
+    blk_range_waiting[blk_hash].replica = replica;
+    /* the blocks above the last committed one are mostly unknown */
+    pn.send_msg(MsgReqBlockRange(blk_hash, get_b_exec()->get_height()), replica);
+    nrange_req++;
     return static_cast<promise_t &>(pm);
 }
 
+void HotStuffBase::deliver_blk_range(const uint256_t &blk_hash) {
+    auto it = blk_range_waiting.find(blk_hash);
+    auto blks = std::move(it->second.blks);
+    PeerId replica = it->second.replica;
+    blk_range_waiting.erase(it);
+    /* verify all the certificates in parallel, then deliver the blocks from
+     * the bottom up in a loop, rather than through a chain of promises as
+     * deep as the range */
+    std::vector<promise_t> pms;
+    for (const auto &blk: blks)
+        pms.push_back(blk->verify(this, vpool));
+    promise::all(pms).then([this, blks, replica](const promise::values_t values) {
+        for (size_t i = blks.size(); i-- > 0;)
+        {
+            const auto &blk = blks[i];
+            if (blk->is_delivered()) continue;
+            if (!promise::any_cast<bool>(values[i]))
+            {
+                LOG_WARN("verification failed during range delivery");
+                return;
+            }
+            bool ready = storage->is_blk_fetched(blk->get_qc()->get_obj_hash());
+            for (const auto &p: blk->get_parent_hashes())
+                ready = ready && storage->is_blk_delivered(p);
+            if (!ready)
+            {
+                /* e.g. an unknown uncle: deliver the rest one by one */
+                deliver_blk(blks[0]->get_hash(), replica);
+                return;
+            }
+            on_deliver_blk(blk);
+        }
+    });
+}
+
 void HotStuffBase::propose_handler(MsgPropose &&msg, const Net::conn_t &conn) {
     const PeerId &peer = conn->get_peer_id();
     if (peer.is_null()) return;
     msg.postponed_parse(this);
-    auto &prop = msg.proposal;
-    block_t blk = prop.blk;
+    accept_proposal(std::move(msg.proposal), peer);
+}
+
+void HotStuffBase::accept_proposal(Proposal &&prop, const PeerId &peer) {
+    const block_t &blk = prop.blk;
     if (!blk) return;
-    promise::all(std::vector<promise_t>{
-        async_deliver_blk(blk->get_hash(), peer)
-    }).then([this, prop = std::move(prop)]() {
-        on_receive_proposal(prop);
+    /* only the genesis has no parent */
+    if (blk->get_parent_hashes().empty())
+    {
+        LOG_WARN("proposal without parents from %s", get_hex10(peer).c_str());
+        return;
+    }
+    if (catchup_pending)
+    {
+        catchup_deferred.push_back(std::make_pair(std::move(prop), peer));
+        return;
+    }
+    /* neither the parent nor the certified block is known: the replica has
+     * likely fallen behind by more than one block, so a checkpoint may be
+     * cheaper than fetching the missing blocks one by one */
+    if (checkpoint_interval &&
+        !storage->is_blk_fetched(blk->get_parent_hashes()[0]) &&
+        !storage->is_blk_fetched(blk->get_qc()->get_obj_hash()))
+    {
+        catchup_deferred.push_back(std::make_pair(std::move(prop), peer));
+        start_catchup();
+        return;
+    }
+    on_proposal(std::move(prop), peer);
+}
+
+const ReedSolomon &HotStuffBase::get_ec_coder() {
+    const auto &config = get_config();
+    size_t n = config.nreplicas;
+    size_t nfaulty = n - config.nmajority;
+    /* any n - 2f chunks rebuild the proposal, so do the chunks echoed by
+     * the correct replicas */
+    if (!ec_coder || ec_coder->get_n() != n)
+        ec_coder = new ReedSolomon(n - 2 * nfaulty, n);
+    return *ec_coder;
+}
+
+void HotStuffBase::broadcast_proposal_chunks(const Proposal &prop) {
+    MsgPropose msg(prop);
+    const auto &coder = get_ec_coder();
+    size_t len = msg.serialized.size();
+    auto chunks = coder.encode(msg.serialized.data(), len);
+    MerkleTree tree(chunks);
+    const auto &root = tree.get_root();
+    mark_chunk_done(root);
+    size_t n = coder.get_n();
+    for (size_t i = 0; i < n; i++)
+    {
+        if (i == get_id()) continue;
+        MsgProposeChunk cmsg(get_id(), root, len, i, chunks[i], tree.get_proof(i));
+        nec_sent_bytes += cmsg.serialized.size();
+        pn.send_msg(cmsg, get_config().get_peer_id(i));
+    }
+    nec_full_bytes += len * (n - 1);
+    nec_prop++;
+}
+
+void HotStuffBase::mark_chunk_done(const uint256_t &root) {
+    chunk_waiting.erase(root);
+    if (!chunk_done.insert(root).second) return;
+    chunk_done_queue.push(root);
+    if (chunk_done_queue.size() > 128)
+    {
+        chunk_done.erase(chunk_done_queue.front());
+        chunk_done_queue.pop();
+    }
+}
+
+void HotStuffBase::propose_chunk_handler(MsgProposeChunk &&msg, const Net::conn_t &conn) {
+    const PeerId &peer = conn->get_peer_id();
+    if (peer.is_null()) return;
+    const auto &config = get_config();
+    size_t n = config.nreplicas;
+    if (chunk_done.count(msg.root) || msg.idx >= n || msg.proposer >= n)
+        return;
+    if (!MerkleTree::verify(msg.root, msg.idx, n, msg.chunk, msg.proof))
+    {
+        LOG_WARN("invalid proposal chunk %u from %s",
+                msg.idx, get_hex10(peer).c_str());
+        return;
+    }
+    auto it = chunk_waiting.find(msg.root);
+    if (it == chunk_waiting.end())
+    {
+        /* bound the chunks of proposals not (yet) known to be genuine,
+         * dropping those that are too old or else the oldest one */
+        uint64_t now = MonotonicClock::now_ns();
+        while (!chunk_waiting_queue.empty())
+        {
+            const auto &e = chunk_waiting_queue.front();
+            if (chunk_waiting.size() < chunk_waiting_max &&
+                e.second + chunk_waiting_timeout > now) break;
+            auto cit = chunk_waiting.find(e.first);
+            if (cit != chunk_waiting.end() && cit->second.created == e.second)
+                chunk_waiting.erase(cit);
+            chunk_waiting_queue.pop();
+        }
+        it = chunk_waiting.insert(std::make_pair(msg.root,
+            ChunkContext{0, 0, false, std::vector<bytearray_t>(n), 0, now})).first;
+        chunk_waiting_queue.push(std::make_pair(msg.root, now));
+    }
+    auto &ctx = it->second;
+    /* the proposer and the length carried by the echoed chunks are not
+     * covered by the root, so only those sent by the proposer count */
+    if (ctx.authentic && (ctx.proposer != msg.proposer || ctx.len != msg.len))
+        return;
+    if (msg.idx == get_id() && peer == config.get_peer_id(msg.proposer) &&
+        !ctx.authentic)
+    {
+        ctx.proposer = msg.proposer;
+        ctx.len = msg.len;
+        ctx.authentic = true;
+        /* pass the chunk on to the others */
+        pn.multicast_msg(MsgProposeChunk(msg.proposer, msg.root, msg.len,
+                                        msg.idx, msg.chunk, msg.proof), peers);
+    }
+    if (ctx.chunks[msg.idx].empty())
+    {
+        ctx.chunks[msg.idx] = std::move(msg.chunk);
+        ctx.nchunks++;
+    }
+    if (ctx.authentic && ctx.nchunks >= get_ec_coder().get_k())
+        rebuild_proposal(msg.root);
+}
+
+void HotStuffBase::rebuild_proposal(const uint256_t &root) {
+    auto ctx = std::move(chunk_waiting[root]);
+    mark_chunk_done(root);
+    const auto &coder = get_ec_coder();
+    bytearray_t data;
+    /* the chunks must also be consistent: encoding the rebuilt proposal
+     * again has to give the same root, otherwise the proposer is faulty */
+    if (!coder.decode(ctx.chunks, ctx.len, data) ||
+        MerkleTree(coder.encode(data.data(), data.size())).get_root() != root)
+    {
+        LOG_WARN("inconsistent proposal chunks from %d", ctx.proposer);
+        return;
+    }
+    nec_rebuilt++;
+    MsgPropose msg(DataStream(data.begin(), data.end()));
+    msg.postponed_parse(this);
+    accept_proposal(std::move(msg.proposal), get_config().get_peer_id(ctx.proposer));
+}
+
+void HotStuffBase::on_proposal(Proposal &&prop, const PeerId &peer) {
+    block_t blk = prop.blk;
+    if (!vote_pipeline)
+    {
+        promise::all(std::vector<promise_t>{
+            async_deliver_blk(blk->get_hash(), peer)
+        }).then([this, prop = std::move(prop)]() {
+            on_receive_proposal(prop);
+        });
+        return;
+    }
+    /* The fairness check only needs the proposed ordering, and the vote
+     * signature only needs the block hash, so both are done while the block
+     * and its QC are being delivered (the QC is verified by vpool). The vote
+     * is released once all of them finish. */
+    ElapsedTime et;
+    et.start();
+    ElapsedTime fet;
+    fet.start();
+    uint64_t now = CommandTimestampStorage::get_current_timestamp();
+    bool fair = check_proposal_fairness(blk, now);
+    fet.stop(false);
+    stage_fairness.add(fet.elapsed_sec);
+    std::vector<promise_t> pms{
+        async_deliver_blk(blk->get_hash(), peer).then([this, et]() {
+            ElapsedTime e = et;
+            e.stop(false);
+            stage_deliver.add(e.elapsed_sec);
+        })
+    };
+    if (fair)
+        pms.push_back(async_create_part_cert(blk->get_hash()).then([this, et]() {
+            ElapsedTime e = et;
+            e.stop(false);
+            stage_sign.add(e.elapsed_sec);
+        }));
+    promise::all(pms).then([this, prop = std::move(prop), fair, now, et]() {
+        ElapsedTime e = et;
+        e.stop(false);
+        stage_vote.add(e.elapsed_sec);
+        /* only a delivered block (with its QC verified) may stamp the
+         * commands it carries */
+        record_proposal_cmds(prop.blk, now);
+        on_receive_proposal(prop, fair);
+    });
+}
+
+promise_t HotStuffBase::async_create_part_cert(const uint256_t &blk_hash) {
+    RcObj<part_cert_bt> cert(new part_cert_bt());
+    return spool.verify(new FuncTask([this, cert, blk_hash]() {
+        *cert = create_part_cert(*priv_key, blk_hash);
+        return true;
+    })).then([this, cert, blk_hash]() {
+        add_signed_ahead(blk_hash, std::move(*cert));
     });
 }
 
@@ -219,7 +1186,7 @@ void HotStuffBase::vote_handler(MsgVote &&msg, const Net::conn_t &conn) {
     if (peer.is_null()) return;
     msg.postponed_parse(this);
     //auto &vote = msg.vote;
-    RcObj<Vote> v(new Vote(std::move(msg.vote)));
+    vote_t v(new Vote(std::move(msg.vote)));
     promise::all(std::vector<promise_t>{
         async_deliver_blk(v->blk_hash, peer),
         v->verify(vpool),
@@ -231,28 +1198,575 @@ void HotStuffBase::vote_handler(MsgVote &&msg, const Net::conn_t &conn) {
     });
 }
 
-void HotStuffBase::req_blk_handler(MsgReqBlock &&msg, const Net::conn_t &conn) {
+size_t HotStuffBase::agg_pos(ReplicaID rid, ReplicaID root) const {
+    size_t n = get_config().nreplicas;
+    return (rid + n - root) % n;
+}
+
+ReplicaID HotStuffBase::agg_parent(ReplicaID root) const {
+    /* the replicas form a complete tree of degree vote_fanin in the order
+     * of their ids starting from the root */
+    size_t pos = agg_pos(get_id(), root);
+    return (root + (pos - 1) / vote_fanin) % get_config().nreplicas;
+}
+
+bool HotStuffBase::agg_is_child(const PeerId &peer, ReplicaID root) const {
+    size_t n = get_config().nreplicas;
+    size_t lo = agg_pos(get_id(), root) * vote_fanin + 1;
+    for (size_t pos = lo; pos < lo + vote_fanin && pos < n; pos++)
+        if (get_config().get_peer_id((root + pos) % n) == peer) return true;
+    return false;
+}
+
+HotStuffBase::VoteAggContext &HotStuffBase::get_vote_agg(ReplicaID root, const uint256_t &blk_hash) {
+    auto it = vote_agg.find(blk_hash);
+    if (it != vote_agg.end()) return it->second;
+    while (vote_agg_queue.size() >= vote_agg_max)
+    {
+        vote_agg.erase(vote_agg_queue.front());
+        vote_agg_queue.pop();
+    }
+    vote_agg_queue.push(blk_hash);
+    auto &ctx = vote_agg[blk_hash];
+    ctx.root = root;
+    ctx.flushed = false;
+    /* the size and the height of the subtree */
+    size_t n = get_config().nreplicas;
+    size_t lo = agg_pos(get_id(), root), hi = lo;
+    size_t height = 0;
+    ctx.expected = 0;
+    for (;;)
+    {
+        ctx.expected += std::min(hi, n - 1) - lo + 1;
+        lo = lo * vote_fanin + 1;
+        hi = hi * vote_fanin + vote_fanin;
+        if (lo >= n) break;
+        height++;
+    }
+    if (height)
+    {
+        ctx.timer = TimerEvent(ec, [this, blk_hash](TimerEvent &) {
+            flush_vote_agg(blk_hash);
+        });
+        ctx.timer.add(vote_agg_timeout * height);
+    }
+    return ctx;
+}
+
+void HotStuffBase::aggregate_vote(ReplicaID root, const Vote &vote) {
+    auto &ctx = get_vote_agg(root, vote.blk_hash);
+    if (vote.voter == get_id() && !ctx.own_vote)
+    {
+        /* the bundles reach the root within a timeout per level, so wait
+         * for that (and one more level) before going around the tree */
+        size_t n = get_config().nreplicas, levels = 1;
+        for (size_t hi = 0; hi + 1 < n; hi = hi * vote_fanin + vote_fanin)
+            levels++;
+        ctx.own_vote = new MsgVote(vote);
+        const uint256_t blk_hash = vote.blk_hash;
+        ctx.fallback_timer = TimerEvent(ec, [this, blk_hash](TimerEvent &) {
+            auto it = vote_agg.find(blk_hash);
+            if (it == vote_agg.end()) return;
+            block_t blk = storage->find_blk(blk_hash);
+            if (blk && get_hqc()->get_height() >= blk->get_height()) return;
+            pn.send_msg(*it->second.own_vote,
+                        get_config().get_peer_id(it->second.root));
+            nagg_fallback++;
+        });
+        ctx.fallback_timer.add(vote_agg_timeout * levels);
+    }
+    ctx.voters.push_back(vote.voter);
+    ctx.certs.push_back(vote.cert->clone());
+    ctx.summary.add(*vote.replica_preferred_orderedlist);
+    if (ctx.flushed || ctx.voters.size() >= ctx.expected)
+        flush_vote_agg(vote.blk_hash);
+}
+
+void HotStuffBase::flush_vote_agg(const uint256_t &blk_hash) {
+    auto it = vote_agg.find(blk_hash);
+    if (it == vote_agg.end()) return;
+    auto &ctx = it->second;
+    ctx.flushed = true;
+    /* a leaf has no timer */
+    if (ctx.expected > 1) ctx.timer.del();
+    if (ctx.voters.empty()) return;
+    pn.send_msg(MsgVoteBundle(ctx.root, blk_hash, ctx.voters, ctx.certs, ctx.summary),
+                get_config().get_peer_id(agg_parent(ctx.root)));
+    nagg_sent++;
+    ctx.voters.clear();
+    ctx.certs.clear();
+    ctx.summary = PrecedenceMatrix();
+}
+
+void HotStuffBase::vote_bundle_handler(MsgVoteBundle &&msg, const Net::conn_t &conn) {
+    const PeerId peer = conn->get_peer_id();
+    if (peer.is_null()) return;
+    msg.postponed_parse(this);
+    if (msg.root >= get_config().nreplicas) return;
+    /* only the children of this replica in the tree send it bundles */
+    if (!vote_fanin || !agg_is_child(peer, msg.root)) return;
+    nagg_recv++;
+    nagg_summary_cmds += msg.summary.size();
+    if (msg.root == get_id())
+    {
+        on_vote_bundle(std::move(msg), peer);
+        return;
+    }
+    auto &ctx = get_vote_agg(msg.root, msg.blk_hash);
+    for (size_t i = 0; i < msg.voters.size(); i++)
+    {
+        ctx.voters.push_back(msg.voters[i]);
+        ctx.certs.push_back(std::move(msg.certs[i]));
+    }
+    ctx.summary.merge(msg.summary);
+    if (ctx.flushed || ctx.voters.size() >= ctx.expected)
+        flush_vote_agg(msg.blk_hash);
+}
+
+void HotStuffBase::on_vote_bundle(MsgVoteBundle &&msg, const PeerId &peer) {
+    nagg_votes += msg.voters.size();
+    RcObj<MsgVoteBundle> m(new MsgVoteBundle(std::move(msg)));
+    async_deliver_blk(m->blk_hash, peer).then([this, m](const block_t &blk) {
+        /* nothing is verified past the quorum, nor the votes already
+         * counted together with their orderings */
+        if (blk->voted.size() >= get_config().nmajority) return;
+        std::vector<size_t> idx;
+        std::vector<promise_t> pms;
+        for (size_t i = 0; i < m->voters.size(); i++)
+        {
+            ReplicaID voter = m->voters[i];
+            if (voter >= get_config().nreplicas ||
+                m->certs[i]->get_obj_hash() != m->blk_hash ||
+                (blk->voted.count(voter) &&
+                orderedlist_storage->is_summarized(m->blk_hash, voter)))
+                continue;
+            idx.push_back(i);
+            pms.push_back(m->certs[i]->verify(get_config().get_pubkey(voter), vpool));
+        }
+        if (pms.empty()) return;
+        promise::all(pms).then([this, m, idx, blk](const promise::values_t values) {
+            /* the distinct valid voters whose orderings are not taken yet
+             * (a vote sent directly, as a fallback, brings none) */
+            std::unordered_set<ReplicaID> fresh;
+            for (size_t j = 0; j < idx.size(); j++)
+            {
+                ReplicaID voter = m->voters[idx[j]];
+                if (!promise::any_cast<bool>(values[j]))
+                {
+                    LOG_WARN("invalid vote from %d in a bundle", voter);
+                    continue;
+                }
+                if (!orderedlist_storage->is_summarized(m->blk_hash, voter))
+                    fresh.insert(voter);
+                if (!blk->voted.count(voter))
+                    on_receive_vote(Vote(voter, m->blk_hash,
+                                        m->certs[idx[j]]->clone(), this));
+            }
+            /* the orderings are taken once the votes carrying them are
+             * verified, and a bundle cannot stand for more orderings than
+             * it brings new voters; the orderings themselves are not signed,
+             * so the aggregators are trusted with them */
+            if (fresh.empty()) return;
+            if (m->summary.get_total() <= fresh.size())
+                orderedlist_storage->add_summary(m->blk_hash, m->summary,
+                        std::vector<ReplicaID>(fresh.begin(), fresh.end()));
+            else
+                LOG_WARN("a bundle of %lu votes summarizes %u orderings",
+                        fresh.size(), m->summary.get_total());
+        });
+    });
+}
+
+void HotStuffBase::batch_handler(MsgBatch &&msg, const Net::conn_t &conn) {
     const PeerId replica = conn->get_peer_id();
     if (replica.is_null()) return;
-    auto &blk_hashes = msg.blk_hashes;
-    std::vector<promise_t> pms;
-    for (const auto &h: blk_hashes)
-        pms.push_back(async_fetch_blk(h, nullptr));
-    promise::all(pms).then([replica, this](const promise::values_t values) {
-        std::vector<block_t> blks;
-        for (auto &v: values)
+    const uint256_t batch_hash = msg.batch.get_hash();
+    if (storage->is_batch_fetched(batch_hash)) return;
+    /* a batch comes from its creator, or from any replica once it is
+     * decided (then its hash is certified) */
+    ReplicaID creator = msg.batch.get_creator();
+    bool from_creator = creator < get_config().nreplicas &&
+                        get_config().get_peer_id(creator) == replica;
+    bool requested = !batch_exec_waiting.empty() &&
+                    batch_exec_waiting.front().cmd_hash == batch_hash;
+    if (!from_creator && !requested) return;
+    if (!msg.batch.verify())
+    {
+        LOG_WARN("invalid batch from %s", get_hex10(replica).c_str());
+        return;
+    }
+    storage->add_batch(new CmdBatch(std::move(msg.batch)));
+    nbatch_recv++;
+    if (requested) exec_batches();
+    if (!from_creator) return;
+    /* acknowledge storing it to the creator */
+    RcObj<part_cert_bt> cert(new part_cert_bt());
+    spool.verify(new FuncTask([this, cert, batch_hash]() {
+        *cert = create_part_cert(*priv_key, batch_hash);
+        return true;
+    })).then([this, cert, batch_hash, replica]() {
+        pn.send_msg(MsgBatchAck(get_id(), batch_hash, **cert), replica);
+    });
+}
+
+void HotStuffBase::batch_ack_handler(MsgBatchAck &&msg, const Net::conn_t &conn) {
+    if (conn->get_peer_id().is_null()) return;
+    msg.postponed_parse(this);
+    auto it = batch_acking.find(msg.batch_hash);
+    if (it == batch_acking.end() || it->second.voters.count(msg.voter)) return;
+    if (msg.voter >= get_config().nreplicas) return;
+    RcObj<part_cert_bt> cert(new part_cert_bt(std::move(msg.cert)));
+    ReplicaID voter = msg.voter;
+    uint256_t batch_hash = msg.batch_hash;
+    (*cert)->verify(get_config().get_pubkey(voter), vpool).then(
+            [this, cert, voter, batch_hash](bool valid) {
+        if (!valid || (*cert)->get_obj_hash() != batch_hash)
         {
-            auto blk = promise::any_cast<block_t>(v);
-            blks.push_back(blk);
+            LOG_WARN("invalid batch ack from %d", voter);
+            return;
         }
-        pn.send_msg(MsgRespBlock(blks), replica);
+        auto it = batch_acking.find(batch_hash);
+        if (it == batch_acking.end() ||
+            !it->second.voters.insert(voter).second) return;
+        it->second.cert->add_part(voter, **cert);
+        check_batch_acks(batch_hash);
     });
 }
 
-void HotStuffBase::resp_blk_handler(MsgRespBlock &&msg, const Net::conn_t &) {
+void HotStuffBase::batch_cert_handler(MsgBatchCert &&msg, const Net::conn_t &conn) {
+    if (conn->get_peer_id().is_null()) return;
+    msg.postponed_parse(this);
+    if (batch_certified.count(msg.batch_hash) ||
+        batch_done.count(msg.batch_hash) ||
+        msg.cert->get_obj_hash() != msg.batch_hash) return;
+    RcObj<quorum_cert_bt> cert(new quorum_cert_bt(std::move(msg.cert)));
+    uint256_t batch_hash = msg.batch_hash;
+    (*cert)->verify(get_config(), vpool).then([this, cert, batch_hash](bool valid) {
+        if (!valid)
+        {
+            LOG_WARN("invalid batch certificate %.10s", get_hex(batch_hash).c_str());
+            return;
+        }
+        on_batch_certified(batch_hash);
+    });
+}
+
+void HotStuffBase::req_batch_handler(MsgReqBatch &&msg, const Net::conn_t &conn) {
+    const PeerId replica = conn->get_peer_id();
+    if (replica.is_null()) return;
+    for (const auto &h: msg.batch_hashes)
+    {
+        auto batch = storage->find_batch(h);
+        if (batch) pn.send_msg(MsgBatch(*batch), replica);
+    }
+}
+
+void HotStuffBase::req_blk_handler(MsgReqBlock &&msg, const Net::conn_t &conn) {
+    const PeerId replica = conn->get_peer_id();
+    if (replica.is_null()) return;
+    /* reply at once with the blocks at hand, and send each of the others
+     * when it arrives, so that one missing block does not hold up the
+     * whole batch */
+    std::vector<block_t> blks;
+    for (const auto &h: msg.blk_hashes)
+    {
+        if (storage->is_blk_fetched(h))
+            blks.push_back(storage->find_blk(h));
+        else
+            async_fetch_blk(h, nullptr).then([this, replica](block_t blk) {
+                pn.send_msg(MsgRespBlock(std::vector<block_t>{blk}), replica);
+            });
+    }
+    if (!blks.empty())
+        pn.send_msg(MsgRespBlock(blks), replica);
+}
+
+void HotStuffBase::resp_blk_handler(MsgRespBlock &&msg, const Net::conn_t &conn) {
+    const PeerId replica = conn->get_peer_id();
     msg.postponed_parse(this);
     for (const auto &blk: msg.blks)
-        if (blk) on_fetch_blk(blk);
+        if (blk) on_fetch_blk(blk, replica.is_null() ? nullptr : &replica);
+}
+
+void HotStuffBase::req_blk_range_handler(MsgReqBlockRange &&msg, const Net::conn_t &conn) {
+    const PeerId replica = conn->get_peer_id();
+    if (replica.is_null()) return;
+    /* walk the first parents locally, sending the blocks in bounded chunks
+     * until the requested height, the genesis or a pruned block */
+    block_t blk = storage->find_blk(msg.blk_hash);
+    std::vector<block_t> chunk;
+    size_t chunk_size = std::max(blk_range_chunk, (size_t)1);
+    while (blk && blk->is_delivered() && blk->get_height() > msg.height)
+    {
+        chunk.push_back(blk);
+        if (chunk.size() == chunk_size)
+        {
+            pn.send_msg(MsgRespBlockRange(msg.blk_hash, chunk, false), replica);
+            chunk.clear();
+        }
+        if (blk->get_parents().empty()) break;
+        blk = blk->get_parents()[0];
+    }
+    pn.send_msg(MsgRespBlockRange(msg.blk_hash, chunk, true), replica);
+}
+
+void HotStuffBase::resp_blk_range_handler(MsgRespBlockRange &&msg, const Net::conn_t &) {
+    msg.postponed_parse(this);
+    auto it = blk_range_waiting.find(msg.blk_hash);
+    if (it == blk_range_waiting.end() || it->second.closed) return;
+    auto &ctx = it->second;
+    bool broken = false;
+    for (const auto &blk: msg.blks)
+    {
+        /* each block is the first parent of the previous one (and only the
+         * genesis has no parent) */
+        if (blk->get_parent_hashes().empty() ||
+            blk->get_hash() != (ctx.blks.empty() ? msg.blk_hash :
+                                ctx.blks.back()->get_parent_hashes()[0]))
+        {
+            broken = true;
+            break;
+        }
+        on_fetch_blk(blk);
+        ctx.blks.push_back(blk);
+        nrange_blks++;
+        if (storage->is_blk_delivered(blk->get_parent_hashes()[0]))
+        {
+            /* connected to the delivered chain */
+            deliver_blk_range(msg.blk_hash);
+            return;
+        }
+    }
+    if (!msg.last && !broken) return;
+    /* the range ended (or was broken) before reaching a delivered block:
+     * fetch the rest of the chain from below the range as usual */
+    ctx.closed = true;
+    if (ctx.blks.empty())
+    {
+        auto replica = ctx.replica;
+        blk_range_waiting.erase(it);
+        deliver_blk(msg.blk_hash, replica);
+        return;
+    }
+    async_deliver_blk(ctx.blks.back()->get_parent_hashes()[0], ctx.replica).then(
+        [this, blk_hash = msg.blk_hash]() {
+            if (blk_range_waiting.count(blk_hash))
+                deliver_blk_range(blk_hash);
+        });
+}
+
+void HotStuffBase::req_checkpoint_handler(MsgReqCheckpoint &&msg, const Net::conn_t &conn) {
+    const PeerId replica = conn->get_peer_id();
+    if (replica.is_null()) return;
+    std::vector<block_t> blks;
+    if (checkpoint.blk && checkpoint.height > msg.height + catchup_lag)
+    {
+        /* the chain from the checkpoint to the highest certified block,
+         * unless part of it is already pruned */
+        block_t b = get_hqc();
+        while (b->get_height() > checkpoint.height && !b->get_parents().empty())
+        {
+            blks.push_back(b);
+            b = b->get_parents()[0];
+        }
+        blks.push_back(b);
+        if (b == checkpoint.blk)
+            std::reverse(blks.begin(), blks.end());
+        else
+            blks.clear();
+    }
+    pn.send_msg(MsgRespCheckpoint(checkpoint.height, checkpoint.app_state,
+                                checkpoint.cmds, blks), replica);
+}
+
+void HotStuffBase::resp_checkpoint_handler(MsgRespCheckpoint &&msg, const Net::conn_t &conn) {
+    const PeerId replica = conn->get_peer_id();
+    if (replica.is_null() || !catchup_pending) return;
+    msg.postponed_parse(this);
+    if (!check_checkpoint(msg))
+    {
+        if (!msg.blks.empty())
+            LOG_WARN("invalid checkpoint from %s", get_hex10(replica).c_str());
+        on_catchup_resp();
+        return;
+    }
+    std::vector<promise_t> pms;
+    for (size_t i = 1; i < msg.blks.size(); i++)
+        pms.push_back(msg.blks[i]->verify(this, vpool));
+    RcObj<MsgRespCheckpoint> m(new MsgRespCheckpoint(std::move(msg)));
+    promise::all(pms).then([this, replica, m](const promise::values_t values) {
+        if (!catchup_pending) return;
+        bool valid = true;
+        for (const auto &v: values)
+            valid = valid && promise::any_cast<bool>(v);
+        if (valid)
+        {
+            /* the height, the application state and the commands are not
+             * covered by any certificate, so they are only trusted once
+             * f + 1 replicas vouch for the same ones */
+            DataStream s;
+            s << m->blks[0]->get_hash() << htole(m->height)
+              << htole((uint32_t)m->app_state.size()) << m->app_state
+              << htole((uint32_t)m->cmds.size());
+            for (const auto &cmd: m->cmds) s << cmd;
+            auto &voters = catchup_votes[s.get_hash()];
+            voters.insert(replica);
+            const auto &config = get_config();
+            if (voters.size() > config.nreplicas - config.nmajority)
+            {
+                finish_catchup(install_checkpoint(*m));
+                return;
+            }
+        }
+        else
+            LOG_WARN("invalid certificate in the checkpoint from %s",
+                    get_hex10(replica).c_str());
+        on_catchup_resp();
+    });
+}
+
+void HotStuffBase::on_catchup_resp() {
+    /* a quorum has answered without f + 1 of them agreeing: the others are
+     * unlikely to change that, so fetch the blocks instead of waiting */
+    size_t nquorum = std::min(peers.size(), get_config().nmajority);
+    if (++catchup_nresp >= nquorum) finish_catchup(false);
+}
+
+bool HotStuffBase::check_checkpoint(const MsgRespCheckpoint &msg) const {
+    const auto &blks = msg.blks;
+    if (blks.size() < 1 + commit_chain_len) return false;
+    if (msg.height <= get_b_exec()->get_height()) return false;
+    for (size_t i = 1; i < blks.size(); i++)
+        if (blks[i]->get_parent_hashes().empty() ||
+            blks[i]->get_parent_hashes()[0] != blks[i - 1]->get_hash())
+            return false;
+    /* a chain of direct certificates commits the checkpoint block (the
+     * certificates themselves are verified by the caller) */
+    for (size_t i = 1; i <= commit_chain_len; i++)
+        if (blks[i]->get_qc()->get_obj_hash() != blks[i - 1]->get_hash())
+            return false;
+    return true;
+}
+
+bool HotStuffBase::install_checkpoint(MsgRespCheckpoint &msg) {
+    auto &blks = msg.blks;
+    DataStream s(msg.app_state.begin(), msg.app_state.end());
+    std::unordered_set<uint256_t> done, cmd_done;
+    std::deque<uint256_t> done_queue, cmd_done_queue;
+    try {
+        load_done(s, done, done_queue);
+        load_done(s, cmd_done, cmd_done_queue);
+    } catch (std::exception &err) {
+        LOG_WARN("invalid checkpoint state: %s", err.what());
+        return false;
+    }
+    /* use the copies already stored, if any */
+    for (auto &b: blks)
+        b = storage->add_blk(b);
+    const block_t &blk = blks[0];
+    if (!blk->is_delivered())
+    {
+        on_install_checkpoint(blk, msg.height, blks[1]->get_qc());
+        batch_done = std::move(done);
+        batch_done_queue = std::move(done_queue);
+        batch_cmd_done = std::move(cmd_done);
+        batch_cmd_done_queue = std::move(cmd_done_queue);
+        /* the batches decided up to the checkpoint are in its state */
+        batch_exec_waiting = std::queue<Finality>();
+        if (batch_fetch_pending)
+        {
+            batch_fetch_pending = false;
+            batch_fetch_timer.del();
+        }
+        checkpoint_waiting = nullptr;
+        checkpoint_waiting_cmds.clear();
+        state_machine_restore(s);
+        command_timestamp_storage->refresh_available_cmds(msg.cmds);
+        /* serve it to the others as well */
+        checkpoint.blk = blk;
+        checkpoint.height = msg.height;
+        checkpoint.app_state = std::move(msg.app_state);
+        checkpoint.cmds = std::move(msg.cmds);
+        checkpoint_cmds.clear();
+    }
+    for (size_t i = 1; i < blks.size(); i++)
+    {
+        on_fetch_blk(blks[i]);
+        if (!blks[i]->is_delivered()) on_deliver_blk(blks[i]);
+    }
+    ncatchup++;
+    return true;
+}
+
+void HotStuffBase::start_catchup() {
+    catchup_pending = true;
+    catchup_nresp = 0;
+    catchup_votes.clear();
+    catchup_elapsed.start();
+    LOG_INFO("falling behind, requesting checkpoints");
+    pn.multicast_msg(MsgReqCheckpoint(get_b_exec()->get_height()), peers);
+    catchup_timer = TimerEvent(ec, [this](TimerEvent &) {
+        finish_catchup(false);
+    });
+    catchup_timer.add(catchup_timeout);
+}
+
+void HotStuffBase::finish_catchup(bool installed) {
+    catchup_pending = false;
+    catchup_timer.del();
+    catchup_votes.clear();
+    catchup_elapsed.stop(false);
+    if (installed)
+        LOG_INFO("caught up to height %u in %.3f sec",
+                checkpoint.height, catchup_elapsed.elapsed_sec);
+    else
+        LOG_INFO("no checkpoint to catch up from, fetching the blocks");
+    /* the proposals extending the installed chain are delivered normally,
+     * and so are all of them if no checkpoint was installed */
+    auto deferred = std::move(catchup_deferred);
+    catchup_deferred.clear();
+    for (auto &e: deferred)
+        on_proposal(std::move(e.first), e.second);
+}
+
+void HotStuffBase::take_checkpoint(const block_t &blk) {
+    for (const auto &cmd: blk->get_proposed_orderedlist().convert_to_vec())
+        checkpoint_cmds.push_back(cmd);
+    if (blk->get_height() % checkpoint_interval) return;
+    if (checkpoint_waiting)
+    {
+        /* still waiting for the previous one: take this one instead */
+        checkpoint_waiting_cmds.insert(checkpoint_waiting_cmds.end(),
+                            checkpoint_cmds.begin(), checkpoint_cmds.end());
+        checkpoint_cmds.clear();
+        checkpoint_waiting = blk;
+        checkpoint_nwaiting = batch_exec_waiting.size();
+        return;
+    }
+    if (batch_size && !batch_exec_waiting.empty())
+    {
+        /* the snapshot must include exactly the batches decided up to the
+         * block, wherever their execution is */
+        checkpoint_waiting = blk;
+        checkpoint_nwaiting = batch_exec_waiting.size();
+        checkpoint_waiting_cmds = std::move(checkpoint_cmds);
+        checkpoint_cmds.clear();
+        return;
+    }
+    make_checkpoint(blk, std::move(checkpoint_cmds));
+    checkpoint_cmds.clear();
+}
+
+void HotStuffBase::make_checkpoint(const block_t &blk, std::vector<uint256_t> &&cmds) {
+    DataStream s;
+    save_done(s, batch_done_queue);
+    save_done(s, batch_cmd_done_queue);
+    state_machine_snapshot(s);
+    checkpoint.blk = blk;
+    checkpoint.height = blk->get_height();
+    checkpoint.app_state = bytearray_t(s.data(), s.data() + s.size());
+    checkpoint.cmds = std::move(cmds);
+    ncheckpoint++;
 }
 
 bool HotStuffBase::conn_handler(const salticidae::ConnPool::conn_t &conn, bool connected) {
@@ -271,12 +1785,68 @@ void HotStuffBase::print_stat() const {
     LOG_INFO("-------- queues -------");
     LOG_INFO("blk_fetch_waiting: %lu", blk_fetch_waiting.size());
     LOG_INFO("blk_delivery_waiting: %lu", blk_delivery_waiting.size());
+    LOG_INFO("blk_range_waiting: %lu", blk_range_waiting.size());
     LOG_INFO("decision_waiting: %lu", decision_waiting.size());
+    mempool.print_stat();
+    fetch_sched.print_stat();
+    if (blk_log) blk_log->print_stat();
+    if (checkpoint_interval)
+    {
+        LOG_INFO("-------- checkpoint ------");
+        LOG_INFO("latest: %u, taken: %lu, caught up: %lu",
+                checkpoint.height, ncheckpoint, ncatchup);
+    }
+    if (ec_proposal)
+    {
+        LOG_INFO("-------- ec_proposal (%s) ------", GF256::simd_name());
+        LOG_INFO("sent: %lu proposals, %lu bytes (%lu if sent whole)",
+                nec_prop, nec_sent_bytes, nec_full_bytes);
+        LOG_INFO("rebuilt: %lu, pending: %lu", nec_rebuilt, chunk_waiting.size());
+    }
+    if (vote_fanin)
+    {
+        LOG_INFO("-------- vote_agg (fan-in %lu) ------", vote_fanin);
+        LOG_INFO("bundles: %lu sent, %lu received, %lu votes sent directly",
+                nagg_sent, nagg_recv, nagg_fallback);
+        LOG_INFO("collected: %lu votes, avg. summary: %.1f commands",
+                nagg_votes, nagg_recv ? nagg_summary_cmds / double(nagg_recv) : 0);
+    }
+    if (safety_log)
+    {
+        LOG_INFO("-------- safety_log (%s) ------",
+                SafetyLog::mode_name(safety_log->get_mode()));
+        safety_write_lat.print("write");
+        safety_persist_lat.print("vote delay");
+        safety_write_lat.clear();
+        safety_persist_lat.clear();
+    }
     LOG_INFO("-------- misc ---------");
     LOG_INFO("fetched: %lu", fetched);
     LOG_INFO("delivered: %lu", delivered);
+    LOG_INFO("blk_range: %lu requests, %lu blocks", nrange_req, nrange_blks);
+    if (batch_size)
+        LOG_INFO("batches: %lu made, %lu received, %lu certified, %lu executed "
+                "(%lu cached, %lu waiting, %lu duplicated cmds)",
+                nbatch_made, nbatch_recv, nbatch_cert, nbatch_exec,
+                storage->get_batch_cache_size(), batch_exec_waiting.size(),
+                nbatch_dup_cmds);
     LOG_INFO("cmd_cache: %lu", storage->get_cmd_cache_size());
     LOG_INFO("blk_cache: %lu", storage->get_blk_cache_size());
+    LOG_INFO("veri_cache: %lu (%lu hit, %lu miss), part: %lu (%lu hit, %lu miss)",
+            vpool.get_cache().size(),
+            vpool.get_cache().get_nhit(),
+            vpool.get_cache().get_nmiss(),
+            vpool.get_part_cache().size(),
+            vpool.get_part_cache().get_nhit(),
+            vpool.get_part_cache().get_nmiss());
+    LOG_INFO("blk_pool: %lu free (%lu fresh, %lu reused)",
+            ObjectPool<Block>::get_nfree(),
+            ObjectPool<Block>::get_nfresh(),
+            ObjectPool<Block>::get_nreused());
+    LOG_INFO("vote_pool: %lu free (%lu fresh, %lu reused)",
+            ObjectPool<Vote>::get_nfree(),
+            ObjectPool<Vote>::get_nfresh(),
+            ObjectPool<Vote>::get_nreused());
     LOG_INFO("------ misc (10s) -----");
     LOG_INFO("fetched: %lu", part_fetched);
     LOG_INFO("delivered: %lu", part_delivered);
@@ -297,6 +1867,15 @@ void HotStuffBase::print_stat() const {
     part_delivery_time = 0;
     part_delivery_time_min = double_inf;
     part_delivery_time_max = 0;
+    LOG_INFO("--- proposal stages (10s) ---");
+    stage_deliver.print("deliver");
+    stage_fairness.print("fairness");
+    stage_sign.print("sign");
+    stage_vote.print("vote");
+    stage_deliver.clear();
+    stage_fairness.clear();
+    stage_sign.clear();
+    stage_vote.clear();
 #ifdef HOTSTUFF_MSG_STAT
     LOG_INFO("--- replica msg. (10s) ---");
     size_t _nsent = 0;
@@ -341,11 +1920,21 @@ HotStuffBase::HotStuffBase(uint32_t blk_size,
         ec(ec),
         tcall(ec),
         vpool(ec, nworker),
+        spool(ec, 1),
         pn(ec, netconfig),
         pmaker(std::move(pmaker)),
+        fetch_sched(this),
+        blk_range_chunk(128),
+        batch_size(0),
+        batch_timeout(0.005),
+        batch_seq(0),
+        batch_fetch_pending(false),
 
         fetched(0), delivered(0),
         nsent(0), nrecv(0),
+        nrange_req(0), nrange_blks(0),
+        nbatch_made(0), nbatch_recv(0), nbatch_cert(0), nbatch_exec(0),
+        nbatch_dup_cmds(0),
         part_parent_size(0),
         part_fetched(0),
         part_delivered(0),
@@ -353,13 +1942,57 @@ HotStuffBase::HotStuffBase(uint32_t blk_size,
         part_gened(0),
         part_delivery_time(0),
         part_delivery_time_min(double_inf),
-        part_delivery_time_max(0)
+        part_delivery_time_max(0),
+        vote_pipeline(true),
+        blk_log(nullptr),
+        blk_log_sync_interval(0),
+        blk_log_pool(nullptr),
+        checkpoint_interval(0),
+        catchup_lag(0),
+        checkpoint_waiting(nullptr),
+        checkpoint_nwaiting(0),
+        catchup_pending(false),
+        catchup_nresp(0),
+        ncheckpoint(0),
+        ncatchup(0),
+        ec_proposal(false),
+        ec_coder(nullptr),
+        nec_prop(0),
+        nec_sent_bytes(0),
+        nec_full_bytes(0),
+        nec_rebuilt(0),
+        vote_fanin(0),
+        vote_agg_timeout(0.01),
+        nagg_sent(0),
+        nagg_recv(0),
+        nagg_votes(0),
+        nagg_summary_cmds(0),
+        nagg_fallback(0),
+        safety_log(nullptr),
+        safety_pool(nullptr),
+        safety_dirty(false),
+        safety_flushing(false)
 {
+    batch_timer = TimerEvent(ec, [this](TimerEvent &) { seal_batch(); });
+    batch_fetch_timer = TimerEvent(ec, [this](TimerEvent &) {
+        batch_fetch_pending = false;
+        exec_batches();
+    });
     /* register the handlers for msg from replicas */
     pn.reg_handler(salticidae::generic_bind(&HotStuffBase::propose_handler, this, _1, _2));
+    pn.reg_handler(salticidae::generic_bind(&HotStuffBase::propose_chunk_handler, this, _1, _2));
     pn.reg_handler(salticidae::generic_bind(&HotStuffBase::vote_handler, this, _1, _2));
+    pn.reg_handler(salticidae::generic_bind(&HotStuffBase::vote_bundle_handler, this, _1, _2));
     pn.reg_handler(salticidae::generic_bind(&HotStuffBase::req_blk_handler, this, _1, _2));
     pn.reg_handler(salticidae::generic_bind(&HotStuffBase::resp_blk_handler, this, _1, _2));
+    pn.reg_handler(salticidae::generic_bind(&HotStuffBase::req_blk_range_handler, this, _1, _2));
+    pn.reg_handler(salticidae::generic_bind(&HotStuffBase::resp_blk_range_handler, this, _1, _2));
+    pn.reg_handler(salticidae::generic_bind(&HotStuffBase::batch_handler, this, _1, _2));
+    pn.reg_handler(salticidae::generic_bind(&HotStuffBase::batch_ack_handler, this, _1, _2));
+    pn.reg_handler(salticidae::generic_bind(&HotStuffBase::batch_cert_handler, this, _1, _2));
+    pn.reg_handler(salticidae::generic_bind(&HotStuffBase::req_batch_handler, this, _1, _2));
+    pn.reg_handler(salticidae::generic_bind(&HotStuffBase::req_checkpoint_handler, this, _1, _2));
+    pn.reg_handler(salticidae::generic_bind(&HotStuffBase::resp_checkpoint_handler, this, _1, _2));
     pn.reg_conn_handler(salticidae::generic_bind(&HotStuffBase::conn_handler, this, _1, _2));
     pn.reg_error_handler([](const std::exception_ptr _err, bool fatal, int32_t async_id) {
         try {
@@ -372,8 +2005,46 @@ HotStuffBase::HotStuffBase(uint32_t blk_size,
     pn.listen(listen_addr);
 }
 
+void HotStuffBase::beat_and_propose() {
+    pmaker->beat().then([this](ReplicaID proposer) {
+        uint256_t block_hash = pmaker->get_parents()[0]->get_hash();
+        HOTSTUFF_LOG_PROTO("The parent block is: %s", get_hex10(block_hash).c_str());
+        LeaderProposedOrderedList proposed_orderedlist;
+        if (block_hash != this->get_genesis_hash())
+        {
+            // applying Aequitas to get the proposed ordering
+            float g = 3.0 / 4.0;
+            proposed_orderedlist = Aequitas::aequitas_order(
+                    this->orderedlist_storage->get_candidates(block_hash),
+                    this->orderedlist_storage->get_summary(block_hash), g);
+            for (const auto &cmd: proposed_orderedlist.convert_to_vec())
+                mempool.mark_proposed(cmd);
+            proposed_orderedlist.print_out();
+        }
+        else 
+        {
+            // beginning proposal, no need for aequitas
+            std::vector<uint256_t> cmds = mempool.take(blk_size);
+            std::vector<std::vector<uint256_t>> proposed_ranked_cmds;
+            for(auto cmd: cmds) {
+                proposed_ranked_cmds.push_back(std::vector<uint256_t> {cmd});
+            }
+            proposed_orderedlist = LeaderProposedOrderedList(proposed_ranked_cmds);
+            proposed_orderedlist.print_out();
+        }
+
+        if (proposer == get_id())
+            on_propose(pmaker->get_parents(), proposed_orderedlist);
+    });
+}
+
 void HotStuffBase::do_broadcast_proposal(const Proposal &prop) {
-    pn.multicast_msg(MsgPropose(prop), peers);
+    if (ec_proposal)
+        broadcast_proposal_chunks(prop);
+    else
+        pn.multicast_msg(MsgPropose(prop), peers);
+    /* the proposer delivers its own block without on_deliver_blk() */
+    log_blk(prop.blk);
     // leader's addition of orderedlist should be done here.
     command_timestamp_storage->refresh_available_cmds(prop.blk->get_proposed_orderedlist().convert_to_vec());
     orderedlist_t self_orderedlist = command_timestamp_storage->get_orderedlist(prop.blk->get_hash(), blk_size);
@@ -405,22 +2076,47 @@ void HotStuffBase::do_vote(ReplicaID last_proposer, const Vote &dummy_vote)
                 //HOTSTUFF_LOG_PROTO("Part test cert is: %s", get_hex10(certificate->get_obj_hash()).c_str());
                 // WARN - Here the data inside replica_preferred_orderedlist is not returned on calling extract_cmds()
                 //orderedlist_t replica_orderedlist = command_timestamp_storage->get_orderedlist(blk_hash_test);
-                Vote vote = Vote(std::move(dummy_vote.voter), vote_blk_hash, create_part_cert(*priv_key, vote_blk_hash), command_timestamp_storage->get_orderedlist(vote_blk_hash, blk_size), this);
+                /* reuse the certificate of the dummy vote (possibly signed
+                 * ahead by a worker) instead of signing again */
+                part_cert_bt cert = dummy_vote.cert ?
+                    part_cert_bt(dummy_vote.cert->clone()) :
+                    create_part_cert(*priv_key, vote_blk_hash);
+                Vote vote = Vote(std::move(dummy_vote.voter), vote_blk_hash, std::move(cert), command_timestamp_storage->get_orderedlist(vote_blk_hash, blk_size), this);
                 //HOTSTUFF_LOG_PROTO("The size inside do_vote  after pmakeris: %lu", vote_test.replica_preferred_orderedlist->extract_cmds().size());
                 //for(auto &ts: vote_test.replica_preferred_orderedlist->extract_timestamps()) {
                 //    HOTSTUFF_LOG_PROTO("The ts sent is: %s", boost::lexical_cast<std::string>(ts).c_str());
                 //}
                 // HOTSTUFF_LOG_PROTO("The size inside do_vote  after pmakeris: %lu", vote.replica_preferred_orderedlist->extract_cmds().size());
-                pn.send_msg(MsgVote(vote), get_config().get_peer_id(proposer));
+                if (vote_fanin)
+                    aggregate_vote(proposer, vote);
+                else
+                    pn.send_msg(MsgVote(vote), get_config().get_peer_id(proposer));
             }
         });
 }
 
 void HotStuffBase::do_consensus(const block_t &blk) {
+    if (blk_log)
+    {
+        blk_log->append_commit(blk->get_hash());
+        if (blk_log->need_flush()) flush_blk_log();
+    }
+    if (checkpoint_interval) take_checkpoint(blk);
     pmaker->on_consensus(blk);
 }
 
 void HotStuffBase::do_decide(Finality &&fin) {
+    if (batch_size)
+    {
+        /* the decided "command" is a batch */
+        batch_exec_waiting.push(std::move(fin));
+        exec_batches();
+        return;
+    }
+    decide_cmd(std::move(fin));
+}
+
+void HotStuffBase::decide_cmd(Finality &&fin) {
     part_decided++;
     state_machine_execute(fin);
     auto it = decision_waiting.find(fin.cmd_hash);
@@ -458,79 +2154,72 @@ void HotStuffBase::start(
     if (nfaulty == 0)
         LOG_WARN("too few replicas in the system to tolerate any failure");
     on_init(nfaulty);
+    /* warm the pools of the consensus thread for the live window: the blocks
+     * kept until pruned plus those not committed yet, and a round of votes
+     * for each of the latter */
+    if (get_prune_staleness() >= 0)
+    {
+        size_t nblks = get_prune_staleness() + commit_chain_len + 1;
+        ObjectPool<Block>::reserve(std::min(nblks, pool_reserve_max));
+        ObjectPool<Vote>::reserve(std::min(
+            get_config().nreplicas * (commit_chain_len + 1), pool_reserve_max));
+    }
+    if (blk_log)
+    {
+        recover_blk_log();
+        blk_log_timer = TimerEvent(ec, [this](TimerEvent &) {
+            /* group commit: one sync for the records of the interval */
+            flush_blk_log();
+            blk_log_timer.add(blk_log_sync_interval);
+        });
+        blk_log_timer.add(blk_log_sync_interval);
+    }
+    if (safety_log) recover_safety_log();
     pmaker->init(this);
     if (ec_loop)
         ec.dispatch();
     HOTSTUFF_LOG_INFO("===========checkpoint2=============");
     cmd_pending.reg_handler(ec, [this](cmd_queue_t &q) {
         HOTSTUFF_LOG_INFO("===========checkpoint3=============");
-        std::pair<uint256_t, commit_cb_t> e;
+        PendingCmd e;
         while (q.try_dequeue(e))
         {
             HOTSTUFF_LOG_INFO("===========checkpoint4=============");
             ReplicaID proposer = pmaker->get_proposer();
 
-            const auto &cmd_hash = e.first;
+            const auto &cmd_hash = e.cmd_hash;
+            /* record the arrival time for the fairness ordering (of the
+             * command, or of its batch once certified) */
+            if (!batch_size && command_timestamp_storage->is_new_command(cmd_hash))
+                command_timestamp_storage->add_command_to_storage(cmd_hash, e.timestamp);
             auto it = decision_waiting.find(cmd_hash);
-            if (it == decision_waiting.end())
-                it = decision_waiting.insert(std::make_pair(cmd_hash, e.second)).first;
+            bool is_new = it == decision_waiting.end();
+            if (is_new)
+                it = decision_waiting.insert(std::make_pair(cmd_hash, e.callback)).first;
             else
-                e.second(Finality(id, 0, 0, 0, cmd_hash, uint256_t()));
+                e.callback(Finality(id, 0, 0, 0, cmd_hash, uint256_t()));
+            if (batch_size)
+            {
+                if (is_new) add_to_batch(cmd_hash, std::move(e.payload));
+                continue;
+            }
             if (proposer != get_id())
                 continue;
-            cmd_pending_buffer.push_back(cmd_hash);
-            if (cmd_pending_buffer.size() >= blk_size)
+            auto res = mempool.admit(cmd_hash, e.client, e.nbytes);
+            if (res == Mempool::CLIENT_QUOTA || res == Mempool::OVERLOADED)
+            {
+                /* push back on the client instead of buffering without bound
+                 * (a duplicate was already answered above) */
+                if (!is_new) continue;
+                decision_waiting.erase(it);
+                e.callback(Finality(id, -1, 0, 0, cmd_hash, uint256_t()));
+                continue;
+            }
+            if (res != Mempool::ADMITTED)
+                continue;
+            if (mempool.size() >= blk_size)
             {
-                // std::vector<uint256_t> cmds;
-                // for (uint32_t i = 0; i < blk_size; i++)
-                // {
-                //     cmds.push_back(cmd_pending_buffer.front());
-                //     HOTSTUFF_LOG_PROTO("command being included in proposal to be sent is: %s", get_hex10(cmd_pending_buffer.front()).c_str());
-                //     cmd_pending_buffer.pop();
-                // }
-
-                
-                pmaker->beat().then([this](ReplicaID proposer) {
-                    
-
-                    uint256_t block_hash = pmaker->get_parents()[0]->get_hash();
-                    HOTSTUFF_LOG_PROTO("The parent block is: %s", get_hex10(block_hash).c_str());
-                    LeaderProposedOrderedList proposed_orderedlist;
-                    if (block_hash != this->get_genesis_hash())
-                    {
-                        // applying Aequitas to get the proposed ordering
-                        float g = 3.0 / 4.0;
-                        std::vector<OrderedList> replica_orderedlists = this->orderedlist_storage->get_set_of_orderedlists(block_hash);
-                        proposed_orderedlist = Aequitas::aequitas_order(replica_orderedlists,g);
-                        for (auto cmd: proposed_orderedlist.convert_to_vec()) 
-                        {
-                            auto it = std::find(cmd_pending_buffer.begin(), cmd_pending_buffer.end(), cmd);
-                            auto index = std::distance(cmd_pending_buffer.begin(), it);
-                            cmd_pending_buffer.erase(cmd_pending_buffer.begin() + index);
-                        }
-                        proposed_orderedlist.print_out();
-                    }
-                    else 
-                    {
-                        // beginning proposal, no need for aequitas
-                        std::vector<uint256_t> cmds;
-                        for (uint32_t i = 0; i < blk_size; i++)
-                        {
-                            cmds.push_back(cmd_pending_buffer.front());
-                            cmd_pending_buffer.erase(cmd_pending_buffer.begin());
-                        }
-                        std::vector<std::vector<uint256_t>> proposed_ranked_cmds;
-                        for(auto cmd: cmds) {
-                            proposed_ranked_cmds.push_back(std::vector<uint256_t> {cmd});
-                        }
-                        proposed_orderedlist = LeaderProposedOrderedList(proposed_ranked_cmds);
-                        proposed_orderedlist.print_out();
-                    }
-                   
-
-                    if (proposer == get_id())
-                        on_propose(pmaker->get_parents(), proposed_orderedlist);
-                });
+                beat_and_propose();
                 return true;
             }
         }
@@ -17,6 +17,9 @@
 //#include <error.h>
 #include "salticidae/util.h"
 #include "hotstuff/crypto.h"
+#ifdef HOTSTUFF_BLS
+#include "hotstuff/crypto_bls.h"
+#endif
 
 using salticidae::Config;
 using hotstuff::privkey_bt;
@@ -33,6 +36,10 @@ int main(int argc, char **argv) {
     auto &algo = opt_algo->get();
     if (algo == "secp256k1")
         priv_key = new hotstuff::PrivKeySecp256k1();
+#ifdef HOTSTUFF_BLS
+    else if (algo == "bls")
+        priv_key = new hotstuff::PrivKeyBLS();
+#endif
  //   else
  //       error(1, 0, "algo not supported");
     int n = opt_n->get();
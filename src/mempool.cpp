@@ -0,0 +1,110 @@
+/**
+ * Copyright 2018 VMware
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "hotstuff/util.h"
+#include "hotstuff/mempool.h"
+
+#define LOG_INFO HOTSTUFF_LOG_INFO
+
+namespace hotstuff {
+
+Mempool::Mempool(const Config &config):
+    config(config), nbytes(0),
+    nadmitted(0), nduplicate(0), nquota(0), noverloaded(0), nproposed(0),
+    peak_size(0), peak_bytes(0) {}
+
+Mempool::AdmitResult Mempool::admit(const uint256_t &cmd_hash,
+                                    const NetAddr &client, size_t cmd_size) {
+    if (index.count(cmd_hash) || recent.count(cmd_hash))
+    {
+        nduplicate++;
+        return DUPLICATE;
+    }
+    if ((config.max_cmds && entries.size() >= config.max_cmds) ||
+        (config.max_bytes && nbytes + cmd_size > config.max_bytes))
+    {
+        noverloaded++;
+        return OVERLOADED;
+    }
+    auto &cnt = client_pending[client];
+    if (config.client_quota && cnt >= config.client_quota)
+    {
+        nquota++;
+        return CLIENT_QUOTA;
+    }
+    cnt++;
+    nbytes += cmd_size;
+    index.insert(std::make_pair(cmd_hash,
+        entries.insert(entries.end(), Entry(cmd_hash, client, cmd_size))));
+    nadmitted++;
+    peak_size = std::max(peak_size, entries.size());
+    peak_bytes = std::max(peak_bytes, nbytes);
+    return ADMITTED;
+}
+
+void Mempool::erase(entry_list_t::iterator it) {
+    auto cit = client_pending.find(it->client);
+    if (--cit->second == 0)
+        client_pending.erase(cit);
+    nbytes -= it->nbytes;
+    index.erase(it->cmd_hash);
+    entries.erase(it);
+}
+
+void Mempool::remember(const uint256_t &cmd_hash) {
+    if (!config.recent_size) return;
+    if (!recent.insert(cmd_hash).second) return;
+    recent_queue.push_back(cmd_hash);
+    if (recent_queue.size() > config.recent_size)
+    {
+        recent.erase(recent_queue.front());
+        recent_queue.pop_front();
+    }
+}
+
+std::vector<uint256_t> Mempool::take(size_t n) {
+    std::vector<uint256_t> cmds;
+    while (n-- && !entries.empty())
+    {
+        auto cmd_hash = entries.front().cmd_hash;
+        erase(entries.begin());
+        remember(cmd_hash);
+        nproposed++;
+        cmds.push_back(cmd_hash);
+    }
+    return cmds;
+}
+
+bool Mempool::mark_proposed(const uint256_t &cmd_hash) {
+    remember(cmd_hash);
+    auto it = index.find(cmd_hash);
+    if (it == index.end()) return false;
+    erase(it->second);
+    nproposed++;
+    return true;
+}
+
+void Mempool::print_stat() const {
+    LOG_INFO("-------- mempool ------");
+    LOG_INFO("pending: %lu (%lu bytes), peak: %lu (%lu bytes)",
+            entries.size(), nbytes, peak_size, peak_bytes);
+    LOG_INFO("clients: %lu", client_pending.size());
+    LOG_INFO("admitted: %lu, proposed: %lu", nadmitted, nproposed);
+    LOG_INFO("rejected: %lu dup, %lu quota, %lu overloaded",
+            nduplicate, nquota, noverloaded);
+}
+
+}
@@ -0,0 +1,196 @@
+/**
+ * Copyright 2018 VMware
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "hotstuff/util.h"
+#include "hotstuff/safetylog.h"
+
+#define LOG_INFO HOTSTUFF_LOG_INFO
+#define LOG_WARN HOTSTUFF_LOG_WARN
+
+namespace hotstuff {
+
+const uint32_t SafetyLog::magic;
+const size_t SafetyLog::header_size;
+
+static std::runtime_error log_error(const std::string &what) {
+    return std::runtime_error("safety log: " + what + ": " + strerror(errno));
+}
+
+SafetyLog::SafetyLog(const Config &config):
+    config(config), fd(-1), seq(0), next_off(0), buf(nullptr), buf_size(0) {
+    if (!config.slot_size || config.file_size < config.slot_size)
+        throw std::runtime_error("safety log: invalid slot size");
+    if (config.direct && config.slot_size % 4096)
+        throw std::runtime_error("safety log: O_DIRECT needs 4096-byte slots");
+}
+
+SafetyLog::~SafetyLog() {
+    if (fd >= 0) close(fd);
+    free(buf);
+}
+
+void SafetyLog::reserve_buf(size_t size) {
+    if (size <= buf_size) return;
+    void *p;
+    if (posix_memalign(&p, 4096, size))
+        throw std::runtime_error("safety log: cannot allocate the buffer");
+    free(buf);
+    buf = (uint8_t *)p;
+    buf_size = size;
+}
+
+void SafetyLog::prepare_file() {
+    struct stat st;
+    if (fstat(fd, &st) < 0)
+        throw log_error("cannot stat " + config.path);
+    if ((uint64_t)st.st_size >= config.file_size) return;
+    /* write the zeros once, so that later writes do not allocate blocks
+     * (which would make fdatasync flush the metadata as well) */
+    reserve_buf(config.slot_size);
+    memset(buf, 0, config.slot_size);
+    for (uint64_t off = st.st_size / config.slot_size * config.slot_size;
+            off < config.file_size; off += config.slot_size)
+        if (pwrite(fd, buf, config.slot_size, off) != (ssize_t)config.slot_size)
+            throw log_error("cannot preallocate " + config.path);
+    if (fsync(fd) < 0)
+        throw log_error("cannot sync " + config.path);
+}
+
+bool SafetyLog::recover(bytearray_t &state) {
+    int flags = O_RDWR | O_CREAT;
+#ifdef O_DIRECT
+    if (config.direct) flags |= O_DIRECT;
+#else
+    if (config.direct)
+        LOG_WARN("safety log: O_DIRECT is not supported, using the page cache");
+#endif
+    fd = open(config.path.c_str(), flags, 0644);
+    if (fd < 0)
+        throw log_error("cannot open " + config.path);
+    prepare_file();
+
+    /* read through the page cache, the file is small */
+    int rfd = open(config.path.c_str(), O_RDONLY);
+    if (rfd < 0)
+        throw log_error("cannot open " + config.path);
+    bytearray_t data(config.file_size);
+    ssize_t size = pread(rfd, data.data(), data.size(), 0);
+    close(rfd);
+    if (size < 0)
+        throw log_error("cannot read " + config.path);
+
+    bool found = false;
+    uint64_t off = 0;
+    while (off + header_size <= (uint64_t)size)
+    {
+        const uint8_t *rec = &data[off];
+        uint32_t m, len, crc;
+        uint64_t s;
+        memcpy(&m, rec, 4);
+        memcpy(&len, rec + 4, 4);
+        memcpy(&s, rec + 8, 8);
+        memcpy(&crc, rec + 16, 4);
+        len = letoh(len);
+        uint64_t rec_size = header_size + len;
+        if (letoh(m) != magic || rec_size > (uint64_t)size - off ||
+            crc32c(rec + header_size, len, crc32c(rec + 8, 8)) != letoh(crc))
+        {
+            off += config.slot_size;
+            continue;
+        }
+        s = letoh(s);
+        /* round up to the next slot */
+        uint64_t end = off + (rec_size + config.slot_size - 1) /
+                            config.slot_size * config.slot_size;
+        if (!found || s > seq)
+        {
+            found = true;
+            seq = s;
+            next_off = end;
+            state = bytearray_t(rec + header_size, rec + rec_size);
+        }
+        off = end;
+    }
+    if (found)
+        LOG_INFO("safety log: recovered state #%lu (%lu bytes)",
+                seq, state.size());
+    return found;
+}
+
+void SafetyLog::write(const uint8_t *data, size_t len) {
+    if (fd < 0)
+        throw std::runtime_error("safety log: write before recovery");
+    size_t rec_size = (header_size + len + config.slot_size - 1) /
+                        config.slot_size * config.slot_size;
+    if (rec_size > config.file_size)
+        throw std::runtime_error("safety log: the state does not fit in the file");
+    if (next_off + rec_size > config.file_size) next_off = 0;
+    reserve_buf(rec_size);
+    uint32_t v = htole(magic);
+    memcpy(buf, &v, 4);
+    v = htole((uint32_t)len);
+    memcpy(buf + 4, &v, 4);
+    uint64_t s = htole(++seq);
+    memcpy(buf + 8, &s, 8);
+    memcpy(buf + header_size, data, len);
+    v = htole(crc32c(buf + header_size, len, crc32c(buf + 8, 8)));
+    memcpy(buf + 16, &v, 4);
+    memset(buf + 20, 0, 4);
+    memset(buf + header_size + len, 0, rec_size - header_size - len);
+    for (;;)
+    {
+        ssize_t ret = pwrite(fd, buf, rec_size, next_off);
+        if (ret == (ssize_t)rec_size) break;
+        if (ret < 0 && errno == EINTR) continue;
+        throw log_error("cannot write");
+    }
+#ifdef __linux__
+    if (fdatasync(fd) < 0)
+#else
+    if (fsync(fd) < 0)
+#endif
+        throw log_error("cannot sync");
+    next_off += rec_size;
+}
+
+const char *SafetyLog::mode_name(Mode mode) {
+    switch (mode)
+    {
+        case MODE_SYNC: return "sync";
+        case MODE_GROUP: return "group";
+        case MODE_ASYNC: return "async";
+    }
+    return "unknown";
+}
+
+bool SafetyLog::parse_mode(const std::string &name, Mode &mode) {
+    for (auto m: {MODE_SYNC, MODE_GROUP, MODE_ASYNC})
+        if (name == mode_name(m))
+        {
+            mode = m;
+            return true;
+        }
+    return false;
+}
+
+}
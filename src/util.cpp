@@ -14,10 +14,51 @@
  * limitations under the License.
  */
 
+#include <cstring>
+#ifdef __SSE4_2__
+#include <nmmintrin.h>
+#endif
+
 #include "hotstuff/util.h"
 
 namespace hotstuff {
 
 Logger logger("hotstuff");
 
+#ifdef __SSE4_2__
+uint32_t crc32c(const uint8_t *data, size_t len, uint32_t crc) {
+    uint64_t c = ~crc;
+    for (; len >= 8; data += 8, len -= 8)
+    {
+        uint64_t v;
+        memcpy(&v, data, 8);
+        c = _mm_crc32_u64(c, v);
+    }
+    uint32_t c32 = c;
+    for (; len; data++, len--)
+        c32 = _mm_crc32_u8(c32, *data);
+    return ~c32;
+}
+#else
+static struct CRC32CTable {
+    uint32_t t[256];
+    CRC32CTable() {
+        for (uint32_t i = 0; i < 256; i++)
+        {
+            uint32_t c = i;
+            for (int k = 0; k < 8; k++)
+                c = (c >> 1) ^ (0x82f63b78 & -(c & 1));
+            t[i] = c;
+        }
+    }
+} crc32c_table;
+
+uint32_t crc32c(const uint8_t *data, size_t len, uint32_t crc) {
+    uint32_t c = ~crc;
+    for (; len; data++, len--)
+        c = crc32c_table.t[(c ^ *data) & 0xff] ^ (c >> 8);
+    return ~c;
+}
+#endif
+
 }
@@ -0,0 +1,67 @@
+#include <atomic>
+#include <cstdlib>
+#include <deque>
+#include <new>
+
+#include "hotstuff/entity.h"
+#include "hotstuff/consensus.h"
+
+using namespace hotstuff;
+
+/* counts every allocation made through the global operator new */
+static std::atomic<size_t> nalloc(0);
+
+void *operator new(size_t size) {
+    nalloc++;
+    if (void *p = malloc(size)) return p;
+    throw std::bad_alloc();
+}
+
+void operator delete(void *p) noexcept { free(p); }
+void operator delete(void *p, size_t) noexcept { free(p); }
+
+/* Measures the heap allocations per consensus round in steady state: each
+ * round creates a block, collects the votes of all replicas, and releases
+ * the block that falls out of the live window (as prune does, after it has
+ * cut the links between blocks). */
+int main() {
+    const size_t nreplicas = 4;
+    const size_t window = 128;
+    const size_t nwarmup = 1000;
+    const size_t nround = 100000;
+    std::deque<block_t> live;
+    LeaderProposedOrderedList ordering;
+    size_t start_alloc = 0;
+    uint64_t start_fresh = 0;
+
+    for (size_t r = 0; r < nwarmup + nround; r++)
+    {
+        if (r == nwarmup)
+        {
+            start_alloc = nalloc;
+            start_fresh = ObjectPool<Block>::get_nfresh() +
+                        ObjectPool<Vote>::get_nfresh();
+        }
+        block_t blk = new Block({}, new QuorumCertDummy(), ordering,
+                                bytearray_t(), r + 1, nullptr, nullptr);
+        for (ReplicaID i = 0; i < nreplicas; i++)
+        {
+            vote_t v(new Vote(i, blk->get_hash(), nullptr, nullptr));
+            (void)v->voter;
+        }
+        live.push_back(blk);
+        if (live.size() > window)
+            live.pop_front();
+    }
+    size_t heap = nalloc - start_alloc;
+    uint64_t pool_fresh = ObjectPool<Block>::get_nfresh() +
+                        ObjectPool<Vote>::get_nfresh() - start_fresh;
+    printf("rounds: %lu, replicas: %lu, live window: %lu\n",
+            nround, nreplicas, window);
+    printf("heap allocations per round: %.2f\n", heap / double(nround));
+    printf("pool misses per round: %.4f (block reused %lu, vote reused %lu)\n",
+            pool_fresh / double(nround),
+            ObjectPool<Block>::get_nreused(),
+            ObjectPool<Vote>::get_nreused());
+    return 0;
+}
@@ -0,0 +1,61 @@
+#include <chrono>
+#include <cstdlib>
+#include <random>
+#include <stdexcept>
+
+#include "hotstuff/erasure.h"
+
+using namespace hotstuff;
+
+/* Sends a proposal of the given size (1 MB by default) through the erasure
+ * coder on loopback: the proposer encodes it into n chunks with their Merkle
+ * proofs, and a replica rebuilds it from n - 2f chunks (the parity ones, the
+ * worst case). Prints the proposer's egress bytes per proposal, whole vs.
+ * coded, and the coding time for different n. */
+int main(int argc, char **argv) {
+    const size_t len = argc > 1 ? atol(argv[1]) : (1 << 20);
+    const size_t niter = 10;
+    std::mt19937 rng(0);
+    bytearray_t data(len);
+    for (auto &b: data) b = rng();
+    printf("region multiplication: %s, proposal: %lu bytes\n",
+            GF256::simd_name(), len);
+    printf("%5s %5s %14s %14s %7s %11s %11s\n",
+            "n", "k", "whole_bytes", "coded_bytes", "ratio", "encode_ms", "decode_ms");
+    for (size_t n: {4, 16, 64, 128, 256})
+    {
+        size_t nfaulty = (n - 1) / 3;
+        ReedSolomon coder(n - 2 * nfaulty, n);
+        std::vector<bytearray_t> chunks;
+        size_t coded = 0;
+        auto start = std::chrono::steady_clock::now();
+        for (size_t t = 0; t < niter; t++)
+        {
+            chunks = coder.encode(data.data(), len);
+            MerkleTree tree(chunks);
+            coded = 0;
+            for (size_t i = 1; i < n; i++)
+                coded += chunks[i].size() + tree.get_proof(i).size() * 32;
+        }
+        std::chrono::duration<double, std::milli> enc =
+            std::chrono::steady_clock::now() - start;
+
+        /* lose the data chunks that the parity ones can stand for */
+        auto received = chunks;
+        for (size_t i = 0; i < n - coder.get_k() && i < coder.get_k(); i++)
+            received[i].clear();
+        bytearray_t out;
+        start = std::chrono::steady_clock::now();
+        for (size_t t = 0; t < niter; t++)
+            if (!coder.decode(received, len, out) || out != data)
+                throw std::runtime_error("decoding failed");
+        std::chrono::duration<double, std::milli> dec =
+            std::chrono::steady_clock::now() - start;
+
+        size_t whole = len * (n - 1);
+        printf("%5lu %5lu %14lu %14lu %7.2f %11.2f %11.2f\n",
+                n, coder.get_k(), whole, coded, whole / double(coded),
+                enc.count() / niter, dec.count() / niter);
+    }
+    return 0;
+}
@@ -0,0 +1,71 @@
+#include <chrono>
+#include <vector>
+
+#include "hotstuff/entity.h"
+#include "hotstuff/crypto.h"
+#ifdef HOTSTUFF_BLS
+#include "hotstuff/crypto_bls.h"
+#endif
+
+using namespace hotstuff;
+
+/* Measures the encoded size and the verification time of a quorum
+ * certificate of the given kind for different numbers of replicas. */
+template<typename PrivKeyType, typename PartCertType, typename QuorumCertType>
+void bench_qc(const char *name) {
+    const size_t niter = 20;
+    printf("%s\n", name);
+    printf("%6s %6s %10s %14s\n", "n", "quorum", "qc_bytes", "verify_us");
+    for (size_t n: {4, 16, 64, 128})
+    {
+        ReplicaConfig config;
+        std::vector<PrivKeyType> privs(n);
+        for (size_t i = 0; i < n; i++)
+        {
+            privs[i].from_rand();
+            config.add_replica(i, ReplicaInfo(i, PeerId(), privs[i].get_pubkey()));
+        }
+        config.nmajority = n - (n - 1) / 3;
+
+        bytearray_t raw(32);
+        raw[0] = n;
+        uint256_t obj_hash(raw);
+        QuorumCertType qc(config, obj_hash);
+        for (size_t i = 0; i < config.nmajority; i++)
+            qc.add_part(i, PartCertType(privs[i], obj_hash));
+        qc.compute();
+
+        DataStream s;
+        s << qc;
+        size_t qc_bytes = s.size();
+        /* verify the received copy, as a replica would */
+        QuorumCertType recv;
+        s >> recv;
+
+        auto start = std::chrono::steady_clock::now();
+        for (size_t k = 0; k < niter; k++)
+            if (!recv.verify(config))
+                throw std::runtime_error("qc verification failed");
+        std::chrono::duration<double, std::micro> elapsed =
+            std::chrono::steady_clock::now() - start;
+        printf("%6lu %6lu %10lu %14.1f\n",
+                n, config.nmajority, qc_bytes, elapsed.count() / niter);
+
+        /* a QC missing a signature must not pass */
+        QuorumCertType partial(config, obj_hash);
+        for (size_t i = 1; i < config.nmajority; i++)
+            partial.add_part(i, PartCertType(privs[i], obj_hash));
+        partial.add_part(0, PartCertType(privs[1], obj_hash));
+        partial.compute();
+        if (partial.verify(config))
+            throw std::runtime_error("a forged qc was accepted");
+    }
+}
+
+int main() {
+    bench_qc<PrivKeySecp256k1, PartCertSecp256k1, QuorumCertSecp256k1>("secp256k1");
+#ifdef HOTSTUFF_BLS
+    bench_qc<PrivKeyBLS, PartCertBLS, QuorumCertBLS>("bls");
+#endif
+    return 0;
+}
@@ -0,0 +1,142 @@
+#include <chrono>
+#include <condition_variable>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <thread>
+#include <unistd.h>
+
+#include "hotstuff/util.h"
+#include "hotstuff/safetylog.h"
+
+using namespace hotstuff;
+using steady_clock = std::chrono::steady_clock;
+
+static double since(steady_clock::time_point t) {
+    return std::chrono::duration<double>(steady_clock::now() - t).count();
+}
+
+/* Votes arrive every interval; each changes the state (of about the size of
+ * one with a 4-replica QC). Records the delay from the change to the time
+ * the vote may leave (vote), and to the time the state is durable
+ * (durable), as HotStuffBase schedules them in the given mode: a write per
+ * vote (sync), or one write at a time by a background thread for all the
+ * states changed meanwhile, with the votes waiting for it (group) or not
+ * (async). */
+static void run(SafetyLog &log, SafetyLog::Mode mode, size_t nwrite,
+                double interval, LatencyHistogram &vote, LatencyHistogram &durable) {
+    bytearray_t state(400);
+    std::mutex m;
+    std::condition_variable cv;
+    /* the arrival times of the changes not yet written */
+    std::vector<steady_clock::time_point> waiting;
+    bool done = false;
+    std::string error;
+    std::thread flusher;
+    if (mode != SafetyLog::MODE_SYNC)
+        flusher = std::thread([&]() {
+            std::unique_lock<std::mutex> lk(m);
+            for (;;)
+            {
+                cv.wait(lk, [&]() { return done || !waiting.empty(); });
+                if (waiting.empty()) return;
+                auto batch = std::move(waiting);
+                waiting.clear();
+                bytearray_t copy = state;
+                lk.unlock();
+                try {
+                    log.write(copy.data(), copy.size());
+                } catch (std::runtime_error &err) {
+                    lk.lock();
+                    error = err.what();
+                    return;
+                }
+                lk.lock();
+                for (auto t: batch)
+                {
+                    double d = since(t);
+                    durable.add(d);
+                    if (mode == SafetyLog::MODE_GROUP) vote.add(d);
+                }
+            }
+        });
+    auto start = steady_clock::now();
+    for (size_t i = 0; i < nwrite; i++)
+    {
+        std::this_thread::sleep_until(
+            start + std::chrono::duration_cast<steady_clock::duration>(
+                        std::chrono::duration<double>(interval * i)));
+        auto t = steady_clock::now();
+        if (mode == SafetyLog::MODE_SYNC)
+        {
+            memcpy(&state[0], &i, sizeof i);
+            log.write(state.data(), state.size());
+            double d = since(t);
+            vote.add(d);
+            durable.add(d);
+            continue;
+        }
+        std::lock_guard<std::mutex> lk(m);
+        memcpy(&state[0], &i, sizeof i);
+        waiting.push_back(t);
+        if (mode == SafetyLog::MODE_ASYNC) vote.add(since(t));
+        cv.notify_one();
+    }
+    {
+        std::lock_guard<std::mutex> lk(m);
+        done = true;
+        cv.notify_one();
+    }
+    if (flusher.joinable()) flusher.join();
+    if (!error.empty()) throw std::runtime_error(error);
+}
+
+/* Measures, for each durability mode, the delay a vote waits for the safety
+ * state and the delay until the state is durable, through the page cache
+ * and with O_DIRECT, and checks that the latest state is recovered. The
+ * arguments are the number of votes and the interval between them (in
+ * microseconds). */
+int main(int argc, char **argv) {
+    const size_t nwrite = argc > 1 ? atol(argv[1]) : 1000;
+    const double interval = (argc > 2 ? atof(argv[2]) : 100) / 1e6;
+    for (bool direct: {false, true})
+        for (auto mode: {SafetyLog::MODE_SYNC, SafetyLog::MODE_GROUP, SafetyLog::MODE_ASYNC})
+        {
+            char path[] = "/tmp/hotstuff-safetylog-XXXXXX";
+            int tmp = mkstemp(path);
+            if (tmp < 0)
+                throw std::runtime_error("cannot create the log file");
+            close(tmp);
+            SafetyLog::Config config;
+            config.path = path;
+            config.mode = mode;
+            config.direct = direct;
+            std::string name = std::string(direct ? "direct" : "buffered") +
+                                "/" + SafetyLog::mode_name(mode);
+            LatencyHistogram vote, durable;
+            try {
+                SafetyLog log(config);
+                bytearray_t state;
+                log.recover(state);
+                run(log, mode, nwrite, interval, vote, durable);
+            } catch (std::runtime_error &err) {
+                /* e.g. O_DIRECT on tmpfs */
+                printf("%s: %s\n", name.c_str(), err.what());
+                unlink(path);
+                continue;
+            }
+            vote.print((name + " vote delay").c_str());
+            durable.print((name + " durable").c_str());
+
+            SafetyLog log(config);
+            bytearray_t recovered;
+            size_t last;
+            if (!log.recover(recovered) || recovered.size() != 400)
+                throw std::runtime_error("no state recovered");
+            memcpy(&last, &recovered[0], sizeof last);
+            if (last != nwrite - 1)
+                throw std::runtime_error("stale state recovered");
+            unlink(path);
+        }
+    return 0;
+}
@@ -0,0 +1,82 @@
+#include <chrono>
+#include <functional>
+#include <thread>
+#include <vector>
+
+#include "hotstuff/crypto.h"
+
+using namespace hotstuff;
+
+/* Measures signing and verification throughput from 1 to 32 threads, either
+ * all sharing one context or each using its own per-thread context. */
+static double run(size_t nthread, size_t niter,
+                const std::function<void()> &op) {
+    std::vector<std::thread> threads;
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < nthread; i++)
+        threads.emplace_back([&]() {
+            for (size_t k = 0; k < niter; k++) op();
+        });
+    for (auto &t: threads) t.join();
+    std::chrono::duration<double> elapsed =
+        std::chrono::steady_clock::now() - start;
+    return nthread * niter / elapsed.count();
+}
+
+int main() {
+    const size_t niter = 2000;
+    PrivKeySecp256k1 priv;
+    priv.from_rand();
+    PubKeySecp256k1 pub(priv);
+    bytearray_t msg(32);
+    msg[0] = 1;
+    SigSecp256k1 sig(uint256_t(msg), priv);
+
+    /* the raw secp256k1 objects, to drive the shared contexts directly */
+    Secp256k1Context shared_sign(true, true);
+    Secp256k1Context shared_verify(false);
+    DataStream s;
+    s << pub << sig;
+    secp256k1_pubkey raw_pub;
+    secp256k1_ecdsa_signature raw_sig;
+    if (!secp256k1_ec_pubkey_parse(shared_verify.get(), &raw_pub,
+                                    s.get_data_inplace(33), 33) ||
+        !secp256k1_ecdsa_signature_parse_compact(shared_verify.get(), &raw_sig,
+                                    s.get_data_inplace(64)))
+        throw std::runtime_error("cannot parse key or signature");
+    bytearray_t raw_priv;
+    {
+        DataStream ps;
+        ps << priv;
+        auto p = ps.get_data_inplace(32);
+        raw_priv = bytearray_t(p, p + 32);
+    }
+
+    printf("%8s %14s %14s %14s %14s\n", "nthread",
+            "sign/s shared", "sign/s local", "verify/s shared", "verify/s local");
+    for (size_t nthread: {1, 2, 4, 8, 16, 32})
+    {
+        double sign_shared = run(nthread, niter, [&]() {
+            secp256k1_ecdsa_signature out;
+            if (!secp256k1_ecdsa_sign(shared_sign.get(), &out, &msg[0],
+                                    &raw_priv[0], NULL, NULL))
+                throw std::runtime_error("signing failed");
+        });
+        double sign_local = run(nthread, niter, [&]() {
+            SigSecp256k1 out;
+            out.sign(msg, priv);
+        });
+        double verify_shared = run(nthread, niter, [&]() {
+            if (secp256k1_ecdsa_verify(shared_verify.get(), &raw_sig,
+                                        &msg[0], &raw_pub) != 1)
+                throw std::runtime_error("verification failed");
+        });
+        double verify_local = run(nthread, niter, [&]() {
+            if (!sig.verify(msg, pub))
+                throw std::runtime_error("verification failed");
+        });
+        printf("%8lu %14.0f %14.0f %14.0f %14.0f\n", nthread,
+                sign_shared, sign_local, verify_shared, verify_local);
+    }
+    return 0;
+}
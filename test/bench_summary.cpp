@@ -0,0 +1,142 @@
+#include <algorithm>
+#include <cstdlib>
+#include <random>
+#include <stdexcept>
+
+#include "hotstuff/entity.h"
+
+using namespace hotstuff;
+
+static uint256_t cmd_hash(uint32_t x) {
+    DataStream s;
+    s << htole(x);
+    return s.get_hash();
+}
+
+static OrderedList random_list(std::mt19937 &rng, uint32_t pool, size_t m) {
+    std::vector<uint32_t> ids;
+    for (uint32_t x = 0; x < pool; x++) ids.push_back(x);
+    std::shuffle(ids.begin(), ids.end(), rng);
+    ids.resize(std::min<size_t>(m, pool));
+    std::vector<uint256_t> cmds;
+    std::vector<uint64_t> timestamps;
+    for (auto x: ids)
+    {
+        cmds.push_back(cmd_hash(x));
+        timestamps.push_back(rng() % 1000000);
+    }
+    return OrderedList(cmds, timestamps);
+}
+
+/* the number of (sorted) orderings having a before b, or a but not b */
+static uint32_t count_before(const std::vector<OrderedList> &sorted,
+                            const uint256_t &a, const uint256_t &b) {
+    uint32_t cnt = 0;
+    for (const auto &l: sorted)
+        for (const auto &c: l.cmds)
+        {
+            if (c == a) { cnt++; break; }
+            if (c == b) break;
+        }
+    return cnt;
+}
+
+static PrecedenceMatrix roundtrip(const PrecedenceMatrix &m) {
+    DataStream s;
+    m.serialize(s);
+    PrecedenceMatrix out;
+    out.unserialize(s);
+    return out;
+}
+
+static size_t encoded_size(const PrecedenceMatrix &m) {
+    DataStream s;
+    m.serialize(s);
+    return s.size();
+}
+
+/* Checks that the summaries built directly, merged along random trees and
+ * sent over the wire (as orderings or as a matrix) give the same counts as
+ * the orderings themselves, and that malformed summaries are rejected. Then
+ * prints the encoded size of a summary of k orderings of m commands each. */
+int main(int argc, char **argv) {
+    const size_t niter = argc > 1 ? atol(argv[1]) : 300;
+    std::mt19937 rng(7);
+    for (size_t iter = 0; iter < niter; iter++)
+    {
+        size_t n = 1 + rng() % 20;
+        uint32_t pool = 5 + rng() % 15;
+        size_t m = 1 + rng() % 8;
+        std::vector<OrderedList> lists;
+        for (size_t r = 0; r < n; r++)
+            lists.push_back(random_list(rng, pool, m));
+        PrecedenceMatrix whole;
+        for (const auto &l: lists) whole.add(l);
+        std::vector<PrecedenceMatrix> parts(n);
+        for (size_t r = 0; r < n; r++) parts[r].add(lists[r]);
+        while (parts.size() > 1)
+        {
+            size_t a = rng() % parts.size(), b = rng() % parts.size();
+            if (a == b) continue;
+            parts[a].merge(roundtrip(parts[b]));
+            parts.erase(parts.begin() + b);
+        }
+        PrecedenceMatrix merged = roundtrip(parts[0]);
+        if (merged.get_total() != n)
+            throw std::runtime_error("wrong total");
+        auto sorted = lists;
+        for (auto &l: sorted) l.sort_cmds();
+        for (uint32_t x = 0; x < pool; x++)
+            for (uint32_t y = 0; y < pool; y++)
+            {
+                if (x == y) continue;
+                auto a = cmd_hash(x), b = cmd_hash(y);
+                uint32_t cnt = count_before(sorted, a, b);
+                if (whole.get_before(a, b) != cnt || merged.get_before(a, b) != cnt)
+                    throw std::runtime_error("count mismatch");
+            }
+    }
+
+    /* a count above the number of orderings (two orderings of 8 commands
+     * are already larger than their matrix) */
+    PrecedenceMatrix big;
+    std::vector<uint256_t> cmds;
+    std::vector<uint64_t> timestamps;
+    for (uint32_t x = 0; x < 8; x++)
+    {
+        cmds.push_back(cmd_hash(x));
+        timestamps.push_back(x);
+    }
+    big.add(OrderedList(cmds, timestamps));
+    big.add(OrderedList(cmds, timestamps));
+    if (big.is_raw())
+        throw std::runtime_error("a matrix was expected");
+    DataStream s;
+    big.serialize(s);
+    bytearray_t bytes(s.data(), s.data() + s.size());
+    /* the tag, the total, n, then the first command and its count */
+    bytes[1 + 4 + 4 + 32] = 3;
+    DataStream bad(bytes.begin(), bytes.end());
+    bool rejected = false;
+    try {
+        PrecedenceMatrix out;
+        out.unserialize(bad);
+    } catch (std::runtime_error &) {
+        rejected = true;
+    }
+    if (!rejected)
+        throw std::runtime_error("an invalid summary was accepted");
+    printf("ok\n");
+
+    printf("%6s %6s %12s %12s %8s\n", "k", "m", "list_bytes", "sent_bytes", "form");
+    for (size_t k: {1, 4, 16, 64})
+        for (size_t m: {1, 4, 16, 100, 400})
+        {
+            PrecedenceMatrix sum;
+            for (size_t r = 0; r < k; r++)
+                sum.add(random_list(rng, m, m));
+            printf("%6lu %6lu %12lu %12lu %8s\n", k, m, k * (4 + 40 * m),
+                    encoded_size(sum), sum.is_raw() ? "lists" : "matrix");
+        }
+    return 0;
+}
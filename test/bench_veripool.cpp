@@ -0,0 +1,39 @@
+#include <chrono>
+
+#include "hotstuff/crypto.h"
+
+using namespace hotstuff;
+
+/* Measures the throughput of VeriPool with different numbers of workers,
+ * reported as verifications per second in total and per worker. */
+int main() {
+    const size_t ntask = 20000;
+    PrivKeySecp256k1 priv;
+    priv.from_rand();
+    PubKeySecp256k1 pub(priv);
+    bytearray_t raw(32);
+    raw[0] = 1;
+    uint256_t msg(raw);
+    SigSecp256k1 sig(msg, priv);
+
+    printf("%8s %14s %14s\n", "nworker", "verify/s", "verify/s/core");
+    for (size_t nworker: {1, 2, 4, 8})
+    {
+        EventContext ec;
+        VeriPool vpool(ec, nworker);
+        size_t ndone = 0;
+        auto start = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < ntask; i++)
+            vpool.verify(new Secp256k1VeriTask(msg, pub, sig)).then([&](bool result) {
+                if (!result)
+                    throw std::runtime_error("verification failed");
+                if (++ndone == ntask) ec.stop();
+            });
+        ec.dispatch();
+        std::chrono::duration<double> elapsed =
+            std::chrono::steady_clock::now() - start;
+        double rate = ntask / elapsed.count();
+        printf("%8lu %14.0f %14.0f\n", nworker, rate, rate / nworker);
+    }
+    return 0;
+}